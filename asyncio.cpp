@@ -0,0 +1,523 @@
+#include "asyncio.h"
+#include "trace.h"
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+typedef std::chrono::steady_clock IoClock;
+
+/**
+ * one file being read or written.
+ */
+struct AsyncIO::Request
+{
+    std::string path;
+    bool writing{false};
+    int fd{-1};
+    PixelVector bytes;
+    size_t done{0};
+    iovec iov{nullptr, 0};
+    bool finished{false};
+    std::string error;
+
+    // keeps the request alive while the kernel or a thread works on it.
+    Handle self;
+};
+
+static int uringSetup(unsigned entries, io_uring_params *params)
+{
+#ifdef __NR_io_uring_setup
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int uringEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+#ifdef __NR_io_uring_enter
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * @param queue_depth operations in flight at once.
+ * @param use_io_uring false to always use the thread fallback.
+ */
+AsyncIO::AsyncIO(unsigned queue_depth, bool use_io_uring) : depth(queue_depth > 0 ? queue_depth : 1)
+{
+    if (use_io_uring && setup_ring())
+    {
+        threads.emplace_back(&AsyncIO::reap_loop, this);
+        return;
+    }
+    for (unsigned i = 0; i < depth; i++)
+    {
+        threads.emplace_back(&AsyncIO::transfer_loop, this);
+    }
+}
+
+/**
+ * finishes every request, then stops the threads and closes the ring.
+ */
+AsyncIO::~AsyncIO()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return pending.empty() && in_flight == 0; });
+        stopping = true;
+
+        // a no-op completion wakes the reaping thread up to see stopping.
+        if (ring_fd >= 0)
+        {
+            unsigned tail = *ring.sq_tail;
+            unsigned index = tail & *ring.sq_mask;
+            io_uring_sqe *sqe = static_cast<io_uring_sqe *>(ring.sqe_map) + index;
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_NOP;
+            ring.sq_array[index] = index;
+            __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+            in_flight++;
+            while (uringEnter(ring_fd, 1, 0, 0) < 0 && (errno == EINTR || errno == EAGAIN))
+            {
+            }
+        }
+    }
+    changed.notify_all();
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+
+    if (ring_fd >= 0)
+    {
+        if (ring.cq_map != ring.sq_map)
+        {
+            munmap(ring.cq_map, ring.cq_map_size);
+        }
+        munmap(ring.sq_map, ring.sq_map_size);
+        munmap(ring.sqe_map, ring.sqe_map_size);
+        close(ring_fd);
+    }
+}
+
+/**
+ * create the ring and map its queues; false if the kernel won't.
+ */
+bool AsyncIO::setup_ring()
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    // one entry more than the depth, for the no-op that stops the ring.
+    int fd = uringSetup(depth + 1, &params);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    ring.sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single_map = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_map)
+    {
+        ring.sq_map_size = ring.cq_map_size = std::max(ring.sq_map_size, ring.cq_map_size);
+    }
+    ring.sqe_map_size = params.sq_entries * sizeof(io_uring_sqe);
+
+    ring.sq_map = mmap(nullptr, ring.sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring.cq_map = single_map ? ring.sq_map
+                             : mmap(nullptr, ring.cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring.sqe_map = mmap(nullptr, ring.sqe_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring.sq_map == MAP_FAILED || ring.cq_map == MAP_FAILED || ring.sqe_map == MAP_FAILED)
+    {
+        if (ring.sq_map != MAP_FAILED)
+        {
+            munmap(ring.sq_map, ring.sq_map_size);
+        }
+        if (!single_map && ring.cq_map != MAP_FAILED)
+        {
+            munmap(ring.cq_map, ring.cq_map_size);
+        }
+        if (ring.sqe_map != MAP_FAILED)
+        {
+            munmap(ring.sqe_map, ring.sqe_map_size);
+        }
+        close(fd);
+        return false;
+    }
+
+    uint8_t *sq = static_cast<uint8_t *>(ring.sq_map);
+    ring.sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    ring.sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    ring.sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    ring.sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    uint8_t *cq = static_cast<uint8_t *>(ring.cq_map);
+    ring.cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    ring.cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    ring.cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    ring.cqes = cq + params.cq_off.cqes;
+    ring_fd = fd;
+    return true;
+}
+
+bool AsyncIO::uses_io_uring() const
+{
+    return ring_fd >= 0;
+}
+
+unsigned AsyncIO::queue_depth() const
+{
+    return depth;
+}
+
+/**
+ * start reading the whole file at path, once fewer than queue_depth reads are unfinished.
+ */
+AsyncIO::Handle AsyncIO::read(const std::string &path)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (unfinished_reads >= depth)
+        {
+            TRACE_SCOPE("io wait", 0);
+            IoClock::time_point start = IoClock::now();
+            changed.wait(lock, [this] { return unfinished_reads < depth; });
+            counters.stall_seconds += std::chrono::duration<double>(IoClock::now() - start).count();
+        }
+        unfinished_reads++;
+    }
+    return start(path, false, PixelVector());
+}
+
+/**
+ * start writing bytes to path, once fewer than queue_depth writes are unfinished.
+ */
+AsyncIO::Handle AsyncIO::write(const std::string &path, PixelVector &&bytes)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (unfinished_writes >= depth)
+        {
+            TRACE_SCOPE("io wait", 0);
+            IoClock::time_point start = IoClock::now();
+            changed.wait(lock, [this] { return unfinished_writes < depth; });
+            counters.stall_seconds += std::chrono::duration<double>(IoClock::now() - start).count();
+        }
+        unfinished_writes++;
+    }
+    return start(path, true, std::move(bytes));
+}
+
+/**
+ * open the file here and queue the transfer.
+ */
+AsyncIO::Handle AsyncIO::start(const std::string &path, bool writing, PixelVector &&bytes)
+{
+    Handle request = std::make_shared<Request>();
+    request->path = path;
+    request->writing = writing;
+
+    std::string error;
+    if (writing)
+    {
+        request->bytes = std::move(bytes);
+        request->fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (request->fd < 0)
+        {
+            error = "Unable to open the output image file.";
+        }
+    }
+    else
+    {
+        struct stat info;
+        request->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (request->fd < 0 || fstat(request->fd, &info) != 0)
+        {
+            error = "Unable to open the input image file.";
+        }
+        else
+        {
+            request->bytes.resize(static_cast<size_t>(info.st_size));
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!error.empty() || request->bytes.empty())
+    {
+        finish(*request, error);
+        return request;
+    }
+    pending.push_back(request);
+    if (ring_fd >= 0)
+    {
+        submit_pending();
+    }
+    else
+    {
+        changed.notify_all();
+    }
+    return request;
+}
+
+/**
+ * mark a request done, with an error message if it failed. Called with
+ * mutex held.
+ */
+void AsyncIO::finish(Request &request, const std::string &error)
+{
+    if (request.fd >= 0)
+    {
+        if (close(request.fd) != 0 && error.empty() && request.writing)
+        {
+            request.error = "Unable to write the output image file.";
+        }
+        request.fd = -1;
+    }
+    if (!error.empty())
+    {
+        request.error = error;
+    }
+    if (request.writing)
+    {
+        unfinished_writes--;
+    }
+    else
+    {
+        unfinished_reads--;
+    }
+    if (request.error.empty())
+    {
+        if (request.writing)
+        {
+            counters.writes++;
+            counters.bytes_written += request.bytes.size();
+        }
+        else
+        {
+            counters.reads++;
+            counters.bytes_read += request.bytes.size();
+        }
+    }
+    request.finished = true;
+    changed.notify_all();
+}
+
+/**
+ * block until the request is done and hand back its bytes.
+ */
+PixelVector AsyncIO::wait(const Handle &request)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!request->finished)
+    {
+        TRACE_SCOPE("io wait", 0);
+        IoClock::time_point start = IoClock::now();
+        changed.wait(lock, [&request] { return request->finished; });
+        counters.stall_seconds += std::chrono::duration<double>(IoClock::now() - start).count();
+    }
+    if (!request->error.empty())
+    {
+        throw std::runtime_error(request->error);
+    }
+    return std::move(request->bytes);
+}
+
+AsyncIO::Stats AsyncIO::stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
+
+/**
+ * move queued requests into the ring while fewer than depth are in it.
+ */
+void AsyncIO::submit_pending()
+{
+    while (in_flight < depth && !pending.empty())
+    {
+        Handle request = std::move(pending.front());
+        pending.pop_front();
+        request->self = request;
+        in_flight++;
+        submit(*request);
+    }
+}
+
+/**
+ * put the rest of the request's transfer into the ring and submit it.
+ */
+void AsyncIO::submit(Request &request)
+{
+    request.iov.iov_base = request.bytes.data() + request.done;
+    request.iov.iov_len = request.bytes.size() - request.done;
+
+    unsigned tail = *ring.sq_tail;
+    unsigned index = tail & *ring.sq_mask;
+    io_uring_sqe *sqe = static_cast<io_uring_sqe *>(ring.sqe_map) + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = request.writing ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = request.fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&request.iov);
+    sqe->len = 1;
+    sqe->off = request.done;
+    sqe->user_data = reinterpret_cast<uint64_t>(&request);
+    ring.sq_array[index] = index;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    int submitted;
+    while ((submitted = uringEnter(ring_fd, 1, 0, 0)) < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY))
+    {
+    }
+    if (submitted < 0)
+    {
+        // the kernel never saw the entry, so take it back.
+        __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+        in_flight--;
+        Handle keep = std::move(request.self);
+        finish(*keep, std::string("Unable to queue ") + request.path + ": " + strerror(errno));
+    }
+}
+
+/**
+ * wait for completions, resubmit short transfers and finish the rest.
+ */
+void AsyncIO::reap_loop()
+{
+    for (;;)
+    {
+        uringEnter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            const io_uring_cqe *cqe = static_cast<const io_uring_cqe *>(ring.cqes) + (head & *ring.cq_mask);
+            Request *request = reinterpret_cast<Request *>(cqe->user_data);
+            const int result = cqe->res;
+            in_flight--;
+            if (!request)
+            {
+                continue;
+            }
+
+            std::string error;
+            if (result == -EINTR || result == -EAGAIN)
+            {
+                in_flight++;
+                submit(*request);
+                continue;
+            }
+            if (result < 0)
+            {
+                error = request->path + ": " + strerror(-result);
+            }
+            else if (result == 0)
+            {
+                error = request->path + ": unexpected end of file";
+            }
+            else
+            {
+                request->done += static_cast<size_t>(result);
+                if (request->done < request->bytes.size())
+                {
+                    in_flight++;
+                    submit(*request);
+                    continue;
+                }
+            }
+            Handle keep = std::move(request->self);
+            finish(*keep, error);
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+        submit_pending();
+        if (stopping && in_flight == 0)
+        {
+            return;
+        }
+    }
+}
+
+/**
+ * take queued requests and transfer them with blocking calls.
+ */
+void AsyncIO::transfer_loop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;)
+    {
+        changed.wait(lock, [this] { return stopping || !pending.empty(); });
+        if (pending.empty())
+        {
+            return;
+        }
+        Handle request = std::move(pending.front());
+        pending.pop_front();
+        in_flight++;
+        lock.unlock();
+
+        std::string error;
+        while (request->done < request->bytes.size())
+        {
+            uint8_t *bytes = request->bytes.data() + request->done;
+            size_t left = request->bytes.size() - request->done;
+            ssize_t result = request->writing ? pwrite(request->fd, bytes, left, request->done)
+                                              : pread(request->fd, bytes, left, request->done);
+            if (result < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (result <= 0)
+            {
+                error = request->path + ": " + (result < 0 ? strerror(errno) : "unexpected end of file");
+                break;
+            }
+            request->done += static_cast<size_t>(result);
+        }
+
+        lock.lock();
+        in_flight--;
+        finish(*request, error);
+    }
+}
+
+MemoryStreamBuf::MemoryStreamBuf(const uint8_t *bytes, size_t size)
+{
+    char *begin = const_cast<char *>(reinterpret_cast<const char *>(bytes));
+    setg(begin, begin, begin + size);
+}
+
+MemoryStreamBuf::pos_type MemoryStreamBuf::seekoff(off_type offset, std::ios_base::seekdir dir, std::ios_base::openmode which)
+{
+    if (!(which & std::ios_base::in))
+    {
+        return pos_type(off_type(-1));
+    }
+    char *base = dir == std::ios_base::beg ? eback() : dir == std::ios_base::cur ? gptr() : egptr();
+    if (offset < eback() - base || offset > egptr() - base)
+    {
+        return pos_type(off_type(-1));
+    }
+    setg(eback(), base + offset, egptr());
+    return pos_type(gptr() - eback());
+}
+
+MemoryStreamBuf::pos_type MemoryStreamBuf::seekpos(pos_type position, std::ios_base::openmode which)
+{
+    return seekoff(off_type(position), std::ios_base::beg, which);
+}
@@ -0,0 +1,142 @@
+#ifndef ASYNCIO_H
+#define ASYNCIO_H
+
+#include "bufferpool.h"
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Whole-file reads and writes that run in the background, so a batch
+ * can fetch the next images and write back finished ones while the
+ * current ones are filtered.
+ *
+ * Requests go to io_uring where the kernel offers it, with at most
+ * queue_depth operations in the kernel at a time, and a thread reaping
+ * completions. Elsewhere queue_depth threads do blocking reads and
+ * writes instead. Opening a file happens in the caller, the transfer
+ * in the background.
+ */
+class AsyncIO
+{
+public:
+    struct Request;
+    typedef std::shared_ptr<Request> Handle;
+
+    struct Stats
+    {
+        uint64_t reads{0};          // files read
+        uint64_t writes{0};         // files written
+        uint64_t bytes_read{0};
+        uint64_t bytes_written{0};
+        double stall_seconds{0};    // time callers spent blocked in wait(), read() and write()
+    };
+
+    /**
+     * @param queue_depth operations in flight at once.
+     * @param use_io_uring false to always use the thread fallback.
+     */
+    explicit AsyncIO(unsigned queue_depth = 8, bool use_io_uring = true);
+
+    /**
+     * finishes every request before returning.
+     */
+    ~AsyncIO();
+
+    AsyncIO(const AsyncIO &) = delete;
+    AsyncIO &operator=(const AsyncIO &) = delete;
+
+    /**
+     * true if requests go through io_uring rather than threads.
+     */
+    bool uses_io_uring() const;
+
+    unsigned queue_depth() const;
+
+    /**
+     * start reading the whole file at path. Blocks while queue_depth
+     * reads are already unfinished, so files waiting to be read can't
+     * pile up open and buffered without bound.
+     */
+    Handle read(const std::string &path);
+
+    /**
+     * start writing bytes to the file at path, replacing it. Blocks while
+     * queue_depth writes are already unfinished, so output waiting for
+     * the disk can't pile up without bound.
+     */
+    Handle write(const std::string &path, PixelVector &&bytes);
+
+    /**
+     * block until the request is done.
+     *
+     * @return the file contents for a read, the written bytes for a write.
+     *
+     * @throws runtime_error if the file could not be opened, read or written.
+     */
+    PixelVector wait(const Handle &request);
+
+    Stats stats() const;
+
+private:
+    unsigned depth;
+    int ring_fd{-1};
+
+    // io_uring rings, mapped from ring_fd.
+    struct Ring
+    {
+        void *sq_map{nullptr};
+        size_t sq_map_size{0};
+        void *cq_map{nullptr};
+        size_t cq_map_size{0};
+        void *sqe_map{nullptr};
+        size_t sqe_map_size{0};
+        unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        void *cqes;
+    } ring;
+
+    mutable std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<Handle> pending;
+    std::vector<std::thread> threads;
+    unsigned in_flight{0};
+    unsigned unfinished_reads{0};
+    unsigned unfinished_writes{0};
+    bool stopping{false};
+    Stats counters;
+
+    bool setup_ring();
+    Handle start(const std::string &path, bool writing, PixelVector &&bytes);
+    void finish(Request &request, const std::string &error);
+
+    // io_uring backend, called with mutex held.
+    void submit_pending();
+    void submit(Request &request);
+    void reap_loop();
+
+    // thread backend.
+    void transfer_loop();
+};
+
+/**
+ * A read-only stream buffer over bytes in memory, for parsing a file
+ * that was read with AsyncIO through operator>>. Supports seeking.
+ */
+class MemoryStreamBuf : public std::streambuf
+{
+public:
+    MemoryStreamBuf(const uint8_t *bytes, size_t size);
+
+protected:
+    pos_type seekoff(off_type offset, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+    pos_type seekpos(pos_type position, std::ios_base::openmode which) override;
+};
+
+#endif
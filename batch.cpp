@@ -0,0 +1,355 @@
+#include "batch.h"
+#include "asyncio.h"
+#include "threadpool.h"
+#include "tilecache.h"
+#include "trace.h"
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdio.h>
+
+typedef std::chrono::steady_clock BatchClock;
+
+static double secondsSince(BatchClock::time_point start)
+{
+    return std::chrono::duration<double>(BatchClock::now() - start).count();
+}
+
+/**
+ * read a manifest with one "input output" job per line.
+ *
+ * @throws runtime_error if the manifest can't be read or a line has no output.
+ */
+std::vector<BatchJob> readManifest(const std::string &path)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        throw std::runtime_error("Unable to open the manifest " + path);
+    }
+
+    std::vector<BatchJob> jobs;
+    std::string line;
+    for (size_t number = 1; std::getline(in, line); number++)
+    {
+        std::istringstream fields(line);
+        BatchJob job;
+        if (!(fields >> job.input) || job.input[0] == '#')
+        {
+            continue;
+        }
+        if (!(fields >> job.output))
+        {
+            throw std::runtime_error(path + ":" + std::to_string(number) + ": missing output path");
+        }
+        jobs.push_back(job);
+    }
+    return jobs;
+}
+
+/**
+ * a job for every .bmp file in input_dir, written under the same name to output_dir.
+ *
+ * @throws runtime_error if a directory can't be read or created.
+ */
+std::vector<BatchJob> listDirectory(const std::string &input_dir, const std::string &output_dir)
+{
+    namespace fs = std::filesystem;
+    std::vector<BatchJob> jobs;
+    try
+    {
+        fs::create_directories(output_dir);
+        for (const fs::directory_entry &entry : fs::directory_iterator(input_dir))
+        {
+            std::string extension = entry.path().extension().string();
+            std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+            if (entry.is_regular_file() && extension == ".bmp")
+            {
+                jobs.push_back({entry.path().string(), (fs::path(output_dir) / entry.path().filename()).string()});
+            }
+        }
+    }
+    catch (const fs::filesystem_error &ex)
+    {
+        throw std::runtime_error(ex.what());
+    }
+    std::sort(jobs.begin(), jobs.end(), [](const BatchJob &a, const BatchJob &b) { return a.input < b.input; });
+    return jobs;
+}
+
+static void filterImage(const FilterChain &chain, uint32_t band_rows, TileCache *cache, Bitmap &bitmap, BatchResult &result)
+{
+    BatchClock::time_point start = BatchClock::now();
+    if (cache)
+    {
+        cache->run(chain, bitmap, band_rows);
+    }
+    else
+    {
+        chain.run(bitmap, band_rows);
+    }
+    result.width = bitmap.bmp_info_header.width;
+    result.height = bitmap.bmp_info_header.height;
+    result.filter_seconds = secondsSince(start);
+}
+
+/**
+ * read, filter and write one image with the worker's bitmap.
+ */
+static void processImage(const BatchJob &job, const FilterChain &chain, uint32_t band_rows, TileCache *cache,
+                         Bitmap &bitmap, BatchResult &result)
+{
+    TRACE_SCOPE("image", 0);
+    BatchClock::time_point start = BatchClock::now();
+    {
+        std::ifstream in(job.input, std::ios_base::binary);
+        if (!in)
+        {
+            throw std::runtime_error("Unable to open the input image file.");
+        }
+        if (!(in >> bitmap))
+        {
+            throw std::runtime_error("Unable to read the input image file.");
+        }
+        result.bytes_in = static_cast<uint64_t>(in.tellg());
+        TRACE_BYTES(result.bytes_in);
+    }
+    result.read_seconds = secondsSince(start);
+
+    filterImage(chain, band_rows, cache, bitmap, result);
+
+    start = BatchClock::now();
+    result.bytes_out = bitmap.save(job.output);
+    result.write_seconds = secondsSince(start);
+}
+
+/**
+ * filter an image that io has read and queue the result for write-back.
+ * read_done is called once the read is over, to start the next one.
+ *
+ * @return the write, to wait on once the batch is done.
+ */
+static AsyncIO::Handle processPrefetched(const BatchJob &job, AsyncIO &io, const AsyncIO::Handle &read,
+                                         const std::function<void()> &read_done,
+                                         const FilterChain &chain, uint32_t band_rows, TileCache *cache,
+                                         Bitmap &bitmap, BatchResult &result)
+{
+    TRACE_SCOPE("image", 0);
+    BatchClock::time_point start = BatchClock::now();
+    {
+        PixelVector file;
+        try
+        {
+            file = io.wait(read);
+        }
+        catch (...)
+        {
+            read_done();
+            throw;
+        }
+        read_done();
+        MemoryStreamBuf buffer(file.data(), file.size());
+        std::istream in(&buffer);
+        if (!(in >> bitmap))
+        {
+            throw std::runtime_error("Unable to read the input image file.");
+        }
+        result.bytes_in = file.size();
+        TRACE_BYTES(result.bytes_in);
+    }
+    result.read_seconds = secondsSince(start);
+
+    filterImage(chain, band_rows, cache, bitmap, result);
+
+    start = BatchClock::now();
+    PixelVector file;
+    bitmap.encode(file);
+    result.bytes_out = file.size();
+    AsyncIO::Handle write = io.write(job.output, std::move(file));
+    result.write_seconds = secondsSince(start);
+    return write;
+}
+
+/**
+ * run the chain over every job on a work-stealing pool.
+ */
+BatchReport processBatch(const std::vector<BatchJob> &jobs, const FilterChain &chain,
+                         unsigned threads, uint32_t band_rows, unsigned prefetch, TileCache *cache)
+{
+    if (threads == 0)
+    {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    BatchReport report;
+    report.threads = threads;
+    report.images.resize(jobs.size());
+
+    BatchClock::time_point start = BatchClock::now();
+    {
+        std::unique_ptr<AsyncIO> io;
+        std::vector<AsyncIO::Handle> reads;
+        std::vector<AsyncIO::Handle> writes;
+        std::mutex read_mutex;
+        size_t next_read = 0;
+        unsigned outstanding = 0;   // reads started and not yet taken by their job
+        std::vector<uint8_t> taken; // jobs that started their own read
+        if (prefetch > 0)
+        {
+            io.reset(new AsyncIO(prefetch));
+            reads.resize(jobs.size());
+            writes.resize(jobs.size());
+            taken.resize(jobs.size());
+        }
+
+        // start reads in job order while fewer than prefetch are outstanding.
+        auto readAhead = [&]() {
+            std::lock_guard<std::mutex> lock(read_mutex);
+            for (; next_read < jobs.size() && outstanding < prefetch; next_read++)
+            {
+                if (!taken[next_read])
+                {
+                    reads[next_read] = io->read(jobs[next_read].input);
+                    outstanding++;
+                }
+            }
+        };
+
+        // the read of job i, started by readAhead or, for a job reached
+        // before its turn came, by the job itself.
+        auto takeRead = [&](size_t i) {
+            AsyncIO::Handle read;
+            {
+                std::lock_guard<std::mutex> lock(read_mutex);
+                taken[i] = 1;
+                if (reads[i])
+                {
+                    read.swap(reads[i]);
+                    outstanding--;
+                }
+            }
+            return read ? read : io->read(jobs[i].input);
+        };
+        if (io)
+        {
+            readAhead();
+        }
+
+        // with an image for every worker, the filters' loops run on their
+        // worker; spread over the shared pool as well, they would keep
+        // about twice as many threads as cores busy.
+        const bool serial_filters = jobs.size() >= threads;
+
+        // a bitmap per worker, so its buffers are reused from one image to the next.
+        std::vector<Bitmap> bitmaps(threads);
+        WorkStealingPool pool(threads);
+        for (size_t i = 0; i < jobs.size(); i++)
+        {
+            pool.submit([&, i](unsigned worker) {
+                ThreadPool::SerialScope serial(serial_filters);
+                BatchResult &result = report.images[i];
+                result.input = jobs[i].input;
+                result.output = jobs[i].output;
+                result.worker = worker;
+                try
+                {
+                    if (io)
+                    {
+                        writes[i] = processPrefetched(jobs[i], *io, takeRead(i), readAhead, chain, band_rows, cache,
+                                                      bitmaps[worker], result);
+                    }
+                    else
+                    {
+                        processImage(jobs[i], chain, band_rows, cache, bitmaps[worker], result);
+                    }
+                    result.ok = true;
+                }
+                catch (const std::exception &ex)
+                {
+                    result.error = ex.what();
+                }
+            });
+        }
+        pool.wait();
+
+        if (io)
+        {
+            for (size_t i = 0; i < writes.size(); i++)
+            {
+                try
+                {
+                    if (writes[i])
+                    {
+                        io->wait(writes[i]);
+                    }
+                }
+                catch (const std::exception &ex)
+                {
+                    report.images[i].ok = false;
+                    report.images[i].error = ex.what();
+                }
+            }
+            report.prefetch = prefetch;
+            report.io_uring = io->uses_io_uring();
+            report.io_stall_seconds = io->stats().stall_seconds;
+        }
+    }
+    report.wall_seconds = secondsSince(start);
+
+    for (const BatchResult &result : report.images)
+    {
+        if (!result.ok)
+        {
+            report.failed++;
+            continue;
+        }
+        report.bytes_in += result.bytes_in;
+        report.bytes_out += result.bytes_out;
+        report.pixels += static_cast<uint64_t>(result.width) * result.height;
+    }
+    return report;
+}
+
+/**
+ * print a line per image followed by the aggregate throughput.
+ */
+void BatchReport::print(std::ostream &out, bool per_image) const
+{
+    char line[512];
+    if (per_image)
+    {
+        for (const BatchResult &result : images)
+        {
+            if (!result.ok)
+            {
+                out << "FAILED " << result.input << ": " << result.error << "\n";
+                continue;
+            }
+            double seconds = result.read_seconds + result.filter_seconds + result.write_seconds;
+            snprintf(line, sizeof(line), "%s %dx%d read %.2f ms filter %.2f ms write %.2f ms %.1f MB/s (worker %u)\n",
+                     result.input.c_str(), result.width, result.height,
+                     result.read_seconds * 1e3, result.filter_seconds * 1e3, result.write_seconds * 1e3,
+                     seconds > 0 ? (result.bytes_in + result.bytes_out) / seconds / 1e6 : 0.0, result.worker);
+            out << line;
+        }
+    }
+
+    size_t done = images.size() - failed;
+    double wall = wall_seconds > 0 ? wall_seconds : 1e-9;
+    snprintf(line, sizeof(line),
+             "%zu images (%zu failed) on %u threads in %.3f s: %.1f images/s, %.1f MB/s, %.1f Mpixels/s\n",
+             done, failed, threads, wall_seconds, done / wall, (bytes_in + bytes_out) / wall / 1e6, pixels / wall / 1e6);
+    out << line;
+
+    if (prefetch > 0)
+    {
+        snprintf(line, sizeof(line), "async I/O through %s, %u files ahead: workers waited %.3f s\n",
+                 io_uring ? "io_uring" : "threads", prefetch, io_stall_seconds);
+        out << line;
+    }
+}
@@ -0,0 +1,113 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "bitmap.h"
+#include "tilecache.h"
+#include <stdint.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/**
+ * one image of a batch: where to read it and where to write the result.
+ */
+struct BatchJob
+{
+    std::string input;
+    std::string output;
+};
+
+/**
+ * what happened to one image of a batch. Times are in seconds.
+ */
+struct BatchResult
+{
+    std::string input;
+    std::string output;
+    bool ok{false};
+    std::string error;
+    int32_t width{0};
+    int32_t height{0};
+    uint64_t bytes_in{0};
+    uint64_t bytes_out{0};
+    double read_seconds{0};
+    double filter_seconds{0};
+    double write_seconds{0};
+    unsigned worker{0};
+};
+
+/**
+ * per-image results, in the order of the jobs, and the totals of a batch.
+ */
+struct BatchReport
+{
+    std::vector<BatchResult> images;
+    unsigned threads{0};
+    double wall_seconds{0};
+    uint64_t bytes_in{0};
+    uint64_t bytes_out{0};
+    uint64_t pixels{0};
+    size_t failed{0};
+
+    // files read ahead, 0 when images were read as they were reached.
+    unsigned prefetch{0};
+    bool io_uring{false};
+    double io_stall_seconds{0};
+
+    /**
+     * print a line per image followed by the aggregate throughput.
+     */
+    void print(std::ostream &out, bool per_image = true) const;
+};
+
+/**
+ * read a manifest with one job per line: the input path, whitespace and
+ * the output path. Blank lines and lines starting with '#' are skipped.
+ *
+ * @throws runtime_error if the manifest can't be read or a line has no output.
+ */
+std::vector<BatchJob> readManifest(const std::string &path);
+
+/**
+ * a job for every .bmp file in input_dir, written under the same name
+ * to output_dir, which is created if needed. Sorted by name.
+ *
+ * @throws runtime_error if a directory can't be read or created.
+ */
+std::vector<BatchJob> listDirectory(const std::string &input_dir, const std::string &output_dir);
+
+/**
+ * Run the chain over every job on a work-stealing pool, one image per
+ * task. Each worker keeps one Bitmap and reuses its buffers for all the
+ * images it handles, and while one worker waits on a read or a write the
+ * others keep filtering. A failing image is reported and doesn't stop
+ * the batch.
+ *
+ * When there are at least as many jobs as threads, whole images keep
+ * every worker busy, so the filters run their loops on their own worker
+ * instead of also spreading them over ThreadPool::shared(), which would
+ * keep up to twice as many threads as cores runnable. A smaller batch
+ * leaves workers idle, and its images still use the shared pool.
+ *
+ * With prefetch, up to prefetch files are read ahead through AsyncIO, in
+ * job order, while the current images are filtered. A new read starts
+ * only once a job has got its own input, so no more than prefetch files
+ * wait in memory however long the batch. Finished images are queued for
+ * write-back instead of written by the worker, so the I/O overlaps the
+ * filtering. read_seconds is then the time a worker waited for its
+ * input, write_seconds the time spent encoding and queueing the output,
+ * and io_stall_seconds the total time workers waited on AsyncIO.
+ *
+ * @param threads workers, 0 for one per hardware thread.
+ * @param band_rows passed to FilterChain::run.
+ * @param prefetch files read ahead, which is also the queue depth of
+ *                 the reads and of the writes, 0 to read and write each
+ *                 image in its worker.
+ * @param cache if given, images are filtered through it, so images and
+ *              tiles seen before are not filtered again.
+ */
+BatchReport processBatch(const std::vector<BatchJob> &jobs, const FilterChain &chain,
+                         unsigned threads = 0, uint32_t band_rows = 0, unsigned prefetch = 0,
+                         TileCache *cache = nullptr);
+
+#endif
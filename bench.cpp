@@ -0,0 +1,454 @@
+#include "asyncio.h"
+#include "bitmap.h"
+#include "bufferpool.h"
+#include "simd.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/**
+ * Benchmarks of reading, writing and every filter on synthetic 24 and
+ * 32 bit images of several sizes, odd widths among them so the padding
+ * paths run too. Each benchmark repeats until it has run for the
+ * minimum time and reports time, throughput, cycles and allocations
+ * per iteration as a table, and as JSON with --json (- for stdout
+ * instead of the table).
+ *
+ *   bitmap_bench [--min-time=SECONDS] [--filter=SUBSTRING] [--sizes=WxH,...] [--json=FILE]
+ */
+
+static std::atomic<uint64_t> allocations{0};
+static std::atomic<uint64_t> allocated_bytes{0};
+
+void *operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (void *p = malloc(size ? size : 1))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new(size_t size, std::align_val_t align)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    size_t alignment = static_cast<size_t>(align);
+    if (void *p = aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept
+{
+    free(p);
+}
+
+typedef std::chrono::steady_clock BenchClock;
+
+static uint64_t cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/**
+ * totals over the timed part of every iteration.
+ */
+struct Measurement
+{
+    uint64_t iterations{0};
+    double seconds{0};
+    uint64_t cycles{0};
+    uint64_t allocations{0};
+    uint64_t allocated_bytes{0};
+    uint64_t pool_maps{0};
+};
+
+/**
+ * Time op, allocations and pool blocks included, leaving out what
+ * happens outside it.
+ */
+template <typename Op>
+static void measure(Measurement &m, Op &&op)
+{
+    const uint64_t allocations_before = allocations.load(std::memory_order_relaxed);
+    const uint64_t bytes_before = allocated_bytes.load(std::memory_order_relaxed);
+    const uint64_t maps_before = BufferPool::shared().stats().misses;
+    const BenchClock::time_point start = BenchClock::now();
+    const uint64_t cycles_before = cycles();
+
+    op();
+
+    m.cycles += cycles() - cycles_before;
+    m.seconds += std::chrono::duration<double>(BenchClock::now() - start).count();
+    m.pool_maps += BufferPool::shared().stats().misses - maps_before;
+    m.allocated_bytes += allocated_bytes.load(std::memory_order_relaxed) - bytes_before;
+    m.allocations += allocations.load(std::memory_order_relaxed) - allocations_before;
+    m.iterations++;
+}
+
+struct Result
+{
+    std::string name;
+    uint32_t width;
+    uint32_t height;
+    uint32_t bits;
+    uint64_t bytes;  // bytes processed per iteration
+    uint64_t pixels; // pixels processed per iteration
+    Measurement m;
+};
+
+/**
+ * A BMP file of the given size: smooth gradients with some noise, so
+ * filters and encoders see neither flat nor random pixels.
+ */
+static std::string syntheticFile(uint32_t width, uint32_t height, uint32_t bits)
+{
+    const uint32_t bpp = bits / 8;
+    const uint32_t stride = (width * bpp + 3) & ~3u;
+    BMPFileHeader file;
+    BMPInfoHeader info;
+    BMPColorHeader color;
+    info.size = sizeof(BMPInfoHeader) + (bits == 32 ? sizeof(BMPColorHeader) : 0);
+    file.file_type = 0x4D42;
+    file.offset_data = sizeof(BMPFileHeader) + info.size;
+    file.file_size = file.offset_data + stride * height;
+    info.width = width;
+    info.height = height;
+    info.planes = 1;
+    info.bit_count = bits;
+    info.compression = bits == 32 ? 3 : 0;
+    info.size_image = stride * height;
+
+    std::string bytes;
+    bytes.append((const char *)&file, sizeof(file));
+    bytes.append((const char *)&info, sizeof(info));
+    if (bits == 32)
+    {
+        bytes.append((const char *)&color, sizeof(color));
+    }
+
+    uint32_t seed = 12345;
+    std::string row(stride, '\0');
+    for (uint32_t y = 0; y < height; y++)
+    {
+        for (uint32_t x = 0; x < width; x++)
+        {
+            seed = seed * 1664525 + 1013904223;
+            uint8_t *p = (uint8_t *)&row[x * bpp];
+            p[0] = static_cast<uint8_t>(x * 255 / width + (seed >> 28));
+            p[1] = static_cast<uint8_t>(y * 255 / height + ((seed >> 24) & 15));
+            p[2] = static_cast<uint8_t>((x + y) * 127 / (width + height) + ((seed >> 20) & 15));
+            if (bpp == 4)
+            {
+                p[3] = 255;
+            }
+        }
+        bytes += row;
+    }
+    return bytes;
+}
+
+/**
+ * An output stream buffer that copies what is written to it into a
+ * small ring, standing in for the copy into the page cache, and keeps
+ * nothing.
+ */
+class NullBuffer : public std::streambuf
+{
+public:
+    uint64_t written{0};
+
+protected:
+    std::streamsize xsputn(const char *s, std::streamsize n) override
+    {
+        for (std::streamsize done = 0; done < n;)
+        {
+            size_t at = written % sizeof(ring);
+            size_t chunk = std::min<size_t>(n - done, sizeof(ring) - at);
+            memcpy(ring + at, s + done, chunk);
+            done += chunk;
+            written += chunk;
+        }
+        return n;
+    }
+
+    int_type overflow(int_type c) override
+    {
+        ring[written++ % sizeof(ring)] = static_cast<char>(c);
+        return traits_type::not_eof(c);
+    }
+
+private:
+    char ring[1 << 20];
+};
+
+struct BenchOptions
+{
+    double min_time{0.2};
+    std::string filter;
+    std::vector<std::pair<uint32_t, uint32_t>> sizes{{257, 131}, {1024, 768}, {1921, 1081}};
+    std::string json;
+};
+
+/**
+ * Run op once untimed, then timed until min_time has passed. prepare
+ * runs before each iteration, outside the timing.
+ */
+template <typename Prepare, typename Op>
+static Measurement run(const BenchOptions &options, Prepare &&prepare, Op &&op)
+{
+    prepare();
+    op();
+    Measurement m;
+    while (m.seconds < options.min_time || m.iterations == 0)
+    {
+        prepare();
+        measure(m, op);
+    }
+    return m;
+}
+
+static Bitmap parse(const std::string &file)
+{
+    std::istringstream in(file);
+    Bitmap b;
+    if (!(in >> b))
+    {
+        throw std::runtime_error("Unable to read the synthetic image.");
+    }
+    return b;
+}
+
+static void benchImage(const BenchOptions &options, uint32_t width, uint32_t height, uint32_t bits, std::vector<Result> &results)
+{
+    const std::string file = syntheticFile(width, height, bits);
+    const Bitmap source = parse(file);
+    const uint64_t pixels = static_cast<uint64_t>(width) * height;
+    const uint64_t pixel_bytes = pixels * (bits / 8);
+    const std::string suffix = "/" + std::to_string(width) + "x" + std::to_string(height) + "/" + std::to_string(bits);
+    Bitmap work;
+
+    auto wanted = [&](const std::string &name) {
+        return options.filter.empty() || (name + suffix).find(options.filter) != std::string::npos;
+    };
+    auto record = [&](const std::string &name, uint64_t bytes, const Measurement &m) {
+        results.push_back(Result{name + suffix, width, height, bits, bytes, pixels, m});
+    };
+
+    if (wanted("read"))
+    {
+        record("read", file.size(), run(options, [] {}, [&] {
+                   MemoryStreamBuf buffer((const uint8_t *)file.data(), file.size());
+                   std::istream in(&buffer);
+                   in >> work;
+               }));
+    }
+    if (wanted("write"))
+    {
+        work = source;
+        work.output_encoding = OutputEncoding::TrueColor;
+        std::unique_ptr<NullBuffer> sink(new NullBuffer());
+        std::ostream out(sink.get());
+        record("write", file.size(), run(options, [] {}, [&] { out << work; }));
+    }
+    if (wanted("write_auto"))
+    {
+        // grayscale first, so the encoder has a palette to find.
+        Bitmap gray = source;
+        grayscale(gray);
+        PixelVector encoded;
+        record("write_auto", pixel_bytes, run(options, [] {}, [&] { gray.encode(encoded); }));
+    }
+
+    struct Filter
+    {
+        const char *name;
+        std::function<void(Bitmap &)> apply;
+    };
+    const Filter filters[] = {
+        {"grayscale", [](Bitmap &b) { grayscale(b); }},
+        {"cellShade", [](Bitmap &b) { cellShade(b); }},
+        {"pixelate", [](Bitmap &b) { pixelate(b); }},
+        {"blur", [](Bitmap &b) { blur(b); }},
+        {"gaussianBlur", [](Bitmap &b) { gaussianBlur(b, 2.0); }},
+        {"rot90", [](Bitmap &b) { rot90(b); }},
+        {"rot180", [](Bitmap &b) { rot180(b); }},
+        {"rot270", [](Bitmap &b) { rot270(b); }},
+        {"flipv", [](Bitmap &b) { flipv(b); }},
+        {"fliph", [](Bitmap &b) { fliph(b); }},
+        {"flipd1", [](Bitmap &b) { flipd1(b); }},
+        {"flipd2", [](Bitmap &b) { flipd2(b); }},
+        {"scaleUp", [](Bitmap &b) { scaleUp(b); }},
+        {"scaleDown", [](Bitmap &b) { scaleDown(b); }},
+        {"resize_half", [](Bitmap &b) { resize(b, b.bmp_info_header.width / 2 + 1, b.bmp_info_header.height / 2 + 1); }},
+    };
+    for (const Filter &filter : filters)
+    {
+        if (wanted(filter.name))
+        {
+            record(filter.name, pixel_bytes, run(options, [&] { work = source; }, [&] { filter.apply(work); }));
+        }
+    }
+}
+
+static void printConsole(std::ostream &out, const std::vector<Result> &results)
+{
+    char line[256];
+    snprintf(line, sizeof(line), "%-32s %10s %12s %10s %11s %10s %10s %10s\n",
+             "benchmark", "iterations", "time/iter", "MB/s", "Mpixels/s", "cyc/pixel", "allocs", "pool maps");
+    out << line;
+    for (const Result &r : results)
+    {
+        const Measurement &m = r.m;
+        const double per_iteration = m.seconds / m.iterations;
+        snprintf(line, sizeof(line), "%-32s %10llu %9.3f ms %10.1f %11.1f %10.2f %10.1f %10.1f\n",
+                 r.name.c_str(), (unsigned long long)m.iterations, per_iteration * 1e3,
+                 r.bytes / per_iteration / 1e6, r.pixels / per_iteration / 1e6,
+                 double(m.cycles) / m.iterations / r.pixels,
+                 double(m.allocations) / m.iterations, double(m.pool_maps) / m.iterations);
+        out << line;
+    }
+}
+
+static void printJson(std::ostream &out, const std::vector<Result> &results)
+{
+    const char *levels[] = {"scalar", "sse", "avx2"};
+    out << "{\n  \"context\": {\n"
+        << "    \"threads\": " << std::thread::hardware_concurrency() << ",\n"
+        << "    \"simd\": \"" << levels[static_cast<int>(simdLevel())] << "\",\n"
+        << "    \"compiler\": \"" << __VERSION__ << "\"\n  },\n  \"benchmarks\": [\n";
+    char line[1024];
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const Result &r = results[i];
+        const Measurement &m = r.m;
+        const double per_iteration = m.seconds / m.iterations;
+        snprintf(line, sizeof(line),
+                 "    {\"name\": \"%s\", \"width\": %u, \"height\": %u, \"bits\": %u, \"iterations\": %llu, "
+                 "\"real_time_ns\": %.0f, \"bytes_per_second\": %.0f, \"pixels_per_second\": %.0f, "
+                 "\"cycles_per_pixel\": %.3f, \"allocations_per_iteration\": %.2f, "
+                 "\"allocated_bytes_per_iteration\": %.0f, \"pool_maps_per_iteration\": %.2f}%s\n",
+                 r.name.c_str(), r.width, r.height, r.bits, (unsigned long long)m.iterations,
+                 per_iteration * 1e9, r.bytes / per_iteration, r.pixels / per_iteration,
+                 double(m.cycles) / m.iterations / r.pixels, double(m.allocations) / m.iterations,
+                 double(m.allocated_bytes) / m.iterations, double(m.pool_maps) / m.iterations,
+                 i + 1 < results.size() ? "," : "");
+        out << line;
+    }
+    out << "  ]\n}\n";
+}
+
+static BenchOptions parseOptions(int argc, char **argv)
+{
+    BenchOptions options;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        std::string value = arg.find('=') == std::string::npos ? "" : arg.substr(arg.find('=') + 1);
+        if (arg.rfind("--min-time=", 0) == 0)
+        {
+            options.min_time = atof(value.c_str());
+        }
+        else if (arg.rfind("--filter=", 0) == 0)
+        {
+            options.filter = value;
+        }
+        else if (arg.rfind("--sizes=", 0) == 0)
+        {
+            options.sizes.clear();
+            std::istringstream list(value);
+            std::string size;
+            while (std::getline(list, size, ','))
+            {
+                unsigned width = 0, height = 0;
+                if (sscanf(size.c_str(), "%ux%u", &width, &height) != 2 || width == 0 || height == 0)
+                {
+                    throw std::runtime_error("bad size " + size);
+                }
+                options.sizes.push_back({width, height});
+            }
+        }
+        else if (arg.rfind("--json=", 0) == 0)
+        {
+            options.json = value;
+        }
+        else
+        {
+            throw std::runtime_error("usage: bitmap_bench [--min-time=SECONDS] [--filter=SUBSTRING] "
+                                     "[--sizes=WxH,...] [--json=FILE]");
+        }
+    }
+    return options;
+}
+
+int main(int argc, char **argv)
+{
+    try
+    {
+        BenchOptions options = parseOptions(argc, argv);
+        std::vector<Result> results;
+        for (const std::pair<uint32_t, uint32_t> &size : options.sizes)
+        {
+            for (uint32_t bits : {24u, 32u})
+            {
+                benchImage(options, size.first, size.second, bits, results);
+            }
+        }
+
+        if (options.json == "-")
+        {
+            printJson(std::cout, results);
+            return 0;
+        }
+        printConsole(std::cout, results);
+        if (!options.json.empty())
+        {
+            std::ofstream file(options.json);
+            printJson(file, results);
+            if (!file)
+            {
+                throw std::runtime_error("Unable to write " + options.json);
+            }
+        }
+    }
+    catch (const std::exception &ex)
+    {
+        std::cerr << ex.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -1,8 +1,29 @@
 #include "bitmap.h"
+#include "pixelformat.h"
+#include "simd.h"
+#include "threadpool.h"
+#include "trace.h"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <numeric>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <limits.h>
+
 /**
      * Read in an image.
      * reads a bitmap in from the stream
      *
+     * 24 and 32 bit images are read as they are, top-down ones turned
+     * bottom-up. 1, 4 and 8 bit palette images, 16 bit images (5-5-5 or
+     * with bit masks) and RLE8/RLE4 images are expanded to 24 bits.
+     *
      * @param in the stream to read from.
      * @param b the bitmap that we are creating.
      *
@@ -13,68 +34,87 @@
      */
 std::istream &operator>>(std::istream &in, Bitmap &b)
 {
+    return b.read(in, nullptr);
+}
+
+// bytes of rows read from the stream before each call of rows_read.
+static const size_t READ_BAND_BYTES = 256u << 10;
+
+/**
+ * What operator>> does. The rows are read a band of a few hundred KiB at
+ * a time, and rows_read, if given, is called with each band as soon as
+ * it is in, while it is still in cache. Images expanded by decode() are
+ * passed in one piece once they are done.
+ */
+std::istream &Bitmap::read(std::istream &in, const std::function<void(BitmapView)> &rows_read)
+{
+    TRACE_SCOPE("read", 0);
     try
     {
         if (in)
         {
-            in.read((char *)&b.file_header, sizeof(b.file_header));
-            if (b.file_header.file_type != 0x4D42)
-            {
-                throw std::runtime_error("Error! Not a correct file format");
-            }
-            in.read((char *)&b.bmp_info_header, sizeof(b.bmp_info_header));
-            b.imageType = b.bmp_info_header.bit_count / 8;
+            read_headers(in);
+            unmap();
 
-            // The BMPColorHeader is used only for transparent images
-            if (b.bmp_info_header.bit_count == 32)
+            // Palette, 16 bit and run-length encoded images are expanded to 24 bits.
+            const BMPInfoHeader &info = bmp_info_header;
+            if (!(info.bit_count == 24 && info.compression == 0) &&
+                !(info.bit_count == 32 && (info.compression == 0 || info.compression == 3)))
             {
-                // Check if the file has bit mask color information
-                if (b.bmp_info_header.size >= (sizeof(BMPInfoHeader) + sizeof(BMPColorHeader)))
-                {
-                    in.read((char *)&b.bmp_color_header, sizeof(b.bmp_color_header));
-                }
-                else
+                decode(in);
+                if (rows_read)
                 {
-                    throw(BitmapException("Error! The file does not contain bit mask information\n", 74));
+                    rows_read(view());
                 }
+                TRACE_BYTES(pixel_bytes());
+                return in;
             }
 
-            // Jump to the pixel data location
-            in.seekg(b.file_header.offset_data, in.beg);
-
-            // Adjust the header fields for output.
-            if (b.bmp_info_header.bit_count == 32)
-            {
-                b.bmp_info_header.size = sizeof(BMPInfoHeader) + sizeof(BMPColorHeader);
-                b.file_header.offset_data = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + sizeof(BMPColorHeader);
-            }
-            else
+            // Top-down rows are stored the other way round, bottom row first.
+            const bool top_down = bmp_info_header.height < 0;
+            if (top_down)
             {
-                b.bmp_info_header.size = sizeof(BMPInfoHeader);
-                b.file_header.offset_data = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader);
+                bmp_info_header.height = -bmp_info_header.height;
             }
-            b.file_header.file_size = b.file_header.offset_data;
-            b.data.resize(b.bmp_info_header.width * 3 * 3 * b.bmp_info_header.height * b.bmp_info_header.bit_count / 8);
+            const uint32_t height = bmp_info_header.height;
+            data.resize(static_cast<size_t>(row_stride) * height);
 
             // Here we check if we need to take into account row padding
-            if (b.bmp_info_header.width % 4 == 0)
+            if (!top_down && make_stride_aligned(4) == row_stride && !rows_read)
             {
-                in.read((char *)b.data.data(), b.data.size());
-                b.file_header.file_size += static_cast<uint32_t>(b.data.size());
+                in.read((char *)data.data(), data.size());
             }
             else
             {
-                b.row_stride = b.bmp_info_header.width * b.bmp_info_header.bit_count / 8;
-                uint32_t new_stride = b.make_stride_aligned(4);
-                std::vector<uint8_t> padding_row(new_stride - b.row_stride);
+                uint32_t new_stride = make_stride_aligned(4);
+                std::vector<uint8_t> padding_row(new_stride - row_stride);
+                const BitmapView pixels = view();
+                const uint32_t band = static_cast<uint32_t>(std::max<size_t>(READ_BAND_BYTES / std::max<uint32_t>(new_stride, 1), 1));
 
-                for (int y = 0; y < b.bmp_info_header.height; ++y)
+                for (uint32_t first = 0; first < height; first += band)
                 {
-                    in.read((char *)(b.data.data() + b.row_stride * y), b.row_stride);
-                    in.read((char *)padding_row.data(), padding_row.size());
+                    const uint32_t last = std::min(first + band, height);
+                    if (padding_row.empty() && !top_down)
+                    {
+                        in.read((char *)pixels.row(first), static_cast<std::streamsize>(row_stride) * (last - first));
+                    }
+                    else
+                    {
+                        for (uint32_t y = first; y < last; ++y)
+                        {
+                            uint32_t row = top_down ? height - 1 - y : y;
+                            in.read((char *)pixels.row(row), row_stride);
+                            in.read((char *)padding_row.data(), padding_row.size());
+                        }
+                    }
+                    if (rows_read && !pixels.empty())
+                    {
+                        rows_read(pixels.crop(0, top_down ? height - last : first, pixels.width, last - first));
+                    }
                 }
-                b.file_header.file_size += static_cast<uint32_t>(b.data.size()) + b.bmp_info_header.height * static_cast<uint32_t>(padding_row.size());
             }
+            update_output_sizes();
+            TRACE_BYTES(pixel_bytes());
         }
         else
         {
@@ -86,12 +126,25 @@ std::istream &operator>>(std::istream &in, Bitmap &b)
     catch (BitmapException ex)
     {
         ex.print_exception();
+        in.setstate(std::ios::failbit);
+        return in;
     }
 }
 
+// bytes of padded rows gathered before each write to the stream.
+static const size_t WRITE_STAGING_BYTES = 4u << 20;
+
 /**
      * Write the binary representation of the image to the stream.
      *
+     * Images with at most 256 colours are written with 8 bits per pixel,
+     * as b.output_encoding asks for.
+     *
+     * Rows that are already padded to 4 bytes (32 bits per pixel, widths
+     * whose rows need no padding, mapped images) go out with one write
+     * of all the pixels. Otherwise the padded rows are gathered into a
+     * staging buffer of a few MiB and written a batch at a time.
+     *
      * @param out the stream to write to.
      * @param b the bitmap that we are writing.
      *
@@ -101,42 +154,48 @@ std::istream &operator>>(std::istream &in, Bitmap &b)
      */
 std::ostream &operator<<(std::ostream &out, Bitmap &b)
 {
-    if (out)
+    if (!out)
     {
-        if (b.bmp_info_header.bit_count == 32)
-        {
-            b.write_headers_and_data(out);
-        }
-        else if (b.bmp_info_header.bit_count == 24)
-        {
-            if (b.bmp_info_header.width % 4 == 0)
-            {
-                b.write_headers_and_data(out);
-            }
-            else
-            {
-                uint32_t new_stride = b.make_stride_aligned(4);
-                std::vector<uint8_t> padding_row(new_stride - b.row_stride);
+        throw std::runtime_error("Unable to open the output image file.");
+    }
+    if (b.bmp_info_header.bit_count != 24 && b.bmp_info_header.bit_count != 32)
+    {
+        throw std::runtime_error("The program can treat only 24 or 32 bits per pixel BMP files");
+    }
+    TRACE_SCOPE("write", b.pixel_bytes());
 
-                b.write_headers(out);
+    PixelVector file;
+    if (b.encode_compact(file))
+    {
+        out.write((const char *)file.data(), file.size());
+        return out;
+    }
 
-                for (int y = 0; y < b.bmp_info_header.height; ++y)
-                {
-                    uint8_t *row = (&b.data[0] + b.row_stride * y);
-                    out.write((const char *)(row), b.row_stride);
-                    out.write((const char *)padding_row.data(), padding_row.size());
-                }
-            }
-        }
-        else
-        {
-            throw std::runtime_error("The program can treat only 24 or 32 bits per pixel BMP files");
-        }
+    b.update_output_sizes();
+    const uint32_t padded_stride = b.make_stride_aligned(4);
+    if (padded_stride == b.row_stride)
+    {
+        b.write_headers_and_data(out);
+        return out;
     }
-    else
+
+    b.write_headers(out);
+    const uint32_t height = b.bmp_info_header.height > 0 ? b.bmp_info_header.height : 0;
+    const uint32_t batch_rows = std::max<uint32_t>(1, WRITE_STAGING_BYTES / padded_stride);
+    PixelVector staging(static_cast<size_t>(padded_stride) * std::min(batch_rows, height));
+    const uint8_t *pixels = b.pixels();
+    for (uint32_t first = 0; first < height; first += batch_rows)
     {
-        throw std::runtime_error("Unable to open the output image file.");
+        const uint32_t rows = std::min(batch_rows, height - first);
+        for (uint32_t y = 0; y < rows; y++)
+        {
+            uint8_t *row = staging.data() + static_cast<size_t>(padded_stride) * y;
+            memcpy(row, pixels + static_cast<size_t>(b.row_stride) * (first + y), b.row_stride);
+            memset(row + b.row_stride, 0, padded_stride - b.row_stride);
+        }
+        out.write((const char *)staging.data(), static_cast<std::streamsize>(padded_stride) * rows);
     }
+    return out;
 }
 
 BitmapException::BitmapException(const std::string &message, uint32_t position) : _message(message), _position(position)
@@ -172,6 +231,43 @@ uint32_t Bitmap::make_stride_aligned(uint32_t align_stride)
     return new_stride;
 }
 
+/**
+ * Read the file, info and colour headers from the stream, leave the
+ * stream at the first pixel row and set up the fields for output.
+ * @param in stream to read from.
+*/
+void Bitmap::read_headers(std::istream &in)
+{
+    in.read((char *)&file_header, sizeof(file_header));
+    if (file_header.file_type != 0x4D42)
+    {
+        throw std::runtime_error("Error! Not a correct file format");
+    }
+    in.read((char *)&bmp_info_header, sizeof(bmp_info_header));
+    imageType = bmp_info_header.bit_count / 8;
+
+    // The BMPColorHeader is used only for transparent images
+    if (bmp_info_header.bit_count == 32)
+    {
+        // Check if the file has bit mask color information
+        if (bmp_info_header.size >= (sizeof(BMPInfoHeader) + sizeof(BMPColorHeader)))
+        {
+            in.read((char *)&bmp_color_header, sizeof(bmp_color_header));
+        }
+        else
+        {
+            throw(BitmapException("Error! The file does not contain bit mask information\n", 74));
+        }
+    }
+
+    // Jump to the pixel data location
+    in.seekg(file_header.offset_data, in.beg);
+
+    // Adjust the header fields for output.
+    prepare_output_headers();
+    row_stride = bmp_info_header.width * bmp_info_header.bit_count / 8;
+}
+
 /**
      * Write the binary representation of image header to stream
      * @param out stream to write to.
@@ -195,395 +291,2343 @@ void Bitmap::write_headers(std::ostream &out)
 void Bitmap::write_headers_and_data(std::ostream &out)
 {
     write_headers(out);
-    out.write((const char *)data.data(), data.size());
+    out.write((const char *)pixels(), pixel_bytes());
 }
 
 /**
- * returns the nearest number to the given value.
- * @param inValue pixel for which nearest number to be find.
- *  
+ * Rewrite the header fields read from a file so they describe the
+ * image we are going to write back out (header sizes and data offset).
 */
-uint8_t nearesetNumber(uint8_t inValue)
+void Bitmap::prepare_output_headers()
 {
-    uint8_t val[3] = {0, 128, 255};
-    uint8_t min = 255;
-    uint8_t minIndex = 0;
-
-    for (uint8_t i = 0; i < 3; i++)
+    if (bmp_info_header.bit_count == 32)
     {
-        uint8_t curMin = (inValue > val[i]) ? inValue - val[i] : val[i] - inValue;
-        if (curMin < min)
-        {
-            min = curMin;
-            minIndex = i;
-        }
+        bmp_info_header.size = sizeof(BMPInfoHeader) + sizeof(BMPColorHeader);
+        file_header.offset_data = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + sizeof(BMPColorHeader);
     }
-    return val[minIndex];
+    else
+    {
+        bmp_info_header.size = sizeof(BMPInfoHeader);
+        file_header.offset_data = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader);
+    }
+    file_header.file_size = file_header.offset_data;
 }
+
 /**
- * cell shade an image.
- * for each component of each pixel we round to 
- * the nearest number of 0, 180, 255
- *
- * This has the effect of making the image look like.
- * it was colored.
+ * Set size_image and file_size from the padded stride, for writing.
+*/
+void Bitmap::update_output_sizes()
+{
+    const uint32_t height = bmp_info_header.height > 0 ? bmp_info_header.height : 0;
+    bmp_info_header.size_image = make_stride_aligned(4) * height;
+    file_header.file_size = file_header.offset_data + bmp_info_header.size_image;
+}
+
+/**
+ * copy the headers of a file into buffer, the colour header only for 32 bits per pixel.
+ * @return the number of bytes copied.
  */
-void cellShade(Bitmap &b)
+static size_t headerBytes(const BMPFileHeader &file, const BMPInfoHeader &info, const BMPColorHeader &color, uint8_t *buffer)
 {
-    try
-    {
-        for (int y = 0; y < b.bmp_info_header.height; y++)
-        {
-            uint8_t *row = (&b.data[0] + b.row_stride * (y));
-            if (!row)
-            {
-                throw(BitmapException("Image Data is not aviable ", 75));
-            }
-            for (int x = 0; x < b.bmp_info_header.width; x++)
-            {
-                uint8_t *pixel = &row[((x)*b.imageType)];
-                for (uint8_t ch = 0; ch < b.imageType; ch++)
-                {
-                    pixel[ch] = nearesetNumber(pixel[ch]);
-                }
-            }
-        }
-    }
-    catch (BitmapException exception)
+    size_t size = 0;
+    memcpy(buffer + size, &file, sizeof(file));
+    size += sizeof(file);
+    memcpy(buffer + size, &info, sizeof(info));
+    size += sizeof(info);
+    if (info.bit_count == 32)
     {
-        exception.print_exception();
-        return;
+        memcpy(buffer + size, &color, sizeof(color));
+        size += sizeof(color);
     }
+    return size;
 }
 
 /**
- * Grayscales an image by averaging all of the components.
+ * Copy the headers write_headers would write into buffer.
+ * @return the number of bytes copied.
+*/
+size_t Bitmap::header_bytes(uint8_t *buffer) const
+{
+    return headerBytes(file_header, bmp_info_header, bmp_color_header, buffer);
+}
+
+/**
+ * write all of iov to fd, continuing after short writes.
  */
-void grayscale(Bitmap &b)
+static void writeAll(int fd, std::vector<iovec> &iov)
 {
-    uint16_t gray = 0;
-    for (int y = 0; y < b.bmp_info_header.height; y++)
+    size_t next = 0;
+    while (next < iov.size())
     {
-        uint8_t *row = (&b.data[0] + b.row_stride * (y));
-        for (int x = 0; x < b.bmp_info_header.width; x++)
+        int count = static_cast<int>(std::min<size_t>(iov.size() - next, IOV_MAX));
+        ssize_t written = writev(fd, &iov[next], count);
+        if (written < 0)
         {
-            uint8_t *pixel = &row[((x)*b.imageType)];
-            if (b.imageType == 3)
-            {
-                // averaging an RGB component.
-                gray = (pixel[0] + pixel[1] + pixel[2]) / b.imageType;
-            }
-            else
+            if (errno == EINTR)
             {
-                gray = (pixel[0] + pixel[1] + pixel[2] + pixel[3]) / b.imageType;
-                pixel[3] = gray;
+                continue;
             }
-            pixel[0] = pixel[1] = pixel[2] = gray;
-            pixel = pixel + b.imageType;
+            throw std::runtime_error("Unable to write the output image file.");
+        }
+
+        // skip the buffers that went out whole and trim the one cut short.
+        size_t left = static_cast<size_t>(written);
+        while (next < iov.size() && left >= iov[next].iov_len)
+        {
+            left -= iov[next].iov_len;
+            next++;
+        }
+        if (left > 0)
+        {
+            iov[next].iov_base = static_cast<uint8_t *>(iov[next].iov_base) + left;
+            iov[next].iov_len -= left;
         }
     }
 }
 
 /**
- * Pixelats an image by creating groups of 16*16 pixel blocks.
+ * create or replace the file at path and write iov to it.
  */
-void pixelate(Bitmap &b)
+static void writeFile(const std::string &path, std::vector<iovec> &iov)
 {
-    Bitmap originalImage = b;
-    int16_t offset[16] = {-8, -7, -6, -5, -4, -3, -2, -1, 0, 1, 2, 3, 4, 5, 6, 7};
-    for (int y = 8; y < b.bmp_info_header.height - 8; y += 8)
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
     {
-        uint8_t *row = (&originalImage.data[0] + originalImage.row_stride * y);
-        for (int x = 8; x < originalImage.bmp_info_header.width - 8; x += 8)
-        {
-            uint32_t value[4] = {0, 0, 0, 0};
-            for (int oY = 0; oY < 16; oY++)
-            {
-                uint8_t *oRow = (&originalImage.data[0] + originalImage.row_stride * (y + offset[oY]));
-                for (int oX = 0; oX < 16; oX++)
-                {
-                    uint8_t *otherPixel = &oRow[0] + ((x + offset[oX]) * b.imageType);
-                    value[0] += otherPixel[0];
-                    value[1] += otherPixel[1];
-                    value[2] += otherPixel[2];
-                    if (b.imageType == 4)
-                    {
-                        value[3] += otherPixel[3];
-                    }
-                }
-            }
-            value[0] = value[0] / (16 * 16);
-            value[1] = value[1] / (16 * 16);
-            value[2] = value[2] / (16 * 16);
-            if (b.imageType == 4)
-            {
-                value[3] = value[3] / (16 * 16);
-            }
+        throw std::runtime_error("Unable to open the output image file.");
+    }
+    try
+    {
+        writeAll(fd, iov);
+    }
+    catch (...)
+    {
+        close(fd);
+        throw;
+    }
+    if (close(fd) != 0)
+    {
+        throw std::runtime_error("Unable to write the output image file.");
+    }
+}
 
-            for (int oY = 0; oY < 16; oY++)
-            {
-                uint8_t *oRow = (&b.data[0] + b.row_stride * (y + offset[oY]));
-                for (int oX = 0; oX < 17; oX++)
-                {
-                    uint8_t *otherPixel = &oRow[0] + ((x + offset[oX]) * b.imageType);
-                    otherPixel[0] = value[0];
-                    otherPixel[1] = value[1];
-                    otherPixel[2] = value[2];
-                    if (b.imageType == 4)
-                    {
-                        otherPixel[3] = value[3];
-                    }
-                }
-            }
+/**
+ * Write the image to a file with writev, straight from the pixel rows,
+ * or as the 8 bit file encode_compact() makes.
+*/
+size_t Bitmap::save(const std::string &path)
+{
+    if (bmp_info_header.bit_count != 24 && bmp_info_header.bit_count != 32)
+    {
+        throw std::runtime_error("The program can treat only 24 or 32 bits per pixel BMP files");
+    }
+    TRACE_SCOPE("save", pixel_bytes());
+    PixelVector file;
+    const bool compact = encode_compact(file);
+    update_output_sizes();
+
+    uint8_t headers[sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + sizeof(BMPColorHeader)];
+    static const uint8_t padding[4] = {0, 0, 0, 0};
+    const uint32_t padded_stride = make_stride_aligned(4);
+    const uint32_t height = bmp_info_header.height > 0 ? bmp_info_header.height : 0;
+
+    std::vector<iovec> iov;
+    if (compact)
+    {
+        iov.push_back({file.data(), file.size()});
+    }
+    else if (padded_stride == row_stride)
+    {
+        iov.push_back({headers, header_bytes(headers)});
+        iov.push_back({pixels(), pixel_bytes()});
+    }
+    else
+    {
+        iov.push_back({headers, header_bytes(headers)});
+        iov.reserve(1 + 2 * static_cast<size_t>(height));
+        for (uint32_t y = 0; y < height; y++)
+        {
+            iov.push_back({pixels() + static_cast<size_t>(row_stride) * y, row_stride});
+            iov.push_back({const_cast<uint8_t *>(padding), padded_stride - row_stride});
         }
     }
+
+    writeFile(path, iov);
+    return compact ? file.size() : file_header.file_size;
 }
 
 /**
- * Use gaussian bluring to blur an image.
- */
-void blur(Bitmap &b)
+ * Write a view as a file of its own, with the headers of this image
+ * resized to it.
+*/
+size_t Bitmap::save_view(const std::string &path, BitmapView view) const
 {
-    // 5X5 block Kernal for gaussian blur.
-    uint16_t filter[5][5] = {{1, 4, 6, 4, 1},
-                             {4, 16, 24, 16, 4},
-                             {6, 24, 36, 24, 6},
-                             {4, 16, 24, 16, 4},
-                             {1, 4, 6, 4, 1}};
+    if ((bmp_info_header.bit_count != 24 && bmp_info_header.bit_count != 32) || view.bpp != bmp_info_header.bit_count / 8u)
+    {
+        throw std::runtime_error("The view must have the 24 or 32 bits per pixel of the image");
+    }
+    TRACE_SCOPE("save view", static_cast<uint64_t>(view.width) * view.height * view.bpp);
+    const uint32_t row_bytes = view.width * view.bpp;
+    const uint32_t padded_bytes = (row_bytes + 3) & ~3u;
+    const bool color_header = view.bpp == 4;
 
-    int16_t offset[5] = {-2, -1, 0, 1, 2};
+    BMPFileHeader file_out = file_header;
+    BMPInfoHeader info_out = bmp_info_header;
+    file_out.file_type = 0x4D42;
+    file_out.offset_data = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + (color_header ? sizeof(BMPColorHeader) : 0);
+    info_out.size = sizeof(BMPInfoHeader) + (color_header ? sizeof(BMPColorHeader) : 0);
+    info_out.width = static_cast<int32_t>(view.width);
+    info_out.height = static_cast<int32_t>(view.height);
+    info_out.planes = 1;
+    info_out.size_image = padded_bytes * view.height;
+    file_out.file_size = file_out.offset_data + info_out.size_image;
 
-    for (int y = 2; y < b.bmp_info_header.height - 3; y++)
+    uint8_t headers[sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + sizeof(BMPColorHeader)];
+    static const uint8_t padding[4] = {0, 0, 0, 0};
+    std::vector<iovec> iov;
+    iov.reserve(1 + 2 * static_cast<size_t>(view.height));
+    iov.push_back({headers, headerBytes(file_out, info_out, bmp_color_header, headers)});
+    if (view.pitch == padded_bytes)
+    {
+        iov.push_back({view.pixels, static_cast<size_t>(padded_bytes) * view.height});
+    }
+    else
     {
-        uint8_t *row = (&b.data[0] + b.row_stride * y);
-        for (int x = 2; x < b.bmp_info_header.width - 3; x++)
+        for (uint32_t y = 0; y < view.height; y++)
         {
-            uint8_t *pixel = &row[0] + x * b.imageType;
-            uint16_t filterValue[4] = {0, 0, 0, 0};
-            for (int xOff = 0; xOff < 5; xOff++)
-            {
-                for (int yOff = 0; yOff < 5; yOff++)
-                {
-                    uint32_t yOffset = y + offset[yOff];
-                    uint32_t xOffset = x + offset[xOff];
-                    uint8_t *row = (&b.data[0] + b.row_stride * (yOffset));
-                    uint8_t *otherPixel = &row[((xOffset)*b.imageType)];
-
-                    filterValue[0] += (otherPixel[0] * filter[yOff][xOff]);
-                    filterValue[1] += (otherPixel[1] * filter[yOff][xOff]);
-                    filterValue[2] += (otherPixel[2] * filter[yOff][xOff]);
-                    if (b.imageType == 4)
-                    {
-                        filterValue[3] += (otherPixel[3] * filter[yOff][xOff]);
-                    }
-                }
-            }
-            for (uint8_t ch = 0; ch < b.imageType; ch++)
+            iov.push_back({view.row(y), row_bytes});
+            if (padded_bytes != row_bytes)
             {
-                filterValue[ch] = filterValue[ch] / 255.0;
-                pixel[ch] = filterValue[ch];
+                iov.push_back({const_cast<uint8_t *>(padding), padded_bytes - row_bytes});
             }
         }
     }
+    writeFile(path, iov);
+    return file_out.file_size;
 }
 
 /**
- * rotates image 90 degrees, swapping the height and width.
- */
-void rot90(Bitmap &b)
+ * Put the bytes save() would write into file.
+*/
+void Bitmap::encode(PixelVector &file)
 {
-}
+    if (bmp_info_header.bit_count != 24 && bmp_info_header.bit_count != 32)
+    {
+        throw std::runtime_error("The program can treat only 24 or 32 bits per pixel BMP files");
+    }
+    TRACE_SCOPE("encode", pixel_bytes());
+    if (encode_compact(file))
+    {
+        return;
+    }
+    update_output_sizes();
+    file.resize(file_header.file_size);
 
-/**
- * rotates an image by 180 degrees.
- */
-void rot180(Bitmap &b)
-{
+    const size_t header_size = header_bytes(file.data());
+    const uint32_t padded_stride = make_stride_aligned(4);
+    const uint32_t height = bmp_info_header.height > 0 ? bmp_info_header.height : 0;
+    if (padded_stride == row_stride)
+    {
+        memcpy(file.data() + header_size, pixels(), pixel_bytes());
+        return;
+    }
+    for (uint32_t y = 0; y < height; y++)
+    {
+        uint8_t *row = file.data() + header_size + static_cast<size_t>(padded_stride) * y;
+        memcpy(row, pixels() + static_cast<size_t>(row_stride) * y, row_stride);
+        memset(row + row_stride, 0, padded_stride - row_stride);
+    }
 }
 
-/**
- * rotates image 270 degrees, swapping the height and width.
- */
-void rot270(Bitmap &b)
+Bitmap::Bitmap(const Bitmap &other)
+    : row_stride(other.row_stride), imageType(other.imageType),
+      file_header(other.file_header), bmp_info_header(other.bmp_info_header),
+      bmp_color_header(other.bmp_color_header), output_encoding(other.output_encoding)
 {
+    data.assign(other.pixels(), other.pixels() + other.pixel_bytes());
 }
 
-/**
- * flips and image over the vertical axis.
- */
-void flipv(Bitmap &b)
+Bitmap &Bitmap::operator=(const Bitmap &other)
 {
-    Bitmap original = b;
-    for (uint16_t y = 0; y < b.bmp_info_header.height; ++y)
+    if (this != &other)
     {
-        // store the copy of original bitmap data details.
-        uint8_t *originalRow = (&original.data[0] + original.row_stride * y);
-        uint8_t *originalPixel = originalRow;
-
-        uint8_t *newRow = (&b.data[0] + original.row_stride * ((b.bmp_info_header.height - 1) - y));
-        uint8_t *pixel = newRow;
-        for (uint16_t x = 0; x < b.bmp_info_header.width * b.imageType; x += b.imageType)
-        {
-            pixel[x + 0] = originalPixel[x + 0];
-            pixel[x + 1] = originalPixel[x + 1];
-            pixel[x + 2] = originalPixel[x + 2];
-            if (b.imageType == 4)
-            {
-                pixel[x + 3] = originalPixel[x + 3];
-            }
-        }
+        PixelVector copy(other.pixels(), other.pixels() + other.pixel_bytes());
+        unmap();
+        row_stride = other.row_stride;
+        imageType = other.imageType;
+        file_header = other.file_header;
+        bmp_info_header = other.bmp_info_header;
+        bmp_color_header = other.bmp_color_header;
+        output_encoding = other.output_encoding;
+        data.swap(copy);
     }
+    return *this;
 }
 
-/**
- * flips and image over the horizontal axis.
- */
-void fliph(Bitmap &b)
+Bitmap::Bitmap(Bitmap &&other) noexcept
 {
-    Bitmap original = b;
-    for (uint16_t y = 0; y < b.bmp_info_header.height; ++y)
-    {
-        uint8_t *row = (&b.data[0] + b.row_stride * y);
-        uint8_t *pixel = row;
+    *this = std::move(other);
+}
 
-        // store the copy of original bitmap data details.
-        uint8_t *originalRow = (&original.data[0] + original.row_stride * y);
-        uint8_t *originalPixel = originalRow;
+Bitmap &Bitmap::operator=(Bitmap &&other) noexcept
+{
+    if (this != &other)
+    {
+        unmap();
+        row_stride = other.row_stride;
+        imageType = other.imageType;
+        file_header = other.file_header;
+        bmp_info_header = other.bmp_info_header;
+        bmp_color_header = other.bmp_color_header;
+        output_encoding = other.output_encoding;
+        data.swap(other.data);
+        mapped_pixels = other.mapped_pixels;
+        mapping = other.mapping;
+        mapping_length = other.mapping_length;
 
-        for (uint16_t x = 0; x < b.bmp_info_header.width * b.imageType; x += b.imageType)
-        {
-            uint16_t offset = (b.bmp_info_header.width - 1) * b.imageType - x;
-            pixel[x + 0] = originalPixel[offset + 0];
-            pixel[x + 1] = originalPixel[offset + 1];
-            pixel[x + 2] = originalPixel[offset + 2];
-            if (b.imageType == 4)
-            {
-                pixel[x + 3] = originalPixel[offset + 3];
-            }
-        }
+        other.mapped_pixels = nullptr;
+        other.mapping = nullptr;
+        other.mapping_length = 0;
+        other.data.clear();
+        other.row_stride = 0;
+        other.imageType = 0;
+        other.file_header = BMPFileHeader();
+        other.bmp_info_header = BMPInfoHeader();
+        other.bmp_color_header = BMPColorHeader();
     }
+    return *this;
 }
 
-/**
- * flips and image over the line y = -x, swapping the height and width.
- */
-void flipd1(Bitmap &b)
+Bitmap::~Bitmap()
 {
+    unmap();
 }
 
 /**
- * flips and image over the line y = xr, swapping the height and width.
+ * the view of a rectangle inside this one, sharing its pixels.
+ *
+ * @throws runtime_error if the rectangle is not inside the view.
  */
-void flipd2(Bitmap &b)
+BitmapView BitmapView::crop(uint32_t x, uint32_t y, uint32_t crop_width, uint32_t crop_height) const
 {
+    if (x > width || crop_width > width - x || y > height || crop_height > height - y)
+    {
+        throw std::runtime_error("The crop rectangle is outside the image");
+    }
+    return BitmapView(pixels + static_cast<size_t>(pitch) * y + static_cast<size_t>(x) * bpp,
+                      crop_width, crop_height, pitch, bpp);
 }
 
 /**
- * scales the image by a factor of 2.
- */
-void scaleUp(Bitmap &b)
+ * Map a bitmap file into memory and use its pixel rows in place.
+ * Falls back to operator>> for layouts we can't alias.
+ *
+ * @param path the bitmap file to open.
+ *
+ * @throws runtime_error if the file can not be opened, or can not be
+ * read in full when it is not aliased.
+*/
+void Bitmap::map(const std::string &path)
 {
-    Bitmap original = b;
-    b.bmp_info_header.width = b.bmp_info_header.width * 2;
-    b.bmp_info_header.width += b.bmp_info_header.width % 4;
-    b.row_stride = b.bmp_info_header.width * b.bmp_info_header.bit_count / 8;
-    b.bmp_info_header.height = b.bmp_info_header.height * 2;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw std::runtime_error("Unable to open the input image file.");
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        throw std::runtime_error("Unable to open the input image file.");
+    }
 
-    uint32_t r = 0;
-    for (uint16_t y = 0; y < original.bmp_info_header.height; ++y)
+    size_t length = static_cast<size_t>(st.st_size);
+    void *base = MAP_FAILED;
+    if (length >= sizeof(BMPFileHeader) + sizeof(BMPInfoHeader))
     {
-        uint8_t *originalRow = (&original.data[0] + original.row_stride * y);
-        uint8_t *originalPixel = originalRow;
-        for (uint16_t rCount = 0; rCount < 2; rCount++)
+        // private and writable: the first write to a page gives us our own copy of it.
+        base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+
+    if (base != MAP_FAILED)
+    {
+        const uint8_t *bytes = static_cast<const uint8_t *>(base);
+        BMPFileHeader file;
+        BMPInfoHeader info;
+        memcpy(&file, bytes, sizeof(file));
+        memcpy(&info, bytes + sizeof(file), sizeof(info));
+
+        // Only plain bottom-up 24/32 bit rows can be used straight out of the file.
+        bool aliasable = file.file_type == 0x4D42 && info.width > 0 && info.height > 0 &&
+                         (info.bit_count == 24 || info.bit_count == 32) &&
+                         (info.compression == 0 || (info.compression == 3 && info.bit_count == 32));
+        bool has_masks = info.size >= sizeof(BMPInfoHeader) + sizeof(BMPColorHeader) &&
+                         length >= sizeof(file) + sizeof(BMPInfoHeader) + sizeof(BMPColorHeader);
+        if (info.bit_count == 32 && !has_masks)
         {
-            uint32_t c = 0;
-            uint8_t *row = (&b.data[0] + b.row_stride * r);
-            uint8_t *pixel = row;
-            for (uint16_t x = 0; x < b.bmp_info_header.width; x++)
+            aliasable = false;
+        }
+
+        uint64_t stride = ((static_cast<uint64_t>(info.width) * info.bit_count / 8) + 3) & ~static_cast<uint64_t>(3);
+        if (aliasable && static_cast<uint64_t>(file.offset_data) + stride * info.height > length)
+        {
+            aliasable = false;
+        }
+
+        if (aliasable)
+        {
+            unmap();
+            data.clear();
+            data.shrink_to_fit();
+            mapping = base;
+            mapping_length = length;
+            mapped_pixels = static_cast<uint8_t *>(base) + file.offset_data;
+            madvise(base, length, MADV_SEQUENTIAL);
+
+            file_header = file;
+            bmp_info_header = info;
+            if (info.bit_count == 32)
+            {
+                memcpy(&bmp_color_header, bytes + sizeof(file) + sizeof(BMPInfoHeader), sizeof(bmp_color_header));
+            }
+            imageType = info.bit_count / 8;
+            row_stride = static_cast<uint32_t>(stride);
+            prepare_output_headers();
+            file_header.file_size += static_cast<uint32_t>(pixel_bytes());
+            return;
+        }
+        munmap(base, length);
+    }
+
+    std::ifstream in(path, std::ios_base::binary);
+    if (!in)
+    {
+        throw std::runtime_error("Unable to open the input image file.");
+    }
+    if (!(in >> *this))
+    {
+        throw std::runtime_error("Unable to read the input image file.");
+    }
+}
+
+/**
+ * Release the file mapping, if any.
+*/
+void Bitmap::unmap()
+{
+    if (mapping)
+    {
+        munmap(mapping, mapping_length);
+        mapping = nullptr;
+        mapping_length = 0;
+        mapped_pixels = nullptr;
+    }
+}
+
+/**
+ * Pointer to the first pixel row, whether mapped or in data.
+*/
+uint8_t *Bitmap::pixels()
+{
+    return mapped_pixels ? mapped_pixels : data.data();
+}
+
+const uint8_t *Bitmap::pixels() const
+{
+    return mapped_pixels ? mapped_pixels : data.data();
+}
+
+/**
+ * Number of bytes in the pixel rows (row_stride * height).
+*/
+size_t Bitmap::pixel_bytes() const
+{
+    if (mapped_pixels)
+    {
+        return static_cast<size_t>(row_stride) * bmp_info_header.height;
+    }
+    return data.size();
+}
+
+/**
+ * A view of all the pixel rows.
+*/
+BitmapView Bitmap::view()
+{
+    if (bmp_info_header.width <= 0 || bmp_info_header.height <= 0)
+    {
+        return BitmapView(pixels(), 0, 0, row_stride, imageType);
+    }
+    return BitmapView(pixels(), bmp_info_header.width, bmp_info_header.height, row_stride, imageType);
+}
+
+/**
+ * true if the pixel rows are aliased from a file mapping.
+*/
+bool Bitmap::is_mapped() const
+{
+    return mapped_pixels != nullptr;
+}
+
+/**
+ * Change the image size, resizing data to the new rows.
+*/
+void Bitmap::reshape(int32_t width, int32_t height)
+{
+    detach();
+    bmp_info_header.width = width;
+    bmp_info_header.height = height;
+    row_stride = width * imageType;
+    uint32_t padded_stride = make_stride_aligned(4);
+    bmp_info_header.size_image = padded_stride * height;
+    file_header.file_size = file_header.offset_data + bmp_info_header.size_image;
+    data.resize(static_cast<size_t>(row_stride) * height);
+}
+
+/**
+ * Change the image size and take over the rows in pixels.
+*/
+void Bitmap::reshape(int32_t width, int32_t height, PixelVector &pixels)
+{
+    unmap();
+    data.swap(pixels);
+    reshape(width, height);
+}
+
+/**
+ * Copy mapped pixel rows into data and drop the mapping.
+*/
+void Bitmap::detach()
+{
+    if (mapped_pixels)
+    {
+        data.assign(mapped_pixels, mapped_pixels + pixel_bytes());
+        unmap();
+    }
+}
+
+/**
+ * returns the nearest number to the given value.
+ * @param inValue pixel for which nearest number to be find.
+ *  
+*/
+uint8_t nearesetNumber(uint8_t inValue)
+{
+    uint8_t val[3] = {0, 128, 255};
+    uint8_t min = 255;
+    uint8_t minIndex = 0;
+
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        uint8_t curMin = (inValue > val[i]) ? inValue - val[i] : val[i] - inValue;
+        if (curMin < min)
+        {
+            min = curMin;
+            minIndex = i;
+        }
+    }
+    return val[minIndex];
+}
+/**
+ * throws unless src and dst have the same size and format.
+ */
+static void checkSameShape(const BitmapView &src, const BitmapView &dst)
+{
+    if (src.width != dst.width || src.height != dst.height || src.bpp != dst.bpp)
+    {
+        throw std::runtime_error("The source and destination views must have the same size and format");
+    }
+}
+
+/**
+ * Run a per-row point operation over every row of dst, spreading the
+ * rows over the shared thread pool. When src is another view its row is
+ * copied into dst first, so op always works in place.
+ */
+template <typename RowOp>
+static void forEachRow(BitmapView src, BitmapView dst, RowOp op)
+{
+    checkSameShape(src, dst);
+    if (dst.empty())
+    {
+        return;
+    }
+    const uint32_t bytes = dst.width * dst.bpp;
+    const uint32_t grain = std::max<uint32_t>(1, (256 * 1024) / bytes);
+    ThreadPool::shared().parallel_for(0, dst.height, [&](uint32_t first, uint32_t last) {
+        for (uint32_t y = first; y < last; y++)
+        {
+            if (src.pixels != dst.pixels)
+            {
+                memcpy(dst.row(y), src.row(y), bytes);
+            }
+            op(dst.row(y));
+        }
+    }, grain);
+}
+
+/**
+ * cell shade src into dst.
+ */
+void cellShade(BitmapView src, BitmapView dst)
+{
+    const RowKernels &kernels = rowKernels();
+    const uint32_t bytes = dst.width * dst.bpp;
+    forEachRow(src, dst, [&](uint8_t *row) { kernels.cellShade(row, bytes); });
+}
+
+/**
+ * cell shade an image.
+ * for each component of each pixel we round to 
+ * the nearest number of 0, 180, 255
+ *
+ * This has the effect of making the image look like.
+ * it was colored.
+ */
+void cellShade(Bitmap &b)
+{
+    TRACE_SCOPE("cellShade", b.pixel_bytes());
+    try
+    {
+        if (b.bmp_info_header.height > 0 && !b.pixels())
+        {
+            throw(BitmapException("Image Data is not aviable ", 75));
+        }
+        cellShade(b.view(), b.view());
+    }
+    catch (BitmapException exception)
+    {
+        exception.print_exception();
+        return;
+    }
+}
+
+/**
+ * grayscale src into dst. A one byte per pixel view is gray already.
+ */
+void grayscale(BitmapView src, BitmapView dst)
+{
+    const RowKernels &kernels = rowKernels();
+    const uint32_t width = dst.width;
+    withPixelFormat(dst.bpp, [&](auto format) {
+        typedef decltype(format) Format;
+        void (*const gray)(uint8_t *, uint32_t) = Format::channels == 3 ? kernels.grayscale24 : kernels.grayscale32;
+        forEachRow(src, dst, [&](uint8_t *row) {
+            if (Format::channels > 1)
+            {
+                gray(row, width);
+            }
+        });
+    });
+}
+
+/**
+ * Grayscales an image by averaging all of the components.
+ */
+void grayscale(Bitmap &b)
+{
+    TRACE_SCOPE("grayscale", b.pixel_bytes());
+    grayscale(b.view(), b.view());
+}
+
+/**
+ * Pixelats an image by creating groups of 16*16 pixel blocks.
+ */
+void pixelate(Bitmap &b)
+{
+    pixelate(b, 16);
+}
+
+/**
+ * pixelate() for one pixel format.
+ *
+ * Each band of block_size rows is summed down its columns and then
+ * turned into a running sum along the row, the band's slice of a
+ * summed-area table, so the total of any block is one subtraction.
+ * Bands are independent and spread over the shared thread pool. A band
+ * is read completely before it is written, so src may be dst.
+ */
+template <typename Format>
+static void pixelateBlocks(const BitmapView &src, const BitmapView &dst, uint32_t block_size)
+{
+    const uint32_t width = src.width;
+    const uint32_t height = src.height;
+    const uint32_t channels = Format::channels;
+    const uint32_t row_bytes = width * channels;
+    const uint32_t bands = (height + block_size - 1) / block_size;
+
+    ThreadPool::shared().parallel_for(0, bands, [&](uint32_t first, uint32_t last) {
+        // prefix[x * channels + ch] holds the sum of columns [0, x) of the band.
+        std::vector<uint32_t> prefix(row_bytes + channels);
+        for (uint32_t band = first; band < last; band++)
+        {
+            uint32_t y_first = band * block_size;
+            uint32_t y_last = std::min(y_first + block_size, height);
+
+            std::fill(prefix.begin(), prefix.end(), 0);
+            for (uint32_t y = y_first; y < y_last; y++)
             {
-                for (uint16_t cCount = 0; cCount < 2; cCount++)
+                const uint8_t *row = src.row(y);
+                for (uint32_t i = 0; i < row_bytes; i++)
                 {
-                    pixel[(c * b.imageType) + 0] = originalPixel[(x * b.imageType) + 0];
-                    pixel[(c * b.imageType) + 1] = originalPixel[(x * b.imageType) + 1];
-                    pixel[(c * b.imageType) + 2] = originalPixel[(x * b.imageType) + 2];
-                    if (b.imageType == 4)
-                    {
-                        pixel[(c * b.imageType) + 3] = originalPixel[(x * b.imageType) + 3];
-                    }
-                    c++;
+                    prefix[i + channels] += row[i];
                 }
             }
-            r++;
-            while (c < b.bmp_info_header.width)
+            for (uint32_t i = channels; i < row_bytes + channels; i++)
+            {
+                prefix[i] += prefix[i - channels];
+            }
+
+            for (uint32_t x_first = 0; x_first < width; x_first += block_size)
             {
-                pixel[(c * b.imageType) + 0] = 0;
-                pixel[(c * b.imageType) + 1] = 0;
-                pixel[(c * b.imageType) + 2] = 0;
-                if (b.imageType == 4)
+                uint32_t x_last = std::min(x_first + block_size, width);
+                uint32_t area = (x_last - x_first) * (y_last - y_first);
+                Pixel<Format> value;
+                for (uint32_t ch = 0; ch < channels; ch++)
+                {
+                    uint32_t sum = prefix[x_last * channels + ch] - prefix[x_first * channels + ch];
+                    value.c[ch] = static_cast<uint8_t>((sum + area / 2) / area);
+                }
+                for (uint32_t y = y_first; y < y_last; y++)
                 {
-                    pixel[(c * b.imageType) + 3] = 0;
+                    uint8_t *pixel = dst.row(y) + x_first * channels;
+                    for (uint32_t x = x_first; x < x_last; x++, pixel += channels)
+                    {
+                        value.store(pixel);
+                    }
                 }
-                c++;
             }
         }
+    });
+}
+
+/**
+ * pixelate src into dst with square blocks of the given size.
+ */
+void pixelate(BitmapView src, BitmapView dst, uint32_t block_size)
+{
+    checkSameShape(src, dst);
+    if (block_size == 0 || dst.empty())
+    {
+        return;
     }
+    withPixelFormat(dst.bpp, [&](auto format) { pixelateBlocks<decltype(format)>(src, dst, block_size); });
 }
 
 /**
- * scales the image by a factor of 1/2.
+ * Pixelats an image with square blocks of the given size.
  */
-void scaleDown(Bitmap &b)
+void pixelate(Bitmap &b, uint32_t block_size)
+{
+    TRACE_SCOPE("pixelate", b.pixel_bytes());
+    pixelate(b.view(), b.view(), block_size);
+}
+
+// fixed point scale of the 1-D blur weights.
+static const uint32_t BLUR_WEIGHT_BITS = 14;
+
+// extra bits of precision kept between the horizontal and vertical pass.
+static const uint32_t BLUR_SCRATCH_BITS = 8;
+
+/**
+ * Convolve one row horizontally into the scratch row, clamping at the
+ * left and right edges. Taps are one pixel apart, so every byte of the
+ * interior is the same 1-D convolution.
+ */
+template <typename Format>
+static void blurRow(const uint8_t *src, uint16_t *dst, uint32_t width, const std::vector<uint32_t> &weights)
 {
-    Bitmap original = b;
-    b.bmp_info_header.width = b.bmp_info_header.width / 2;
-    b.bmp_info_header.width += b.bmp_info_header.width % 4;
-    b.row_stride = b.bmp_info_header.width * b.bmp_info_header.bit_count / 8;
-    b.bmp_info_header.height = b.bmp_info_header.height / 2;
+    const uint32_t channels = Format::channels;
+    const int32_t radius = static_cast<int32_t>(weights.size() / 2);
+    const int32_t last = static_cast<int32_t>(width) - 1;
+    const uint32_t shift = BLUR_WEIGHT_BITS - BLUR_SCRATCH_BITS;
+    const uint32_t round = 1u << (shift - 1);
+
+    uint32_t interior_first = std::min<uint32_t>(radius, width);
+    uint32_t interior_last = width > static_cast<uint32_t>(radius) ? width - radius : 0;
+    interior_last = std::max(interior_last, interior_first);
 
-    uint16_t r = 0;
-    uint16_t c = 0;
-    for (uint16_t y = 0; y < original.bmp_info_header.height; ++y)
+    for (uint32_t x = 0; x < width; x++)
     {
-        if (y % 2 == 0)
+        if (x == interior_first)
         {
-            continue;
+            x = interior_last;
+            if (x >= width)
+            {
+                break;
+            }
         }
-        uint8_t *row = (&b.data[0] + b.row_stride * r);
-        uint8_t *pixel = row;
-        uint8_t *originalRow = (&original.data[0] + original.row_stride * (y));
-        uint8_t *originalPixel = originalRow;
-        c = 0;
-
-        for (uint16_t x = 0; x < original.bmp_info_header.width; x++)
+        for (uint32_t ch = 0; ch < channels; ch++)
         {
-            if (c >= b.row_stride)
+            uint32_t sum = round;
+            for (int32_t k = -radius; k <= radius; k++)
             {
-                break;
+                int32_t sx = std::min(std::max(static_cast<int32_t>(x) + k, 0), last);
+                sum += weights[k + radius] * src[sx * channels + ch];
             }
-            if (x % 2 == 0)
+            dst[x * channels + ch] = static_cast<uint16_t>(sum >> shift);
+        }
+    }
+
+    const uint32_t begin = interior_first * channels;
+    const uint32_t end = interior_last * channels;
+    for (uint32_t i = begin; i < end; i++)
+    {
+        uint32_t sum = round;
+        const uint8_t *tap = src + i - radius * channels;
+        for (int32_t k = 0; k <= 2 * radius; k++)
+        {
+            sum += weights[k] * tap[k * channels];
+        }
+        dst[i] = static_cast<uint16_t>(sum >> shift);
+    }
+}
+
+/**
+ * Blur with a separable kernel: a horizontal pass from src into a
+ * scratch buffer, then a vertical pass into dst. Rows of both passes are
+ * spread over the shared thread pool. Pixels past the edges are taken
+ * from the nearest edge pixel. src is read completely before dst is
+ * written, so they may be the same view.
+ *
+ * @param weights odd number of taps summing to 1 << BLUR_WEIGHT_BITS.
+ */
+template <typename Format>
+static void separableBlur(const BitmapView &src, const BitmapView &dst, const std::vector<uint32_t> &weights)
+{
+    const uint32_t channels = Format::channels;
+    const uint32_t width = src.width;
+    const uint32_t height = src.height;
+    const uint32_t row_bytes = width * channels;
+    const int32_t radius = static_cast<int32_t>(weights.size() / 2);
+    const uint32_t shift = BLUR_WEIGHT_BITS + BLUR_SCRATCH_BITS;
+    const uint32_t round = 1u << (shift - 1);
+
+    std::vector<uint16_t, PoolAllocator<uint16_t>> scratch(static_cast<size_t>(row_bytes) * height);
+    const uint32_t grain = std::max<uint32_t>(1, (64 * 1024) / std::max<uint32_t>(row_bytes, 1));
+    ThreadPool &pool = ThreadPool::shared();
+
+    pool.parallel_for(0, height, [&](uint32_t first, uint32_t last) {
+        for (uint32_t y = first; y < last; y++)
+        {
+            blurRow<Format>(src.row(y), scratch.data() + static_cast<size_t>(row_bytes) * y, width, weights);
+        }
+    }, grain);
+
+    pool.parallel_for(0, height, [&](uint32_t first, uint32_t last) {
+        std::vector<uint32_t> sums(row_bytes);
+        for (uint32_t y = first; y < last; y++)
+        {
+            std::fill(sums.begin(), sums.end(), round);
+            for (int32_t k = -radius; k <= radius; k++)
             {
-                continue;
+                int32_t sy = std::min(std::max(static_cast<int32_t>(y) + k, 0), static_cast<int32_t>(height) - 1);
+                const uint16_t *tap = scratch.data() + static_cast<size_t>(row_bytes) * sy;
+                const uint32_t weight = weights[k + radius];
+                for (uint32_t i = 0; i < row_bytes; i++)
+                {
+                    sums[i] += weight * tap[i];
+                }
             }
-            pixel[(c * b.imageType) + 0] = originalPixel[(x * b.imageType) + 0];
-            pixel[(c * b.imageType) + 1] = originalPixel[(x * b.imageType) + 1];
-            pixel[(c * b.imageType) + 2] = originalPixel[(x * b.imageType) + 2];
-            if (b.imageType == 4)
+            uint8_t *row = dst.row(y);
+            for (uint32_t i = 0; i < row_bytes; i++)
             {
-                pixel[(c * b.imageType) + 3] = originalPixel[(x * b.imageType) + 3];
+                row[i] = static_cast<uint8_t>(sums[i] >> shift);
             }
-            c++;
         }
-        while (c < b.bmp_info_header.width)
+    }, grain);
+}
+
+static void separableBlur(const BitmapView &src, const BitmapView &dst, const std::vector<uint32_t> &weights)
+{
+    checkSameShape(src, dst);
+    if (dst.empty())
+    {
+        return;
+    }
+    withPixelFormat(dst.bpp, [&](auto format) { separableBlur<decltype(format)>(src, dst, weights); });
+}
+
+// the 5x5 kernel {1, 4, 6, 4, 1} x {1, 4, 6, 4, 1} / 256, one axis at a time.
+static const uint32_t BLUR_UNIT = 1u << (BLUR_WEIGHT_BITS - 4);
+static const std::vector<uint32_t> BLUR_WEIGHTS = {1 * BLUR_UNIT, 4 * BLUR_UNIT, 6 * BLUR_UNIT, 4 * BLUR_UNIT, 1 * BLUR_UNIT};
+
+/**
+ * fixed point gaussian weights for gaussianBlur. The rounding error goes
+ * to the centre tap, so flat areas keep their exact value.
+ *
+ * @param radius kernel reach in pixels, 0 picks ceil(3 * sigma).
+ */
+static std::vector<uint32_t> gaussianWeights(double sigma, uint32_t radius)
+{
+    if (radius == 0)
+    {
+        radius = std::max(1u, static_cast<uint32_t>(std::ceil(3 * sigma)));
+    }
+
+    std::vector<double> exact(2 * radius + 1);
+    double total = 0;
+    for (uint32_t i = 0; i < exact.size(); i++)
+    {
+        double d = static_cast<double>(i) - radius;
+        exact[i] = std::exp(-(d * d) / (2 * sigma * sigma));
+        total += exact[i];
+    }
+
+    std::vector<uint32_t> weights(exact.size());
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < exact.size(); i++)
+    {
+        weights[i] = static_cast<uint32_t>(std::lround(exact[i] / total * (1u << BLUR_WEIGHT_BITS)));
+        sum += weights[i];
+    }
+    weights[radius] += (1u << BLUR_WEIGHT_BITS) - sum;
+    return weights;
+}
+
+/**
+ * blur src into dst with the 5x5 kernel of blur(Bitmap &).
+ */
+void blur(BitmapView src, BitmapView dst)
+{
+    separableBlur(src, dst, BLUR_WEIGHTS);
+}
+
+/**
+ * gaussian blur src into dst.
+ */
+void gaussianBlur(BitmapView src, BitmapView dst, double sigma, uint32_t radius)
+{
+    checkSameShape(src, dst);
+    if (sigma <= 0)
+    {
+        if (src.pixels != dst.pixels)
         {
-            pixel[(c * b.imageType) + 0] = 0;
-            pixel[(c * b.imageType) + 1] = 0;
-            pixel[(c * b.imageType) + 2] = 0;
-            if (b.imageType == 4)
-            {
-                pixel[(c * b.imageType) + 3] = 0;
-            }
-            c++;
+            forEachRow(src, dst, [](uint8_t *) {});
+        }
+        return;
+    }
+    separableBlur(src, dst, gaussianWeights(sigma, radius));
+}
+
+/**
+ * Use gaussian bluring to blur an image.
+ */
+void blur(Bitmap &b)
+{
+    TRACE_SCOPE("blur", b.pixel_bytes());
+    blur(b.view(), b.view());
+}
+
+/**
+ * Gaussian blur with the given standard deviation.
+ */
+void gaussianBlur(Bitmap &b, double sigma, uint32_t radius)
+{
+    TRACE_SCOPE("gaussianBlur", b.pixel_bytes());
+    gaussianBlur(b.view(), b.view(), sigma, radius);
+}
+
+// pixels per side of the tiles copied together, sized so a source
+// and destination tile of 4 byte pixels fit in L1.
+static const uint32_t TRANSPOSE_TILE = 32;
+
+// pixels per side of the blocks handed to one thread, sized for L2.
+static const uint32_t TRANSPOSE_BLOCK = 256;
+
+/**
+ * Copy one block of the transposed image, TRANSPOSE_TILE square tiles
+ * at a time. Destination row i comes from source column i (or
+ * width - 1 - i with mirror_rows) and destination column j from source
+ * row j (or height - 1 - j with mirror_columns).
+ */
+template <typename Format>
+static void transposeBlock(const BitmapView &src, const BitmapView &dst, bool mirror_rows, bool mirror_columns,
+                           uint32_t i_first, uint32_t i_last, uint32_t j_first, uint32_t j_last)
+{
+    const uint32_t bpp = Format::channels;
+    for (uint32_t ti = i_first; ti < i_last; ti += TRANSPOSE_TILE)
+    {
+        uint32_t ti_last = std::min(ti + TRANSPOSE_TILE, i_last);
+        for (uint32_t tj = j_first; tj < j_last; tj += TRANSPOSE_TILE)
+        {
+            uint32_t tj_last = std::min(tj + TRANSPOSE_TILE, j_last);
+            for (uint32_t i = ti; i < ti_last; i++)
+            {
+                uint32_t sx = mirror_rows ? src.width - 1 - i : i;
+                const uint8_t *column = src.pixels + static_cast<size_t>(sx) * bpp;
+                uint8_t *out = dst.row(i);
+                for (uint32_t j = tj; j < tj_last; j++)
+                {
+                    uint32_t sy = mirror_columns ? src.height - 1 - j : j;
+                    Pixel<Format>::load(column + static_cast<size_t>(src.pitch) * sy).store(out + static_cast<size_t>(j) * bpp);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Write the transpose of src, optionally mirrored, into dst. Blocks of
+ * destination rows are spread over the shared thread pool.
+ */
+static void transpose(const BitmapView &src, const BitmapView &dst, bool mirror_rows, bool mirror_columns)
+{
+    if (dst.width != src.height || dst.height != src.width || dst.bpp != src.bpp)
+    {
+        throw std::runtime_error("The destination view must be the source view turned on its side");
+    }
+    if (src.pixels == dst.pixels && !src.empty())
+    {
+        throw std::runtime_error("The image can not be turned on its side in place");
+    }
+    if (src.empty())
+    {
+        return;
+    }
+
+    const uint32_t blocks = (src.width + TRANSPOSE_BLOCK - 1) / TRANSPOSE_BLOCK;
+    withPixelFormat(src.bpp, [&](auto format) {
+        ThreadPool::shared().parallel_for(0, blocks, [&](uint32_t first, uint32_t last) {
+            for (uint32_t block = first; block < last; block++)
+            {
+                uint32_t i_first = block * TRANSPOSE_BLOCK;
+                uint32_t i_last = std::min<uint32_t>(i_first + TRANSPOSE_BLOCK, src.width);
+                for (uint32_t j = 0; j < src.height; j += TRANSPOSE_BLOCK)
+                {
+                    uint32_t j_last = std::min<uint32_t>(j + TRANSPOSE_BLOCK, src.height);
+                    transposeBlock<decltype(format)>(src, dst, mirror_rows, mirror_columns, i_first, i_last, j, j_last);
+                }
+            }
+        });
+    });
+}
+
+/**
+ * Replace the image with its transpose, optionally mirrored, swapping
+ * the height and width.
+ */
+static void transposeImage(Bitmap &b, bool mirror_rows, bool mirror_columns)
+{
+    const int32_t width = b.bmp_info_header.width;
+    const int32_t height = b.bmp_info_header.height;
+    if (width <= 0 || height <= 0)
+    {
+        return;
+    }
+
+    const uint32_t dst_stride = height * b.imageType;
+    PixelVector rotated(static_cast<size_t>(dst_stride) * width);
+    transpose(b.view(), BitmapView(rotated.data(), height, width, dst_stride, b.imageType), mirror_rows, mirror_columns);
+
+    std::swap(b.bmp_info_header.x_pixels_per_meter, b.bmp_info_header.y_pixels_per_meter);
+    b.reshape(height, width, rotated);
+}
+
+/**
+ * rotate src 90 degrees clockwise into dst.
+ */
+void rot90(BitmapView src, BitmapView dst)
+{
+    transpose(src, dst, true, false);
+}
+
+/**
+ * rotate src 270 degrees clockwise into dst.
+ */
+void rot270(BitmapView src, BitmapView dst)
+{
+    transpose(src, dst, false, true);
+}
+
+/**
+ * flip src over the line y = -x into dst.
+ */
+void flipd1(BitmapView src, BitmapView dst)
+{
+    transpose(src, dst, true, true);
+}
+
+/**
+ * flip src over the line y = x into dst.
+ */
+void flipd2(BitmapView src, BitmapView dst)
+{
+    transpose(src, dst, false, false);
+}
+
+/**
+ * rotates image 90 degrees clockwise, swapping the height and width.
+ */
+void rot90(Bitmap &b)
+{
+    TRACE_SCOPE("rot90", b.pixel_bytes());
+    transposeImage(b, true, false);
+}
+
+/**
+ * the kernel that reverses the pixel order of a row in the given format.
+ */
+static void (*reverseKernel(const RowKernels &kernels, uint32_t bytes_per_pixel))(uint8_t *row, uint32_t width)
+{
+    return withPixelFormat(bytes_per_pixel, [&](auto format) {
+        typedef decltype(format) Format;
+        return Format::channels == 1 ? kernels.reverse8 : (Format::channels == 3 ? kernels.reverse24 : kernels.reverse32);
+    });
+}
+
+/**
+ * rotate src by 180 degrees into dst.
+ * In place each row is reversed and swapped with its mirror row;
+ * otherwise each row is copied to its mirror row and reversed there.
+ */
+void rot180(BitmapView src, BitmapView dst)
+{
+    checkSameShape(src, dst);
+    if (dst.empty())
+    {
+        return;
+    }
+    const RowKernels &kernels = rowKernels();
+    const uint32_t width = dst.width;
+    const uint32_t height = dst.height;
+    const uint32_t bytes = width * dst.bpp;
+    void (*const reverse)(uint8_t *, uint32_t) = reverseKernel(kernels, dst.bpp);
+    if (src.pixels != dst.pixels)
+    {
+        for (uint32_t y = 0; y < height; ++y)
+        {
+            memcpy(dst.row(y), src.row(height - 1 - y), bytes);
+            reverse(dst.row(y), width);
+        }
+        return;
+    }
+    for (uint32_t y = 0; y < height / 2; ++y)
+    {
+        uint8_t *top = dst.row(y);
+        uint8_t *bottom = dst.row(height - 1 - y);
+        reverse(top, width);
+        reverse(bottom, width);
+        kernels.swapRows(top, bottom, bytes);
+    }
+    if (height % 2 == 1)
+    {
+        reverse(dst.row(height / 2), width);
+    }
+}
+
+/**
+ * rotates an image by 180 degrees.
+ * Done in place: each row is reversed and swapped with its mirror row.
+ */
+void rot180(Bitmap &b)
+{
+    TRACE_SCOPE("rot180", b.pixel_bytes());
+    rot180(b.view(), b.view());
+}
+
+/**
+ * rotates image 270 degrees clockwise, swapping the height and width.
+ */
+void rot270(Bitmap &b)
+{
+    TRACE_SCOPE("rot270", b.pixel_bytes());
+    transposeImage(b, false, true);
+}
+
+/**
+ * flip src over the vertical axis into dst: in place by swapping each
+ * row with its mirror row, otherwise by copying it there.
+ */
+void flipv(BitmapView src, BitmapView dst)
+{
+    checkSameShape(src, dst);
+    if (dst.empty())
+    {
+        return;
+    }
+    const RowKernels &kernels = rowKernels();
+    const uint32_t height = dst.height;
+    const uint32_t bytes = dst.width * dst.bpp;
+    if (src.pixels != dst.pixels)
+    {
+        for (uint32_t y = 0; y < height; ++y)
+        {
+            memcpy(dst.row(y), src.row(height - 1 - y), bytes);
+        }
+        return;
+    }
+    for (uint32_t y = 0; y < height / 2; ++y)
+    {
+        kernels.swapRows(dst.row(y), dst.row(height - 1 - y), bytes);
+    }
+}
+
+/**
+ * flips and image over the vertical axis.
+ * Done in place by swapping each row with its mirror row.
+ */
+void flipv(Bitmap &b)
+{
+    TRACE_SCOPE("flipv", b.pixel_bytes());
+    flipv(b.view(), b.view());
+}
+
+/**
+ * flip src over the horizontal axis into dst by reversing the pixels of each row.
+ */
+void fliph(BitmapView src, BitmapView dst)
+{
+    checkSameShape(src, dst);
+    if (dst.empty())
+    {
+        return;
+    }
+    void (*const reverse)(uint8_t *, uint32_t) = reverseKernel(rowKernels(), dst.bpp);
+    const uint32_t bytes = dst.width * dst.bpp;
+    for (uint32_t y = 0; y < dst.height; ++y)
+    {
+        if (src.pixels != dst.pixels)
+        {
+            memcpy(dst.row(y), src.row(y), bytes);
+        }
+        reverse(dst.row(y), dst.width);
+    }
+}
+
+/**
+ * flips and image over the horizontal axis.
+ * Done in place by reversing the pixels of each row.
+ */
+void fliph(Bitmap &b)
+{
+    TRACE_SCOPE("fliph", b.pixel_bytes());
+    fliph(b.view(), b.view());
+}
+
+/**
+ * flips and image over the line y = -x, swapping the height and width.
+ */
+void flipd1(Bitmap &b)
+{
+    TRACE_SCOPE("flipd1", b.pixel_bytes());
+    transposeImage(b, true, true);
+}
+
+/**
+ * flips and image over the line y = xr, swapping the height and width.
+ */
+void flipd2(Bitmap &b)
+{
+    TRACE_SCOPE("flipd2", b.pixel_bytes());
+    transposeImage(b, false, false);
+}
+
+/**
+ * Precomputed taps of a 1-D resampling: output i reads taps source
+ * samples starting at first[i], weighted by weights[i * taps + k].
+ */
+struct ResampleTable
+{
+    uint32_t taps{0};
+    std::vector<uint32_t> first;
+    std::vector<int16_t> weights;
+};
+
+/**
+ * half width of the filter at scale 1, in source pixels.
+ */
+static double resampleSupport(ResizeFilter filter)
+{
+    switch (filter)
+    {
+    case ResizeFilter::Bilinear:
+        return 1.0;
+    case ResizeFilter::Lanczos3:
+        return 3.0;
+    default:
+        return 0.5;
+    }
+}
+
+static double sinc(double x)
+{
+    if (x == 0.0)
+    {
+        return 1.0;
+    }
+    x *= M_PI;
+    return std::sin(x) / x;
+}
+
+/**
+ * the filter kernel at distance x from the sample centre.
+ */
+static double resampleKernel(ResizeFilter filter, double x)
+{
+    switch (filter)
+    {
+    case ResizeFilter::Bilinear:
+        x = std::fabs(x);
+        return x < 1.0 ? 1.0 - x : 0.0;
+    case ResizeFilter::Lanczos3:
+        return (x > -3.0 && x < 3.0) ? sinc(x) * sinc(x / 3.0) : 0.0;
+    default:
+        return (x > -0.5 && x <= 0.5) ? 1.0 : 0.0;
+    }
+}
+
+/**
+ * Work out which source samples each output sample reads and with what
+ * weight. Weights are normalised, then rounded to fixed point with the
+ * rounding error given to the largest tap so flat areas stay exact.
+ */
+static ResampleTable buildResampleTable(uint32_t src_size, uint32_t dst_size, ResizeFilter filter)
+{
+    const double scale = static_cast<double>(src_size) / dst_size;
+    const double filter_scale = std::max(scale, 1.0);
+    const double support = resampleSupport(filter) * filter_scale;
+
+    ResampleTable table;
+    table.taps = std::min<uint32_t>(static_cast<uint32_t>(std::ceil(support)) * 2 + 1, src_size);
+    table.first.resize(dst_size);
+    table.weights.assign(static_cast<size_t>(dst_size) * table.taps, 0);
+
+    std::vector<double> exact(table.taps);
+    for (uint32_t i = 0; i < dst_size; i++)
+    {
+        double centre = (i + 0.5) * scale;
+        int64_t lo = std::max<int64_t>(static_cast<int64_t>(centre - support + 0.5), 0);
+        int64_t hi = std::min<int64_t>(static_cast<int64_t>(centre + support + 0.5), src_size);
+        hi = std::min<int64_t>(hi, lo + table.taps);
+        uint32_t first = static_cast<uint32_t>(std::min<int64_t>(lo, src_size - table.taps));
+        table.first[i] = first;
+
+        double total = 0;
+        std::fill(exact.begin(), exact.end(), 0.0);
+        for (int64_t x = lo; x < hi; x++)
+        {
+            double w = resampleKernel(filter, (x - centre + 0.5) / filter_scale);
+            exact[x - first] = w;
+            total += w;
+        }
+        if (total == 0)
+        {
+            // the filter fell between samples: take the nearest one.
+            int64_t nearest = std::min<int64_t>(static_cast<int64_t>(centre), src_size - 1);
+            exact[nearest - first] = 1;
+            total = 1;
+        }
+
+        int16_t *weights = &table.weights[static_cast<size_t>(i) * table.taps];
+        int32_t sum = 0;
+        uint32_t largest = 0;
+        for (uint32_t k = 0; k < table.taps; k++)
+        {
+            weights[k] = static_cast<int16_t>(std::lround(exact[k] / total * (1 << RESAMPLE_WEIGHT_BITS)));
+            sum += weights[k];
+            if (weights[k] > weights[largest])
+            {
+                largest = k;
+            }
+        }
+        weights[largest] += static_cast<int16_t>((1 << RESAMPLE_WEIGHT_BITS) - sum);
+    }
+    return table;
+}
+
+/**
+ * Horizontal pass over one row of 8 bit pixels, which have no row kernel.
+ */
+template <typename Format>
+static void resampleRow(const uint8_t *src, uint8_t *dst, const ResampleTable &table, uint32_t dst_width)
+{
+    const uint32_t C = Format::channels;
+    const uint32_t taps = table.taps;
+    for (uint32_t x = 0; x < dst_width; x++)
+    {
+        const uint8_t *in = src + static_cast<size_t>(table.first[x]) * C;
+        const int16_t *weights = &table.weights[static_cast<size_t>(x) * taps];
+        int32_t sum[C];
+        for (uint32_t c = 0; c < C; c++)
+        {
+            sum[c] = 1 << (RESAMPLE_WEIGHT_BITS - 1);
+        }
+        for (uint32_t k = 0; k < taps; k++)
+        {
+            for (uint32_t c = 0; c < C; c++)
+            {
+                sum[c] += in[k * C + c] * weights[k];
+            }
+        }
+        for (uint32_t c = 0; c < C; c++)
+        {
+            int32_t v = sum[c] >> RESAMPLE_WEIGHT_BITS;
+            dst[x * C + c] = static_cast<uint8_t>(v < 0 ? 0 : (v > 255 ? 255 : v));
+        }
+    }
+}
+
+/**
+ * Nearest neighbour resize: every output pixel is a copy of one input pixel.
+ */
+template <typename Format>
+static void resizeNearest(const BitmapView &src, const BitmapView &dst)
+{
+    const uint32_t bpp = Format::channels;
+    std::vector<uint32_t> columns(dst.width);
+    for (uint32_t x = 0; x < dst.width; x++)
+    {
+        columns[x] = std::min<uint32_t>(static_cast<uint32_t>((x + 0.5) * src.width / dst.width), src.width - 1) * bpp;
+    }
+
+    ThreadPool::shared().parallel_for(0, dst.height, [&](uint32_t first, uint32_t last) {
+        for (uint32_t y = first; y < last; y++)
+        {
+            uint32_t sy = std::min<uint32_t>(static_cast<uint32_t>((y + 0.5) * src.height / dst.height), src.height - 1);
+            const uint8_t *in = src.row(sy);
+            uint8_t *out = dst.row(y);
+            for (uint32_t x = 0; x < dst.width; x++)
+            {
+                Pixel<Format>::load(in + columns[x]).store(out + x * bpp);
+            }
+        }
+    });
+}
+
+/**
+ * resample src to the size of dst.
+ */
+void resize(BitmapView src, BitmapView dst, ResizeFilter filter)
+{
+    if (src.bpp != dst.bpp)
+    {
+        throw std::runtime_error("The source and destination views must have the same format");
+    }
+    if (src.empty() || dst.empty())
+    {
+        return;
+    }
+
+    const uint32_t width = dst.width;
+    const uint32_t height = dst.height;
+    const uint32_t bpp = dst.bpp;
+    ThreadPool &pool = ThreadPool::shared();
+
+    if (filter == ResizeFilter::Nearest)
+    {
+        withPixelFormat(bpp, [&](auto format) { resizeNearest<decltype(format)>(src, dst); });
+        return;
+    }
+
+    // horizontal pass into scratch rows, skipped when the width stays the same.
+    BitmapView rows = src;
+    PixelVector scratch;
+    if (width != src.width)
+    {
+        ResampleTable table = buildResampleTable(src.width, width, filter);
+        scratch.resize(static_cast<size_t>(width) * bpp * src.height);
+        rows = BitmapView(scratch.data(), width, src.height, width * bpp, bpp);
+        const RowKernels &kernels = rowKernels();
+        void (*const resample)(const uint8_t *, uint32_t, const uint32_t *, const int16_t *, uint32_t, uint8_t *, uint32_t) =
+            bpp == 3 ? kernels.resampleRow24 : (bpp == 4 ? kernels.resampleRow32 : nullptr);
+        pool.parallel_for(0, src.height, [&](uint32_t first, uint32_t last) {
+            for (uint32_t y = first; y < last; y++)
+            {
+                if (resample)
+                {
+                    resample(src.row(y), src.width, table.first.data(), table.weights.data(), table.taps, rows.row(y), width);
+                }
+                else
+                {
+                    resampleRow<Gray8>(src.row(y), rows.row(y), table, width);
+                }
+            }
+        });
+    }
+
+    // vertical pass from the scratch rows into the output.
+    if (height != src.height)
+    {
+        ResampleTable table = buildResampleTable(src.height, height, filter);
+        const RowKernels &kernels = rowKernels();
+        pool.parallel_for(0, height, [&](uint32_t first, uint32_t last) {
+            std::vector<const uint8_t *> taps(table.taps);
+            for (uint32_t y = first; y < last; y++)
+            {
+                for (uint32_t k = 0; k < table.taps; k++)
+                {
+                    taps[k] = rows.row(table.first[y] + k);
+                }
+                kernels.resampleColumn(taps.data(), &table.weights[static_cast<size_t>(y) * table.taps], table.taps,
+                                       dst.row(y), width * bpp);
+            }
+        });
+    }
+    else
+    {
+        for (uint32_t y = 0; y < height; y++)
+        {
+            memcpy(dst.row(y), rows.row(y), width * bpp);
+        }
+    }
+}
+
+/**
+ * resample the image to the given size.
+ *
+ * @throws runtime_error if width or height is not positive.
+ */
+void resize(Bitmap &b, int32_t width, int32_t height, ResizeFilter filter)
+{
+    TRACE_SCOPE("resize", b.pixel_bytes());
+    if (width <= 0 || height <= 0)
+    {
+        throw std::runtime_error("The image size must be positive");
+    }
+    if (b.bmp_info_header.width <= 0 || b.bmp_info_header.height <= 0)
+    {
+        return;
+    }
+
+    const uint32_t dst_stride = width * b.imageType;
+    PixelVector resized(static_cast<size_t>(dst_stride) * height);
+    resize(b.view(), BitmapView(resized.data(), width, height, dst_stride, b.imageType), filter);
+    b.reshape(width, height, resized);
+}
+
+/**
+ * scales the image by a factor of 2, repeating each pixel.
+ */
+void scaleUp(Bitmap &b)
+{
+    resize(b, b.bmp_info_header.width * 2, b.bmp_info_header.height * 2, ResizeFilter::Nearest);
+}
+
+/**
+ * scales the image by a factor of 1/2, averaging each 2x2 block.
+ */
+void scaleDown(Bitmap &b)
+{
+    resize(b, std::max(b.bmp_info_header.width / 2, 1), std::max(b.bmp_info_header.height / 2, 1), ResizeFilter::Box);
+}
+
+/**
+ * the pixels of one level.
+ */
+BitmapView Pyramid::level(uint32_t index)
+{
+    const Level &found = levels.at(index);
+    return BitmapView(pixels.data() + found.offset, found.width, found.height, found.width * bpp, bpp);
+}
+
+/**
+ * average the 2x2 blocks of two rows width pixels wide into out.
+ */
+static void halveRow(const RowKernels &kernels, uint32_t bpp, const uint8_t *top, const uint8_t *bottom,
+                     uint8_t *out, uint32_t width)
+{
+    const uint32_t pairs = width / 2;
+    if (bpp == 3)
+    {
+        kernels.halveRows24(top, bottom, out, pairs);
+    }
+    else
+    {
+        kernels.halveRows32(top, bottom, out, pairs);
+    }
+    if (width & 1)
+    {
+        // the last column pairs with itself, which leaves the average of the rows.
+        const size_t last = static_cast<size_t>(pairs) * 2 * bpp;
+        for (uint32_t c = 0; c < bpp; c++)
+        {
+            out[static_cast<size_t>(pairs) * bpp + c] = static_cast<uint8_t>((top[last + c] + bottom[last + c]) >> 1);
+        }
+    }
+}
+
+/**
+ * Make row y of views[k] from two rows of views[k - 1]. A row that
+ * finishes a pair, or ends its level, goes on to make the row below it
+ * in views[k + 1], up to views[last].
+ */
+static void cascadeRow(const RowKernels &kernels, const std::vector<BitmapView> &views, uint32_t k, uint32_t y, uint32_t last)
+{
+    const BitmapView &src = views[k - 1];
+    const BitmapView &dst = views[k];
+    halveRow(kernels, dst.bpp, src.row(2 * y), src.row(std::min(2 * y + 1, src.height - 1)), dst.row(y), src.width);
+    if (k < last && ((y & 1) || y + 1 == dst.height))
+    {
+        cascadeRow(kernels, views, k + 1, y / 2, last);
+    }
+}
+
+// levels made from one block of rows; a block is 2^PYRAMID_BLOCK_LEVELS rows.
+static const uint32_t PYRAMID_BLOCK_LEVELS = 4;
+
+/**
+ * Build the reduced levels of b in one allocation.
+ *
+ * The rows are cut into blocks of 16, and each block makes its rows of
+ * the first four levels in one go, so rows are halved again while they
+ * are still in cache. Blocks share no rows and run in parallel. Levels
+ * past the fourth are made the same way from the fourth, which is 1/256
+ * of the image.
+ */
+Pyramid buildPyramid(Bitmap &b, uint32_t levels)
+{
+    TRACE_SCOPE("pyramid", b.pixel_bytes());
+    Pyramid pyramid;
+    if (b.bmp_info_header.width <= 0 || b.bmp_info_header.height <= 0)
+    {
+        return pyramid;
+    }
+    if (b.bmp_info_header.bit_count != 24 && b.bmp_info_header.bit_count != 32)
+    {
+        throw std::runtime_error("The program can treat only 24 or 32 bits per pixel BMP files");
+    }
+
+    std::vector<BitmapView> views(1, b.view());
+    pyramid.bpp = views[0].bpp;
+    uint32_t width = views[0].width;
+    uint32_t height = views[0].height;
+    size_t size = 0;
+    while ((width > 1 || height > 1) && (levels == 0 || pyramid.levels.size() < levels))
+    {
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+        pyramid.levels.push_back(Pyramid::Level{size, width, height});
+        size += (static_cast<size_t>(width) * pyramid.bpp * height + 63) & ~static_cast<size_t>(63);
+    }
+    pyramid.pixels.resize(size);
+    for (uint32_t i = 0; i < pyramid.levels.size(); i++)
+    {
+        views.push_back(pyramid.level(i));
+    }
+
+    const RowKernels &kernels = rowKernels();
+    const uint32_t count = static_cast<uint32_t>(pyramid.levels.size());
+    for (uint32_t done = 0; done < count;)
+    {
+        const uint32_t step = std::min(count - done, PYRAMID_BLOCK_LEVELS);
+        const uint32_t block_rows = 1u << step;
+        const uint32_t blocks = (views[done].height + block_rows - 1) / block_rows;
+        const uint32_t next_height = views[done + 1].height;
+        ThreadPool::shared().parallel_for(0, blocks, [&](uint32_t first, uint32_t last) {
+            for (uint32_t block = first; block < last; block++)
+            {
+                const uint32_t end = std::min((block + 1) << (step - 1), next_height);
+                for (uint32_t y = block << (step - 1); y < end; y++)
+                {
+                    cascadeRow(kernels, views, done + 1, y, done + step);
+                }
+            }
+        });
+        done += step;
+    }
+    return pyramid;
+}
+
+/**
+ * split the pixels of a 24 or 32 bit bitmap into planes.
+ */
+PlanarBitmap::PlanarBitmap(const Bitmap &b)
+{
+    load(b);
+}
+
+/**
+ * change the size and number of planes. The storage is only reallocated
+ * when it grows; PoolAllocator aligns it to ALIGNMENT.
+ */
+void PlanarBitmap::reshape(uint32_t width, uint32_t height, uint32_t channels)
+{
+    const uint32_t pitch = (width + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    storage.resize(static_cast<size_t>(pitch) * height * channels);
+    plane_width = width;
+    plane_height = height;
+    plane_count = channels;
+    plane_pitch = pitch;
+}
+
+uint32_t PlanarBitmap::width() const
+{
+    return plane_width;
+}
+
+uint32_t PlanarBitmap::height() const
+{
+    return plane_height;
+}
+
+uint32_t PlanarBitmap::channels() const
+{
+    return plane_count;
+}
+
+uint32_t PlanarBitmap::pitch() const
+{
+    return plane_pitch;
+}
+
+/**
+ * a one byte per pixel view of a plane.
+ */
+BitmapView PlanarBitmap::plane(uint32_t channel)
+{
+    return BitmapView(row(channel, 0), plane_width, plane_height, plane_pitch, 1);
+}
+
+uint8_t *PlanarBitmap::row(uint32_t channel, uint32_t y)
+{
+    return storage.data() + (static_cast<size_t>(channel) * plane_height + y) * plane_pitch;
+}
+
+const uint8_t *PlanarBitmap::row(uint32_t channel, uint32_t y) const
+{
+    return storage.data() + (static_cast<size_t>(channel) * plane_height + y) * plane_pitch;
+}
+
+/**
+ * Run op(first, last) over the plane rows, spread over the shared pool.
+ */
+template <typename RowsOp>
+static void forEachPlaneRows(const PlanarBitmap &p, RowsOp op)
+{
+    if (p.width() == 0 || p.height() == 0)
+    {
+        return;
+    }
+    const uint32_t grain = std::max<uint32_t>(1, (256 * 1024) / (p.pitch() * p.channels()));
+    ThreadPool::shared().parallel_for(0, p.height(), op, grain);
+}
+
+/**
+ * split the pixels of a 24 or 32 bit bitmap into planes.
+ */
+void PlanarBitmap::load(const Bitmap &b)
+{
+    if (b.imageType != 3 && b.imageType != 4)
+    {
+        throw std::runtime_error("The program can treat only 24 or 32 bits per pixel BMP files");
+    }
+    reshape(std::max(b.bmp_info_header.width, 0), std::max(b.bmp_info_header.height, 0), b.imageType);
+
+    const RowKernels &kernels = rowKernels();
+    void (*const split)(const uint8_t *, uint8_t *const *, uint32_t) =
+        plane_count == 3 ? kernels.splitPlanes24 : kernels.splitPlanes32;
+    const uint8_t *pixels = b.pixels();
+    const uint32_t stride = b.row_stride;
+    forEachPlaneRows(*this, [&](uint32_t first, uint32_t last) {
+        for (uint32_t y = first; y < last; y++)
+        {
+            uint8_t *planes[4] = {row(0, y), row(1, y), row(2, y), plane_count == 4 ? row(3, y) : nullptr};
+            split(pixels + static_cast<size_t>(stride) * y, planes, plane_width);
+        }
+    });
+}
+
+/**
+ * interleave the planes back into the pixels of b.
+ */
+void PlanarBitmap::store(Bitmap &b) const
+{
+    if (b.imageType != plane_count)
+    {
+        throw std::runtime_error("The bitmap and the planes have a different number of components");
+    }
+    if (b.bmp_info_header.width != static_cast<int32_t>(plane_width) ||
+        b.bmp_info_header.height != static_cast<int32_t>(plane_height))
+    {
+        b.reshape(plane_width, plane_height);
+    }
+
+    const RowKernels &kernels = rowKernels();
+    void (*const merge)(const uint8_t *const *, uint8_t *, uint32_t) =
+        plane_count == 3 ? kernels.mergePlanes24 : kernels.mergePlanes32;
+    uint8_t *pixels = b.pixels();
+    const uint32_t stride = b.row_stride;
+    forEachPlaneRows(*this, [&](uint32_t first, uint32_t last) {
+        for (uint32_t y = first; y < last; y++)
+        {
+            const uint8_t *planes[4] = {row(0, y), row(1, y), row(2, y), plane_count == 4 ? row(3, y) : nullptr};
+            merge(planes, pixels + static_cast<size_t>(stride) * y, plane_width);
+        }
+    });
+}
+
+/**
+ * cell shade each plane; the rows of a plane are contiguous, padding
+ * included, so a whole run of rows is one kernel call.
+ */
+void cellShade(PlanarBitmap &p)
+{
+    const RowKernels &kernels = rowKernels();
+    forEachPlaneRows(p, [&](uint32_t first, uint32_t last) {
+        for (uint32_t c = 0; c < p.channels(); c++)
+        {
+            kernels.cellShade(p.row(c, first), (last - first) * p.pitch());
+        }
+    });
+}
+
+/**
+ * set every plane to the average of the planes.
+ */
+void grayscale(PlanarBitmap &p)
+{
+    const RowKernels &kernels = rowKernels();
+    void (*const gray)(uint8_t *const *, uint32_t) =
+        p.channels() == 3 ? kernels.grayscalePlanes24 : kernels.grayscalePlanes32;
+    forEachPlaneRows(p, [&](uint32_t first, uint32_t last) {
+        for (uint32_t y = first; y < last; y++)
+        {
+            uint8_t *planes[4] = {p.row(0, y), p.row(1, y), p.row(2, y), p.channels() == 4 ? p.row(3, y) : nullptr};
+            gray(planes, p.width());
+        }
+    });
+}
+
+/**
+ * blur each plane as a one byte per pixel image.
+ */
+void blur(PlanarBitmap &p)
+{
+    for (uint32_t c = 0; c < p.channels(); c++)
+    {
+        blur(p.plane(c), p.plane(c));
+    }
+}
+
+/**
+ * gaussian blur each plane.
+ */
+void gaussianBlur(PlanarBitmap &p, double sigma, uint32_t radius)
+{
+    for (uint32_t c = 0; c < p.channels(); c++)
+    {
+        gaussianBlur(p.plane(c), p.plane(c), sigma, radius);
+    }
+}
+
+/**
+ * rotates the planes by 180 degrees.
+ */
+void rot180(PlanarBitmap &p)
+{
+    for (uint32_t c = 0; c < p.channels(); c++)
+    {
+        rot180(p.plane(c), p.plane(c));
+    }
+}
+
+/**
+ * flips the planes over the vertical axis.
+ */
+void flipv(PlanarBitmap &p)
+{
+    for (uint32_t c = 0; c < p.channels(); c++)
+    {
+        flipv(p.plane(c), p.plane(c));
+    }
+}
+
+/**
+ * flips the planes over the horizontal axis.
+ */
+void fliph(PlanarBitmap &p)
+{
+    for (uint32_t c = 0; c < p.channels(); c++)
+    {
+        fliph(p.plane(c), p.plane(c));
+    }
+}
+
+/**
+ * the filters of this file and their names.
+ */
+struct NamedFilter
+{
+    void (*filter)(Bitmap &b);
+    const char *name;
+};
+
+static const NamedFilter NAMED_FILTERS[] = {
+    {grayscale, "grayscale"},
+    {cellShade, "cellShade"},
+    {pixelate, "pixelate"},
+    {blur, "blur"},
+    {rot90, "rot90"},
+    {rot180, "rot180"},
+    {rot270, "rot270"},
+    {flipv, "flipv"},
+    {fliph, "fliph"},
+    {flipd1, "flipd1"},
+    {flipd2, "flipd2"},
+    {scaleUp, "scaleUp"},
+    {scaleDown, "scaleDown"},
+};
+
+/**
+ * returns the name of one of the filters above, or "filter" for any other function.
+ */
+const char *filterName(void (*filter)(Bitmap &b))
+{
+    for (const NamedFilter &named : NAMED_FILTERS)
+    {
+        if (named.filter == filter)
+        {
+            return named.name;
+        }
+    }
+    return "filter";
+}
+
+/**
+ * returns the filter above with the given name, or nullptr.
+ */
+void (*filterByName(const std::string &name))(Bitmap &b)
+{
+    for (const NamedFilter &named : NAMED_FILTERS)
+    {
+        if (name == named.name)
+        {
+            return named.filter;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * looks up the band stage of a filter.
+ * @return false if the filter needs the whole image at once.
+ */
+static bool findBandStage(void (*filter)(Bitmap &b), BandStage &stage)
+{
+    // the filters are overloaded, so name the Bitmap versions.
+    void (*const grayscaleRows)(Bitmap &) = grayscale;
+    void (*const cellShadeRows)(Bitmap &) = cellShade;
+    void (*const fliphRows)(Bitmap &) = fliph;
+    void (*const blurRows)(Bitmap &) = blur;
+    void (*const pixelate16)(Bitmap &) = pixelate;
+    if (filter == grayscaleRows || filter == cellShadeRows || filter == fliphRows)
+    {
+        // fliph moves pixels across the whole row.
+        stage = BandStage{filterName(filter), filter, 0, 1, filter != fliphRows};
+        return true;
+    }
+    if (filter == blurRows)
+    {
+        stage = BandStage{"blur", blurRows, 2, 1, true};
+        return true;
+    }
+    if (filter == pixelate16)
+    {
+        // blocks start every 16 rows and columns, so a band must reach the end of its last block.
+        stage = BandStage{"pixelate", pixelate16, 16, 16, true};
+        return true;
+    }
+    return false;
+}
+
+/**
+ * returns the band stage for one of the filters above.
+ *
+ * @throws runtime_error if the filter needs the whole image at once.
+ */
+BandStage bandStage(void (*filter)(Bitmap &b))
+{
+    BandStage stage;
+    if (!findBandStage(filter, stage))
+    {
+        throw std::runtime_error("The filter needs the whole image and can not run on bands");
+    }
+    return stage;
+}
+
+/**
+ * total halo and common row alignment of a run of band stages.
+ */
+static void bandExtent(const std::vector<BandStage> &stages, uint32_t &halo, uint32_t &align)
+{
+    halo = 0;
+    align = 1;
+    for (const BandStage &stage : stages)
+    {
+        halo += stage.halo;
+        align = std::lcm(align, std::max<uint32_t>(stage.align, 1));
+    }
+}
+
+/**
+ * a bitmap with the headers of b and no pixels, used as a band window.
+ */
+static Bitmap bandWindow(const Bitmap &b)
+{
+    Bitmap window;
+    window.file_header = b.file_header;
+    window.bmp_info_header = b.bmp_info_header;
+    window.bmp_color_header = b.bmp_color_header;
+    window.row_stride = b.row_stride;
+    window.imageType = b.imageType;
+    return window;
+}
+
+/**
+ * Filter rows [first, last) of an image of the given height band by band.
+ *
+ * Each band is filtered inside a window that also holds the halo rows
+ * on either side. Every stage only spoils its own halo at the window
+ * edges, so the band rows come out as if the whole image had been
+ * filtered. read_row(y, dst) is asked for input rows in increasing
+ * order, each once, and always before row y is handed to
+ * write_row(y, src); finished rows are written in increasing order.
+ *
+ * @param window headers of the image, used as scratch for the bands.
+ */
+static void runBands(Bitmap &window, uint32_t first, uint32_t last, uint32_t height,
+                     const std::vector<BandStage> &stages, uint32_t band_rows,
+                     const std::function<void(uint32_t, uint8_t *)> &read_row,
+                     const std::function<void(uint32_t, const uint8_t *)> &write_row)
+{
+    const uint32_t stride = window.row_stride;
+    uint32_t halo_rows;
+    uint32_t align;
+    bandExtent(stages, halo_rows, align);
+    band_rows = std::max<uint32_t>(band_rows, 1);
+
+    // input rows [loaded_first, loaded_first + loaded_rows), kept for the next window.
+    PixelVector loaded;
+    uint32_t loaded_first = 0;
+    uint32_t loaded_rows = 0;
+
+    for (uint32_t band_first = first; band_first < last; band_first += band_rows)
+    {
+        uint32_t band_last = std::min(band_first + band_rows, last);
+        uint32_t window_first = band_first > halo_rows ? band_first - halo_rows : 0;
+        window_first -= window_first % align;
+        uint32_t window_last = std::min(band_last + halo_rows, height);
+        if (band_first == first)
+        {
+            loaded_first = window_first;
+        }
+
+        // drop the rows no later window needs, then read up to window_last.
+        uint32_t drop = window_first - loaded_first;
+        loaded.erase(loaded.begin(), loaded.begin() + static_cast<size_t>(drop) * stride);
+        loaded_first = window_first;
+        loaded_rows -= drop;
+        loaded.resize(static_cast<size_t>(window_last - loaded_first) * stride);
+        for (; loaded_first + loaded_rows < window_last; ++loaded_rows)
+        {
+            read_row(loaded_first + loaded_rows, loaded.data() + static_cast<size_t>(loaded_rows) * stride);
+        }
+
+        window.data.assign(loaded.begin(), loaded.end());
+        window.bmp_info_header.height = window_last - window_first;
+        for (const BandStage &stage : stages)
+        {
+            stage.filter(window);
+        }
+
+        for (uint32_t y = band_first; y < band_last; ++y)
+        {
+            write_row(y, window.pixels() + static_cast<size_t>(y - window_first) * stride);
+        }
+    }
+}
+
+/**
+ * append a filter to the chain.
+ * @throws runtime_error if the filter can not run on bands.
+ */
+BandPipeline &BandPipeline::add(void (*filter)(Bitmap &b))
+{
+    return add(bandStage(filter));
+}
+
+BandPipeline &BandPipeline::add(const BandStage &stage)
+{
+    stages.push_back(stage);
+    return *this;
+}
+
+/**
+ * total rows of context needed above and below a band.
+ */
+uint32_t BandPipeline::halo() const
+{
+    uint32_t total = 0;
+    for (const BandStage &stage : stages)
+    {
+        total += stage.halo;
+    }
+    return total;
+}
+
+/**
+ * read a bitmap from in, filter it band by band and write the result to out.
+ *
+ * Each band [first, last) is filtered inside a window that also holds
+ * halo() rows on either side. Every stage only spoils its own halo at
+ * the window edges, so the band rows come out as if the whole image had
+ * been filtered. Input rows shared with the next window are kept.
+ */
+void BandPipeline::run(std::istream &in, std::ostream &out, uint32_t band_rows)
+{
+    if (!in)
+    {
+        throw std::runtime_error("Unable to open the input image file.");
+    }
+    if (!out)
+    {
+        throw std::runtime_error("Unable to open the output image file.");
+    }
+
+    Bitmap window;
+    window.read_headers(in);
+    if (!in)
+    {
+        throw std::runtime_error("Unable to read the input image file.");
+    }
+    if (window.bmp_info_header.bit_count != 24 && window.bmp_info_header.bit_count != 32)
+    {
+        throw std::runtime_error("The program can treat only 24 or 32 bits per pixel BMP files");
+    }
+    // rows are filtered in file order, so they must be plain and bottom-up.
+    if (window.bmp_info_header.height < 0 || (window.bmp_info_header.compression != 0 && window.bmp_info_header.compression != 3))
+    {
+        throw std::runtime_error("Only uncompressed bottom-up BMP files can be streamed");
+    }
+    TRACE_SCOPE("stream", static_cast<uint64_t>(window.bmp_info_header.width) * window.bmp_info_header.height * (window.bmp_info_header.bit_count / 8));
+
+    const uint32_t height = window.bmp_info_header.height > 0 ? window.bmp_info_header.height : 0;
+    const uint32_t stride = window.row_stride;
+    const uint32_t padded_stride = window.make_stride_aligned(4);
+
+    window.bmp_info_header.size_image = padded_stride * height;
+    window.file_header.file_size = window.file_header.offset_data + window.bmp_info_header.size_image;
+    window.write_headers(out);
+
+    std::vector<uint8_t> padding_row(padded_stride - stride);
+    std::vector<uint8_t> skipped(padded_stride - stride);
+    runBands(window, 0, height, height, stages, band_rows,
+             [&](uint32_t, uint8_t *row) {
+                 in.read((char *)row, stride);
+                 in.read((char *)skipped.data(), skipped.size());
+                 if (!in)
+                 {
+                     throw std::runtime_error("Unable to read the input image file.");
+                 }
+             },
+             [&](uint32_t, const uint8_t *row) {
+                 out.write((const char *)row, stride);
+                 out.write((const char *)padding_row.data(), padding_row.size());
+             });
+    out.flush();
+    if (!out)
+    {
+        throw std::runtime_error("Unable to write the output image file.");
+    }
+}
+
+/**
+ * append one of the filters above; it is fused when it can run on bands.
+ */
+FilterChain &FilterChain::add(void (*filter)(Bitmap &b))
+{
+    Step step{filterName(filter), filter, false, BandStage{}, ""};
+    step.banded = findBandStage(filter, step.stage);
+    if (step.name != "filter")
+    {
+        step.key = step.name;
+    }
+    steps.push_back(step);
+    return *this;
+}
+
+/**
+ * append a band stage, fused with its neighbours.
+ */
+FilterChain &FilterChain::add(const BandStage &stage)
+{
+    Step step{stage.name, stage.filter, true, stage, ""};
+
+    // only the stages of bandStage() are known by their name.
+    BandStage known;
+    if (findBandStage(stage.filter, known) && strcmp(known.name, stage.name) == 0 && known.halo == stage.halo &&
+        known.align == stage.align && known.tiles == stage.tiles)
+    {
+        step.key = stage.name;
+    }
+    steps.push_back(step);
+    return *this;
+}
+
+/**
+ * append a filter that needs the whole image, known by name and key.
+ */
+FilterChain &FilterChain::add(const std::string &name, std::function<void(Bitmap &b)> filter, const std::string &key)
+{
+    steps.push_back(Step{name, filter, false, BandStage{}, key.empty() ? "" : name + "(" + key + ")"});
+    return *this;
+}
+
+/**
+ * split the chain into passes of fused band stages and whole-image filters.
+ */
+std::vector<ChainSegment> FilterChain::plan() const
+{
+    std::vector<ChainSegment> segments;
+    uint32_t fused_halo = 0;
+    for (const Step &step : steps)
+    {
+        if (!step.banded)
+        {
+            segments.push_back(ChainSegment{{}, step.name, step.filter});
+            continue;
+        }
+        bool extend = !segments.empty() && !segments.back().filter &&
+                      fused_halo + step.stage.halo <= MAX_FUSED_HALO;
+        if (!extend)
+        {
+            segments.push_back(ChainSegment{});
+            fused_halo = 0;
+        }
+        segments.back().stages.push_back(step.stage);
+        fused_halo += step.stage.halo;
+    }
+    return segments;
+}
+
+/**
+ * the step keys separated by commas, or nothing if a step has none.
+ */
+std::string FilterChain::signature() const
+{
+    std::string names;
+    for (const Step &step : steps)
+    {
+        if (step.key.empty())
+        {
+            return "";
+        }
+        names += step.key;
+        names += ',';
+    }
+    return names;
+}
+
+/**
+ * Run fused band stages over the bitmap in place.
+ *
+ * The image is cut into one stripe of rows per thread. A stripe reads
+ * the rows just outside it from a copy taken up front, since the
+ * neighbouring stripe may already have overwritten them; rows inside
+ * the stripe are always read before the stripe writes them.
+ */
+static void runFused(Bitmap &b, const std::vector<BandStage> &stages, uint32_t band_rows)
+{
+    const uint32_t height = b.bmp_info_header.height;
+    const uint32_t stride = b.row_stride;
+    uint32_t halo_rows;
+    uint32_t align;
+    bandExtent(stages, halo_rows, align);
+    if (band_rows == 0)
+    {
+        band_rows = std::max<uint32_t>(1, (256 * 1024) / std::max<uint32_t>(stride, 1));
+    }
+    band_rows = std::max(band_rows, 2 * halo_rows);
+
+    ThreadPool &pool = ThreadPool::shared();
+    const uint32_t stripes = std::max<uint32_t>(1, std::min<uint32_t>(pool.size(), height / (4 * band_rows)));
+    const uint32_t stripe_rows = (height + stripes - 1) / stripes;
+
+    // rows [above_first, stripe start) and [stripe end, below_last) of each stripe.
+    struct Edges
+    {
+        uint32_t first;
+        uint32_t last;
+        uint32_t above_first;
+        uint32_t below_last;
+        std::vector<uint8_t> above;
+        std::vector<uint8_t> below;
+    };
+    std::vector<Edges> edges(stripes);
+    uint8_t *pixels = b.pixels();
+    for (uint32_t s = 0; s < stripes; s++)
+    {
+        Edges &edge = edges[s];
+        edge.first = std::min(s * stripe_rows, height);
+        edge.last = std::min(edge.first + stripe_rows, height);
+        edge.above_first = edge.first > halo_rows ? edge.first - halo_rows : 0;
+        edge.above_first -= edge.above_first % align;
+        edge.below_last = std::min(edge.last + halo_rows, height);
+        edge.above.assign(pixels + static_cast<size_t>(stride) * edge.above_first, pixels + static_cast<size_t>(stride) * edge.first);
+        edge.below.assign(pixels + static_cast<size_t>(stride) * edge.last, pixels + static_cast<size_t>(stride) * edge.below_last);
+    }
+
+    pool.parallel_for(0, stripes, [&](uint32_t first, uint32_t last) {
+        for (uint32_t s = first; s < last; s++)
+        {
+            const Edges &edge = edges[s];
+            Bitmap window = bandWindow(b);
+            runBands(window, edge.first, edge.last, height, stages, band_rows,
+                     [&](uint32_t y, uint8_t *row) {
+                         const uint8_t *src;
+                         if (y < edge.first)
+                         {
+                             src = edge.above.data() + static_cast<size_t>(y - edge.above_first) * stride;
+                         }
+                         else if (y >= edge.last)
+                         {
+                             src = edge.below.data() + static_cast<size_t>(y - edge.last) * stride;
+                         }
+                         else
+                         {
+                             src = pixels + static_cast<size_t>(stride) * y;
+                         }
+                         memcpy(row, src, stride);
+                     },
+                     [&](uint32_t y, const uint8_t *row) {
+                         memcpy(pixels + static_cast<size_t>(stride) * y, row, stride);
+                     });
+        }
+    }, 1);
+}
+
+#ifndef BITMAP_NO_TRACE
+/**
+ * the trace name of fused stages, such as "fused grayscale blur".
+ */
+static std::string fusedName(const std::vector<BandStage> &stages)
+{
+    std::string name = "fused";
+    for (const BandStage &stage : stages)
+    {
+        name += ' ';
+        name += stage.name;
+    }
+    return name;
+}
+#endif
+
+/**
+ * apply the chain to the bitmap.
+ */
+void FilterChain::run(Bitmap &b, uint32_t band_rows) const
+{
+    for (const ChainSegment &segment : plan())
+    {
+        if (segment.filter)
+        {
+            segment.filter(b);
+        }
+        else if (b.bmp_info_header.width > 0 && b.bmp_info_header.height > 0)
+        {
+            TRACE_SCOPE(Trace::enabled() ? fusedName(segment.stages).c_str() : "", b.pixel_bytes());
+            runFused(b, segment.stages, band_rows);
         }
-        r++;
     }
 }
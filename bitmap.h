@@ -1,10 +1,14 @@
 #ifndef BITMAP_H
 #define BITMAP_H
 
+#include "bufferpool.h"
 #include <stdint.h>
+#include <stddef.h>
 #include <iostream>
+#include <string>
 #include <vector>
 #include <exception>
+#include <functional>
 #include <stdexcept>
 
 using namespace std;
@@ -57,11 +61,70 @@ struct BMPColorHeader
 };
 #pragma pack(pop)
 
+/**
+ * A non-owning window onto pixel rows: the pixels of a Bitmap, a plane
+ * of a PlanarBitmap, or a rectangle of either. Rows are in memory order,
+ * bottom-up like Bitmap::data, and pitch bytes apart. Copying a view
+ * copies the pointer, never the pixels.
+ */
+struct BitmapView
+{
+    uint8_t *pixels{nullptr};
+    uint32_t width{0};
+    uint32_t height{0};
+    uint32_t pitch{0};
+    uint32_t bpp{0}; // bytes per pixel: 3 or 4, 1 for a plane
+
+    BitmapView()
+    {
+    }
+
+    BitmapView(uint8_t *pixels, uint32_t width, uint32_t height, uint32_t pitch, uint32_t bpp)
+        : pixels(pixels), width(width), height(height), pitch(pitch), bpp(bpp)
+    {
+    }
+
+    /**
+     * first byte of row y.
+     */
+    uint8_t *row(uint32_t y) const
+    {
+        return pixels + static_cast<size_t>(pitch) * y;
+    }
+
+    /**
+     * the view of a rectangle inside this one, sharing its pixels.
+     *
+     * @throws runtime_error if the rectangle is not inside the view.
+     */
+    BitmapView crop(uint32_t x, uint32_t y, uint32_t width, uint32_t height) const;
+
+    bool empty() const
+    {
+        return width == 0 || height == 0;
+    }
+};
+
+/**
+ * how operator<<, save() and encode() store the pixels of a 24 bit image.
+ */
+enum class OutputEncoding
+{
+    TrueColor, // 24 or 32 bit rows, as they are in memory
+    Palette8,  // 8 bit palette rows, if the image has at most 256 colours
+    Rle8,      // 8 bit palette, BI_RLE8 compressed, if at most 256 colours
+    Auto       // the smallest of the three
+};
+
+struct StatsRead;
+
 class Bitmap
 {
 private:
     friend std::istream &operator>>(std::istream &in, Bitmap &b);
+    friend std::istream &operator>>(std::istream &in, StatsRead read);
     friend std::ostream &operator<<(std::ostream &out, Bitmap &b);
+    friend class BandPipeline;
 
     /** 
      *  To align strid, add 1 to the row_stride until it is divisible with align_stride
@@ -69,6 +132,29 @@ private:
     */
     uint32_t make_stride_aligned(uint32_t align_stride);
 
+    /**
+     * Read the file, info and colour headers from the stream, leave the
+     * stream at the first pixel row and set up the fields for output.
+     * @param in stream to read from.
+    */
+    void read_headers(std::istream &in);
+
+    /**
+     * Read the rows of a 1, 4 or 8 bit palette image, a 16 bit image or
+     * a BI_RLE8/BI_RLE4 image after read_headers and expand them to 24
+     * bit bottom-up rows in data, setting the headers to match.
+     * @param in stream to read from; it must be seekable.
+     * @throws BitmapException if the format is not supported or the data is cut short.
+    */
+    void decode(std::istream &in);
+
+    /**
+     * Read the image as operator>> does, calling rows_read, if given,
+     * with each band of rows as soon as it is in.
+     * @param in stream to read from.
+    */
+    std::istream &read(std::istream &in, const std::function<void(BitmapView)> &rows_read);
+
     /**
      * Write the binary representation of image header to stream
      * @param out stream to write to.
@@ -83,16 +169,177 @@ private:
     */
     void write_headers_and_data(std::ostream &out);
 
+    /**
+     * Rewrite the header fields read from a file so they describe the
+     * image we are going to write back out (header sizes and data offset).
+    */
+    void prepare_output_headers();
+
+    /**
+     * Set size_image and file_size from the padded row stride, so the
+     * headers describe the file we are about to write.
+    */
+    void update_output_sizes();
+
+    /**
+     * Copy the headers write_headers would write into buffer, which must
+     * hold all three headers.
+     * @return the number of bytes copied.
+    */
+    size_t header_bytes(uint8_t *buffer) const;
+
+    /**
+     * Put the file in file as an 8 bit palette or RLE8 image, as
+     * output_encoding asks for.
+     * @return false, leaving file alone, if the image is to be written
+     * with its rows as they are: 32 bits per pixel, more than 256
+     * colours, or TrueColor asked for or smallest.
+    */
+    bool encode_compact(PixelVector &file);
+
+    /**
+     * Release the file mapping, if any. The pixels are lost unless they
+     * have been copied out with detach() first.
+    */
+    void unmap();
+
+    // first pixel row inside the file mapping, nullptr when the pixels live in data.
+    uint8_t *mapped_pixels{nullptr};
+
+    // base address and length of the whole mapped file.
+    void *mapping{nullptr};
+    size_t mapping_length{0};
+
 public:
     Bitmap()
     {
     }
+
+    /**
+     * Copying a mapped bitmap copies its pixels into data, so that the
+     * copy and the original never share writable rows.
+    */
+    Bitmap(const Bitmap &other);
+    Bitmap &operator=(const Bitmap &other);
+
+    /**
+     * Moving takes over the pixels, mapped or not, without copying them
+     * and leaves other an empty bitmap.
+    */
+    Bitmap(Bitmap &&other) noexcept;
+    Bitmap &operator=(Bitmap &&other) noexcept;
+    ~Bitmap();
+
+    /**
+     * Map a bitmap file into memory and use its pixel rows in place.
+     * Opening costs O(1): nothing is read or copied up front, and the
+     * mapping is private, so pages are only copied when a filter writes
+     * to them. row_stride is the padded stride of the file.
+     *
+     * Images whose rows cannot be aliased (top-down, compressed, or not
+     * 24/32 bits per pixel) are read through operator>> instead.
+     *
+     * @param path the bitmap file to open.
+     *
+     * @throws runtime_error if the file can not be opened, or can not be
+     * read in full when it is not aliased.
+    */
+    void map(const std::string &path);
+
+    /**
+     * Write the image to a file. The headers and the pixel rows go out
+     * with writev straight from where they are, mapped or not: one write
+     * when the rows are already padded to 4 bytes, otherwise an iovec per
+     * row and one per row of padding, IOV_MAX at a time. Images that
+     * output_encoding stores as 8 bit are encoded first and written in
+     * one go.
+     *
+     * @param path the file to create or replace.
+     *
+     * @return the size of the file written.
+     *
+     * @throws runtime_error if the file can not be created or written.
+    */
+    size_t save(const std::string &path);
+
+    /**
+     * Write view, a rectangle of this image or pixels of the same format
+     * such as a Pyramid level, to a file of its own. The headers are
+     * those of this image resized to the view, and the rows go out with
+     * writev straight from the view, in one piece when they are already
+     * padded to 4 bytes.
+     *
+     * @return the size of the file written.
+     *
+     * @throws runtime_error if the view doesn't have the bits per pixel
+     * of the image or the file can not be created or written.
+    */
+    size_t save_view(const std::string &path, BitmapView view) const;
+
+    /**
+     * Put the bytes save() would write into file, for writing them out
+     * some other way, such as through AsyncIO.
+     *
+     * @throws runtime_error if the image is not 24 or 32 bits per pixel.
+    */
+    void encode(PixelVector &file);
+
+    /**
+     * Pointer to the first pixel row, whether mapped or in data.
+    */
+    uint8_t *pixels();
+    const uint8_t *pixels() const;
+
+    /**
+     * Number of bytes in the pixel rows (row_stride * height).
+    */
+    size_t pixel_bytes() const;
+
+    /**
+     * A view of all the pixel rows.
+    */
+    BitmapView view();
+
+    /**
+     * true if the pixel rows are aliased from a file mapping.
+    */
+    bool is_mapped() const;
+
+    /**
+     * Copy mapped pixel rows into data and drop the mapping. Filters that
+     * change the image size call this before touching data directly.
+    */
+    void detach();
+
+    /**
+     * Change the image size. Updates the width and height, row_stride and
+     * the size fields of the headers, drops any file mapping and resizes
+     * data to the new rows. The old pixels are not kept in place.
+     *
+     * @param width new width in pixels.
+     * @param height new height in pixels.
+    */
+    void reshape(int32_t width, int32_t height);
+
+    /**
+     * Change the image size and take over pixels, which must hold the
+     * rows of the new size at the unpadded stride. pixels is left with
+     * the old data.
+    */
+    void reshape(int32_t width, int32_t height, PixelVector &pixels);
+
     uint32_t row_stride{0};
     uint16_t imageType = 0;
     BMPFileHeader file_header;
     BMPInfoHeader bmp_info_header;
     BMPColorHeader bmp_color_header;
-    std::vector<uint8_t> data;
+
+    // pixel rows when not mapped, drawn from BufferPool::shared().
+    PixelVector data;
+
+    // how 24 bit images are written; images with few colours, such as
+    // the output of grayscale() or cellShade(), shrink to 8 bits.
+    OutputEncoding output_encoding{OutputEncoding::Auto};
 };
 
 /**
@@ -114,6 +361,8 @@ void cellShade(Bitmap &b);
 
 /**
  * Grayscales an image by averaging all of the components.
+ * This is the plain mean, not a weighted luma, so the vector kernels
+ * give the same images the filter always has.
  */
 void grayscale(Bitmap &b);
 
@@ -122,13 +371,33 @@ void grayscale(Bitmap &b);
  */
 void pixelate(Bitmap &b);
 
+/**
+ * Pixelats an image with square blocks of the given size.
+ * Blocks start at the first pixel; the blocks along the right and last
+ * edge are cut short and take the average of the pixels they cover.
+ *
+ * @param block_size block side in pixels, nothing happens if it is 0.
+ */
+void pixelate(Bitmap &b, uint32_t block_size);
+
 /**
  * Use gaussian bluring to blur an image.
+ * Applies the 5x5 kernel {1, 4, 6, 4, 1} x {1, 4, 6, 4, 1} / 256 as two
+ * 1-D passes, spread over the shared thread pool. Pixels past the edges
+ * repeat the nearest edge pixel.
  */
 void blur(Bitmap &b);
 
 /**
- * rotates image 90 degrees, swapping the height and width.
+ * Gaussian blur with an arbitrary standard deviation.
+ *
+ * @param sigma standard deviation in pixels, nothing happens if it is not positive.
+ * @param radius kernel reach in pixels, 0 picks ceil(3 * sigma).
+ */
+void gaussianBlur(Bitmap &b, double sigma, uint32_t radius = 0);
+
+/**
+ * rotates image 90 degrees clockwise, swapping the height and width.
  */
 void rot90(Bitmap &b);
 
@@ -138,7 +407,7 @@ void rot90(Bitmap &b);
 void rot180(Bitmap &b);
 
 /**
- * rotates image 270 degrees, swapping the height and width.
+ * rotates image 270 degrees clockwise, swapping the height and width.
  */
 void rot270(Bitmap &b);
 
@@ -163,15 +432,478 @@ void flipd1(Bitmap &b);
 void flipd2(Bitmap &b);
 
 /**
- * scales the image by a factor of 2.
+ * scales the image by a factor of 2, repeating each pixel.
  */
 void scaleUp(Bitmap &b);
 
 /**
- * scales the image by a factor of 1/2.
+ * scales the image by a factor of 1/2, averaging each 2x2 block.
  */
 void scaleDown(Bitmap &b);
 
+/**
+ * filters resize() can reconstruct the image with.
+ */
+enum class ResizeFilter
+{
+    Nearest,  // pick the closest source pixel
+    Bilinear, // triangle filter, 2 taps when enlarging
+    Box,      // area average, exact for integer reductions
+    Lanczos3  // windowed sinc, 6 taps when enlarging
+};
+
+/**
+ * resample the image to the given size.
+ * The filter is run as a horizontal and a vertical pass with the
+ * coefficients computed once per pass; when shrinking it is widened by
+ * the scale factor, so every source pixel contributes.
+ *
+ * @param width new width in pixels.
+ * @param height new height in pixels.
+ * @param filter reconstruction filter.
+ *
+ * @throws runtime_error if width or height is not positive.
+ */
+void resize(Bitmap &b, int32_t width, int32_t height, ResizeFilter filter = ResizeFilter::Lanczos3);
+
+/**
+ * The reduced levels of an image, each half the size of the one before,
+ * rounded up, in one allocation. Level 0 is half the size of the image
+ * itself. Rows are bottom-up and unpadded, and each level starts on a
+ * 64 byte boundary.
+ */
+struct Pyramid
+{
+    struct Level
+    {
+        size_t offset; // of the first row in pixels
+        uint32_t width;
+        uint32_t height;
+    };
+
+    std::vector<Level> levels;
+    PixelVector pixels;
+    uint32_t bpp{0};
+
+    /**
+     * the pixels of one level.
+     */
+    BitmapView level(uint32_t index);
+};
+
+/**
+ * Build up to levels reduced levels of an image, 0 for all of them down
+ * to 1x1, averaging 2x2 blocks. Every level is made in the same pass
+ * over the image: as soon as two rows of a level are done they are
+ * averaged into the next, while still in cache. A last odd row or
+ * column is averaged with itself.
+ */
+Pyramid buildPyramid(Bitmap &b, uint32_t levels = 0);
+
+/**
+ * The values of one channel over an image.
+ */
+struct ChannelStats
+{
+    uint64_t histogram[256]{};
+    uint8_t min{0};
+    uint8_t max{0};
+    double mean{0};
+    double variance{0}; // of all the pixels, not a sample
+};
+
+/**
+ * Per channel histograms and moments of an image, channels in memory
+ * order: blue, green, red and, for 32 bit images, alpha. A plane of a
+ * PlanarBitmap has the one channel.
+ */
+struct ImageStats
+{
+    uint32_t channels{0};
+    uint64_t pixels{0};
+    ChannelStats channel[4];
+};
+
+/**
+ * Histogram every channel of the view in one pass, spread over the
+ * shared thread pool. Each thread counts into four interleaved
+ * sub-histograms per channel, so neighbouring pixels of the same value
+ * don't wait on each other's increments, and they are summed at the end.
+ * min, max, mean and variance are worked out from the histograms.
+ *
+ * @throws runtime_error if the view isn't 8, 24 or 32 bits per pixel.
+ */
+ImageStats computeStats(BitmapView view);
+
+/**
+ * A bitmap to read together with the stats to fill in, made by withStats().
+ */
+struct StatsRead
+{
+    Bitmap &bitmap;
+    ImageStats &stats;
+};
+
+/**
+ * Read an image and its stats in one pass:
+ *
+ *     in >> withStats(b, stats);
+ *
+ * Each band of rows is counted as soon as it has been read, while it is
+ * still in cache, instead of going over the whole image again.
+ */
+StatsRead withStats(Bitmap &b, ImageStats &stats);
+
+/**
+ * reads the image as operator>> does and fills in the stats, left empty
+ * if the read fails.
+ */
+std::istream &operator>>(std::istream &in, StatsRead read);
+
+/**
+ * A bitmap split into one plane per component (blue, green, red and
+ * alpha for 32 bit images), so the filters below run on contiguous bytes
+ * of one channel instead of interleaved pixels. Rows keep the order of
+ * the Bitmap they came from. Every plane row starts on an ALIGNMENT byte
+ * boundary and is padded to pitch() bytes.
+ *
+ * Converting costs a pass over the image each way, which pays off for
+ * chains of several filters:
+ *
+ *     PlanarBitmap planes(b);
+ *     grayscale(planes);
+ *     blur(planes);
+ *     planes.store(b);
+ */
+class PlanarBitmap
+{
+    PixelVector storage;
+    uint32_t plane_width{0};
+    uint32_t plane_height{0};
+    uint32_t plane_count{0};
+    uint32_t plane_pitch{0};
+
+public:
+    // alignment of every plane row, a cache line and a full AVX2 vector.
+    static const uint32_t ALIGNMENT = 64;
+
+    PlanarBitmap()
+    {
+    }
+
+    /**
+     * split the pixels of a 24 or 32 bit bitmap into planes.
+     *
+     * @throws runtime_error if the bitmap is not 24 or 32 bits per pixel.
+     */
+    explicit PlanarBitmap(const Bitmap &b);
+
+    /**
+     * split the pixels of a 24 or 32 bit bitmap into planes, reusing the
+     * storage when it is large enough.
+     *
+     * @throws runtime_error if the bitmap is not 24 or 32 bits per pixel.
+     */
+    void load(const Bitmap &b);
+
+    /**
+     * interleave the planes back into the pixels of b, which gives the
+     * headers. b is reshaped if its size differs.
+     *
+     * @throws runtime_error if b doesn't have one byte per plane per pixel.
+     */
+    void store(Bitmap &b) const;
+
+    /**
+     * change the size and number of planes. The contents are undefined.
+     */
+    void reshape(uint32_t width, uint32_t height, uint32_t channels);
+
+    uint32_t width() const;
+    uint32_t height() const;
+
+    /**
+     * number of planes, 3 or 4.
+     */
+    uint32_t channels() const;
+
+    /**
+     * bytes from one row of a plane to the next, a multiple of ALIGNMENT.
+     */
+    uint32_t pitch() const;
+
+    /**
+     * a one byte per pixel view of a plane.
+     */
+    BitmapView plane(uint32_t channel);
+
+    /**
+     * first byte of row y of a plane.
+     */
+    uint8_t *row(uint32_t channel, uint32_t y);
+    const uint8_t *row(uint32_t channel, uint32_t y) const;
+};
+
+/**
+ * cell shade each plane, as cellShade(Bitmap &).
+ */
+void cellShade(PlanarBitmap &p);
+
+/**
+ * set every plane to the average of the planes, as grayscale(Bitmap &).
+ */
+void grayscale(PlanarBitmap &p);
+
+/**
+ * blur each plane, as blur(Bitmap &).
+ */
+void blur(PlanarBitmap &p);
+
+/**
+ * gaussian blur each plane, as gaussianBlur(Bitmap &, sigma, radius).
+ */
+void gaussianBlur(PlanarBitmap &p, double sigma, uint32_t radius = 0);
+
+/**
+ * rotates the planes by 180 degrees, in place.
+ */
+void rot180(PlanarBitmap &p);
+
+/**
+ * flips the planes over the vertical axis, in place.
+ */
+void flipv(PlanarBitmap &p);
+
+/**
+ * flips the planes over the horizontal axis, in place.
+ */
+void fliph(PlanarBitmap &p);
+
+/*
+ * The filters on views read src and write dst. For the filters that keep
+ * the size, src and dst have the same size and format and are either the
+ * same view, which works in place, or don't overlap; the others need a
+ * separate dst of the output size. Each one throws runtime_error when
+ * the views don't fit.
+ */
+
+/**
+ * cell shade src into dst.
+ */
+void cellShade(BitmapView src, BitmapView dst);
+
+/**
+ * grayscale src into dst.
+ */
+void grayscale(BitmapView src, BitmapView dst);
+
+/**
+ * pixelate src into dst with square blocks of the given size.
+ */
+void pixelate(BitmapView src, BitmapView dst, uint32_t block_size = 16);
+
+/**
+ * blur src into dst with the 5x5 kernel of blur(Bitmap &).
+ */
+void blur(BitmapView src, BitmapView dst);
+
+/**
+ * gaussian blur src into dst, as gaussianBlur(Bitmap &, sigma, radius).
+ */
+void gaussianBlur(BitmapView src, BitmapView dst, double sigma, uint32_t radius = 0);
+
+/**
+ * rotate src by 180 degrees into dst.
+ */
+void rot180(BitmapView src, BitmapView dst);
+
+/**
+ * flip src over the vertical axis into dst.
+ */
+void flipv(BitmapView src, BitmapView dst);
+
+/**
+ * flip src over the horizontal axis into dst.
+ */
+void fliph(BitmapView src, BitmapView dst);
+
+/**
+ * rotate src 90 degrees clockwise into dst, which is src.height wide
+ * and src.width high. Can't work in place.
+ */
+void rot90(BitmapView src, BitmapView dst);
+
+/**
+ * rotate src 270 degrees clockwise into dst, sized as for rot90.
+ */
+void rot270(BitmapView src, BitmapView dst);
+
+/**
+ * flip src over the line y = -x into dst, sized as for rot90.
+ */
+void flipd1(BitmapView src, BitmapView dst);
+
+/**
+ * flip src over the line y = x into dst, sized as for rot90.
+ */
+void flipd2(BitmapView src, BitmapView dst);
+
+/**
+ * resample src to the size of dst, which must not overlap it.
+ */
+void resize(BitmapView src, BitmapView dst, ResizeFilter filter = ResizeFilter::Lanczos3);
+
+/**
+ * One stage of a BandPipeline: a whole-image filter together with how
+ * many rows of context it reads around each row it writes.
+ */
+struct BandStage
+{
+    const char *name;
+    void (*filter)(Bitmap &b);
+    uint32_t halo;      // rows needed above and below each output row
+    uint32_t align;     // the first row handed to the filter must be a multiple of this
+    bool tiles{false};  // columns need the same halo and alignment, so it can run on tiles
+};
+
+/**
+ * returns the name of one of the filters above, or "filter" for any other function.
+ */
+const char *filterName(void (*filter)(Bitmap &b));
+
+/**
+ * returns the filter above with the given name, as filterName() gives
+ * it, or nullptr if there is none.
+ */
+void (*filterByName(const std::string &name))(Bitmap &b);
+
+/**
+ * returns the band stage for one of the filters above.
+ *
+ * @throws runtime_error if the filter needs the whole image at once
+ * (flipv, rotations and scaling).
+ */
+BandStage bandStage(void (*filter)(Bitmap &b));
+
+/**
+ * Streams a bitmap through a chain of filters in horizontal bands.
+ *
+ * Only the rows of the current band plus the halo rows the stages need
+ * are kept in memory, so peak memory is bounded by the band height and
+ * row stride rather than by the size of the image.
+ */
+class BandPipeline
+{
+    std::vector<BandStage> stages;
+
+public:
+    /**
+     * append a filter to the chain.
+     * @throws runtime_error if the filter can not run on bands.
+     */
+    BandPipeline &add(void (*filter)(Bitmap &b));
+    BandPipeline &add(const BandStage &stage);
+
+    /**
+     * total rows of context needed above and below a band.
+     */
+    uint32_t halo() const;
+
+    /**
+     * read a bitmap from in, filter it band by band and write the result to out.
+     *
+     * @param in the stream to read from.
+     * @param out the stream to write to.
+     * @param band_rows number of output rows produced per band.
+     *
+     * @throws runtime_error if the image is not 24 or 32 bits per pixel, in
+     * ends before the last row, or out can not be written.
+     */
+    void run(std::istream &in, std::ostream &out, uint32_t band_rows = 64);
+};
+
+/**
+ * One pass of a FilterChain plan: either band stages fused into a single
+ * sweep over the image, or one filter that needs the whole image.
+ */
+struct ChainSegment
+{
+    std::vector<BandStage> stages;        // fused band stages, empty for a whole-image filter
+    std::string name;                     // name of the whole-image filter
+    std::function<void(Bitmap &)> filter; // whole-image filter, empty for fused stages
+};
+
+/**
+ * A chain of filters applied to an in-memory bitmap.
+ *
+ * Runs of filters that work on row bands (point operations such as
+ * grayscale and cellShade, and neighbourhood operations such as blur and
+ * pixelate) are fused: every band goes through all of them while it is
+ * in cache, so the image crosses memory once per run instead of once
+ * per filter. Filters that need the whole image, such as the rotations,
+ * flipv and resizing, end a run.
+ */
+class FilterChain
+{
+    struct Step
+    {
+        std::string name;
+        std::function<void(Bitmap &)> filter;
+        bool banded;
+        BandStage stage;
+        std::string key; // what the step does for signature(), "" if unknown
+    };
+    std::vector<Step> steps;
+
+public:
+    /**
+     * append one of the filters above; it is fused when it can run on bands.
+     */
+    FilterChain &add(void (*filter)(Bitmap &b));
+
+    /**
+     * append a band stage, fused with its neighbours.
+     */
+    FilterChain &add(const BandStage &stage);
+
+    /**
+     * append a filter that needs the whole image, such as a resize to a
+     * given size.
+     *
+     * @param key what the filter does, every parameter included, such as
+     * "100x100 lanczos3", for signature(). Without one the name alone
+     * can't tell two such filters apart, so the chain has no signature.
+     */
+    FilterChain &add(const std::string &name, std::function<void(Bitmap &b)> filter, const std::string &key = "");
+
+    /**
+     * split the chain into passes. A pass of fused stages ends before a
+     * whole-image filter, and before a stage that would take the combined
+     * halo past MAX_FUSED_HALO rows, where recomputing the halo of every
+     * band would cost more than another sweep.
+     */
+    std::vector<ChainSegment> plan() const;
+
+    /**
+     * the names of the steps, in order, which identify what the chain does
+     * to an image. Empty for an empty chain, and if a step is a function
+     * filterName() does not know, a band stage other than the ones of
+     * bandStage(), or a whole-image filter added without a key, since
+     * their names say nothing about their parameters.
+     */
+    std::string signature() const;
+
+    /**
+     * apply the chain to the bitmap.
+     *
+     * @param band_rows rows per band, 0 sizes bands to fit in L2.
+     */
+    void run(Bitmap &b, uint32_t band_rows = 0) const;
+
+    // largest combined halo of one fused pass.
+    static const uint32_t MAX_FUSED_HALO = 32;
+};
+
 /**
  * BitmapException denotes an exception from reading in a bitmap.
  */
@@ -0,0 +1,168 @@
+#include "bufferpool.h"
+#include <unistd.h>
+#include <sys/mman.h>
+
+// blocks at least this large are worth backing with huge pages.
+static const size_t HUGE_PAGE = 2u << 20;
+
+// acquire() calls made by this thread.
+static thread_local uint64_t acquired = 0;
+
+/**
+ * @param max_cached_bytes freed blocks beyond this many bytes are unmapped.
+ */
+BufferPool::BufferPool(size_t max_cached_bytes) : max_cached_bytes(max_cached_bytes)
+{
+}
+
+BufferPool::~BufferPool()
+{
+    trim();
+}
+
+/**
+ * the block size that holds the given number of bytes: MIN_BLOCK, or
+ * bytes rounded up to a quarter of its power of two, so at most a fifth
+ * of a block is wasted.
+ */
+size_t BufferPool::size_class(size_t bytes)
+{
+    if (bytes <= MIN_BLOCK)
+    {
+        return MIN_BLOCK;
+    }
+    size_t power = MIN_BLOCK;
+    while (power * 2 <= bytes)
+    {
+        power *= 2;
+    }
+    size_t step = power / 4;
+    return (bytes + step - 1) / step * step;
+}
+
+/**
+ * map a new block and fault its pages in.
+ */
+void *BufferPool::map_block(size_t size)
+{
+    void *block = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED)
+    {
+        throw std::bad_alloc();
+    }
+#ifdef MADV_HUGEPAGE
+    if (huge_pages && size >= HUGE_PAGE)
+    {
+        madvise(block, size, MADV_HUGEPAGE);
+    }
+#endif
+
+    // touch every page now, so the filters don't take the page faults.
+    const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    volatile uint8_t *bytes = static_cast<uint8_t *>(block);
+    for (size_t i = 0; i < size; i += page)
+    {
+        bytes[i] = 0;
+    }
+    return block;
+}
+
+/**
+ * a block of at least bytes bytes, cached or newly mapped.
+ */
+void *BufferPool::acquire(size_t bytes)
+{
+    acquired++;
+    const size_t size = size_class(bytes);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::map<size_t, std::vector<void *>>::iterator free = cached.find(size);
+        if (free != cached.end() && !free->second.empty())
+        {
+            void *block = free->second.back();
+            free->second.pop_back();
+            counters.hits++;
+            counters.cached_bytes -= size;
+            return block;
+        }
+        counters.misses++;
+    }
+
+    void *block = map_block(size);
+    std::lock_guard<std::mutex> lock(mutex);
+    counters.mapped_bytes += size;
+    return block;
+}
+
+/**
+ * give back a block from acquire(bytes), with the same bytes.
+ */
+void BufferPool::release(void *block, size_t bytes)
+{
+    if (!block)
+    {
+        return;
+    }
+    const size_t size = size_class(bytes);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (counters.cached_bytes + size <= max_cached_bytes)
+        {
+            cached[size].push_back(block);
+            counters.releases++;
+            counters.cached_bytes += size;
+            return;
+        }
+        counters.evictions++;
+        counters.mapped_bytes -= size;
+    }
+    munmap(block, size);
+}
+
+/**
+ * back blocks of 2 MiB and more mapped from now on with transparent huge pages.
+ */
+void BufferPool::use_huge_pages(bool enable)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    huge_pages = enable;
+}
+
+/**
+ * unmap every cached block.
+ */
+void BufferPool::trim()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (std::pair<const size_t, std::vector<void *>> &free : cached)
+    {
+        for (void *block : free.second)
+        {
+            munmap(block, free.first);
+        }
+        counters.mapped_bytes -= free.first * free.second.size();
+        free.second.clear();
+    }
+    counters.cached_bytes = 0;
+}
+
+BufferPool::Stats BufferPool::stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
+
+uint64_t BufferPool::thread_acquires()
+{
+    return acquired;
+}
+
+/**
+ * the pool behind PoolAllocator. It is never destroyed, so buffers in
+ * static objects can still be released at exit.
+ */
+BufferPool &BufferPool::shared()
+{
+    static BufferPool *pool = new BufferPool();
+    return *pool;
+}
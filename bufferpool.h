@@ -0,0 +1,174 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+/**
+ * A cache of large blocks for pixel buffers and filter scratch space.
+ *
+ * Blocks come in size classes, four per power of two, so a buffer of a
+ * similar size reuses a block another image or filter gave back instead
+ * of mapping fresh memory. New blocks are mapped from the kernel, 64 byte
+ * aligned (page aligned, in fact) and pre-faulted, optionally backed by
+ * transparent huge pages. Freed blocks are kept up to a byte budget.
+ */
+class BufferPool
+{
+public:
+    struct Stats
+    {
+        uint64_t hits{0};       // acquires served by a cached block
+        uint64_t misses{0};     // acquires that mapped a new block
+        uint64_t releases{0};   // blocks kept for reuse
+        uint64_t evictions{0};  // blocks unmapped because the cache was full
+        size_t cached_bytes{0}; // bytes in cached blocks
+        size_t mapped_bytes{0}; // bytes in all blocks, cached or in use
+    };
+
+    // alignment of every block.
+    static const size_t ALIGNMENT = 64;
+
+    // smallest block the pool deals in; smaller buffers use operator new.
+    static const size_t MIN_BLOCK = 64 * 1024;
+
+    /**
+     * @param max_cached_bytes freed blocks beyond this many bytes are unmapped.
+     */
+    explicit BufferPool(size_t max_cached_bytes = 512u << 20);
+    ~BufferPool();
+
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    /**
+     * the block size that holds the given number of bytes.
+     */
+    static size_t size_class(size_t bytes);
+
+    /**
+     * a block of at least bytes bytes, cached or newly mapped.
+     *
+     * @throws bad_alloc if no memory can be mapped.
+     */
+    void *acquire(size_t bytes);
+
+    /**
+     * give back a block from acquire(bytes), with the same bytes.
+     */
+    void release(void *block, size_t bytes);
+
+    /**
+     * back blocks of 2 MiB and more mapped from now on with transparent
+     * huge pages, where the kernel supports them.
+     */
+    void use_huge_pages(bool enable);
+
+    /**
+     * unmap every cached block.
+     */
+    void trim();
+
+    Stats stats() const;
+
+    /**
+     * blocks the calling thread has acquired from any pool, for tracing.
+     */
+    static uint64_t thread_acquires();
+
+    /**
+     * the pool behind PoolAllocator.
+     */
+    static BufferPool &shared();
+
+private:
+    mutable std::mutex mutex;
+    std::map<size_t, std::vector<void *>> cached;
+    Stats counters;
+    size_t max_cached_bytes;
+    bool huge_pages{false};
+
+    void *map_block(size_t size);
+};
+
+/**
+ * Allocator that takes buffers of BufferPool::MIN_BLOCK bytes and more
+ * from BufferPool::shared(), and smaller ones from operator new, all 64
+ * byte aligned.
+ *
+ * Elements are default initialised, so resizing a vector of bytes
+ * leaves the new bytes as they are instead of zeroing them; every user
+ * overwrites them anyway.
+ */
+template <typename T>
+class PoolAllocator
+{
+public:
+    typedef T value_type;
+
+    PoolAllocator() noexcept
+    {
+    }
+
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U> &) noexcept
+    {
+    }
+
+    T *allocate(size_t n)
+    {
+        size_t bytes = n * sizeof(T);
+        if (bytes < BufferPool::MIN_BLOCK)
+        {
+            return static_cast<T *>(::operator new(bytes, std::align_val_t(BufferPool::ALIGNMENT)));
+        }
+        return static_cast<T *>(BufferPool::shared().acquire(bytes));
+    }
+
+    void deallocate(T *p, size_t n) noexcept
+    {
+        size_t bytes = n * sizeof(T);
+        if (bytes < BufferPool::MIN_BLOCK)
+        {
+            ::operator delete(p, std::align_val_t(BufferPool::ALIGNMENT));
+            return;
+        }
+        BufferPool::shared().release(p, bytes);
+    }
+
+    template <typename U>
+    void construct(U *p) noexcept
+    {
+        ::new (static_cast<void *>(p)) U;
+    }
+
+    template <typename U, typename... Args>
+    void construct(U *p, Args &&...args)
+    {
+        ::new (static_cast<void *>(p)) U(std::forward<Args>(args)...);
+    }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U> &) const noexcept
+    {
+        return true;
+    }
+
+    template <typename U>
+    bool operator!=(const PoolAllocator<U> &) const noexcept
+    {
+        return false;
+    }
+};
+
+/**
+ * byte buffer drawn from the pool, for pixel rows and scratch space.
+ */
+typedef std::vector<uint8_t, PoolAllocator<uint8_t>> PixelVector;
+
+#endif
@@ -0,0 +1,355 @@
+#include "bitmap.h"
+#include "trace.h"
+#include <algorithm>
+#include <string.h>
+
+// values of BMPInfoHeader::compression
+static const uint32_t BI_RGB = 0;
+static const uint32_t BI_RLE8 = 1;
+static const uint32_t BI_RLE4 = 2;
+static const uint32_t BI_BITFIELDS = 3;
+
+// file offsets of the info header fields, for error positions.
+static const uint32_t WIDTH_POSITION = 18;
+static const uint32_t BIT_COUNT_POSITION = 28;
+
+/**
+ * the BGR bytes of each palette index; indices past the colour table are black.
+ */
+typedef uint8_t ColorTable[256][3];
+
+/**
+ * Expands rows of Bits bit palette indices to BGR. The table holds the
+ * pixels of every byte value, so each source byte costs one lookup and
+ * one copy whatever the number of pixels in it.
+ */
+template <unsigned Bits>
+struct IndexExpander
+{
+    static const unsigned PER_BYTE = 8 / Bits;
+    uint8_t pixels[256][3 * PER_BYTE];
+
+    explicit IndexExpander(const ColorTable colors)
+    {
+        for (unsigned byte = 0; byte < 256; byte++)
+        {
+            for (unsigned i = 0; i < PER_BYTE; i++)
+            {
+                // the leftmost pixel is in the high bits.
+                unsigned index = (byte >> (8 - Bits * (i + 1))) & ((1u << Bits) - 1);
+                memcpy(pixels[byte] + 3 * i, colors[index], 3);
+            }
+        }
+    }
+
+    void expand(const uint8_t *src, uint8_t *dst, uint32_t width) const
+    {
+        const uint32_t whole = width / PER_BYTE;
+        for (uint32_t i = 0; i < whole; i++)
+        {
+            memcpy(dst + 3 * PER_BYTE * i, pixels[src[i]], 3 * PER_BYTE);
+        }
+        const uint32_t rest = width % PER_BYTE;
+        if (rest)
+        {
+            memcpy(dst + 3 * PER_BYTE * whole, pixels[src[whole]], 3 * rest);
+        }
+    }
+};
+
+/**
+ * One channel of a 16 bit pixel: where its mask puts it and the 8 bit
+ * value of every level it can have.
+ */
+struct MaskChannel
+{
+    uint32_t mask{0};
+    uint32_t shift{0};
+    std::vector<uint8_t> levels;
+
+    explicit MaskChannel(uint32_t channel_mask) : mask(channel_mask & 0xffff)
+    {
+        if (mask == 0)
+        {
+            levels.assign(1, 0);
+            return;
+        }
+        shift = __builtin_ctz(mask);
+        const uint32_t max = mask >> shift;
+        levels.resize(max + 1);
+        for (uint32_t level = 0; level <= max; level++)
+        {
+            levels[level] = static_cast<uint8_t>((level * 255 + max / 2) / max);
+        }
+    }
+
+    uint8_t operator()(uint32_t pixel) const
+    {
+        return levels[(pixel & mask) >> shift];
+    }
+};
+
+/**
+ * expand a row of 16 bit pixels to BGR through the channel tables.
+ */
+static void expandRow16(const uint8_t *src, uint8_t *dst, uint32_t width,
+                        const MaskChannel &red, const MaskChannel &green, const MaskChannel &blue)
+{
+    for (uint32_t x = 0; x < width; x++, src += 2, dst += 3)
+    {
+        const uint32_t pixel = src[0] | (src[1] << 8);
+        dst[0] = blue(pixel);
+        dst[1] = green(pixel);
+        dst[2] = red(pixel);
+    }
+}
+
+/**
+ * Decode BI_RLE8 or BI_RLE4 data into one index byte per pixel, bottom
+ * row first. Runs and literals that overrun a row are clipped, and
+ * pixels skipped by a delta or an early end of line keep index 0.
+ * Decoding stops at the end of bitmap marker or the end of the data.
+ */
+static void decodeRle(const uint8_t *src, size_t size, bool four_bit, uint8_t *indices, uint32_t width, uint32_t height)
+{
+    memset(indices, 0, static_cast<size_t>(width) * height);
+    uint32_t x = 0;
+    uint32_t y = 0;
+    size_t i = 0;
+    while (i + 1 < size && y < height)
+    {
+        const uint32_t count = src[i];
+        const uint8_t value = src[i + 1];
+        i += 2;
+        uint8_t *row = indices + static_cast<size_t>(width) * y;
+
+        if (count > 0)
+        {
+            // a run: count pixels of value, or alternating nibbles of it.
+            for (uint32_t n = 0; n < count && x < width; n++, x++)
+            {
+                row[x] = four_bit ? ((n & 1) ? value & 0x0f : value >> 4) : value;
+            }
+            continue;
+        }
+
+        switch (value)
+        {
+        case 0: // end of line
+            x = 0;
+            y++;
+            break;
+        case 1: // end of bitmap
+            return;
+        case 2: // delta
+            if (i + 1 >= size)
+            {
+                return;
+            }
+            x += src[i];
+            y += src[i + 1];
+            i += 2;
+            break;
+        default:
+        {
+            // value literal pixels, padded to a 16 bit boundary.
+            const size_t bytes = four_bit ? (value + 1u) / 2 : value;
+            if (i + bytes > size)
+            {
+                return;
+            }
+            for (uint32_t n = 0; n < value && x < width; n++, x++)
+            {
+                const uint8_t byte = src[i + (four_bit ? n / 2 : n)];
+                row[x] = four_bit ? ((n & 1) ? byte & 0x0f : byte >> 4) : byte;
+            }
+            i += (bytes + 1) & ~static_cast<size_t>(1);
+            break;
+        }
+        }
+    }
+}
+
+/**
+ * read the colour table that follows the info header of header_size bytes.
+ */
+static void readColorTable(std::istream &in, const BMPInfoHeader &info, uint32_t header_size, ColorTable colors)
+{
+    memset(colors, 0, sizeof(ColorTable));
+    uint32_t count = info.colors_used ? info.colors_used : 1u << info.bit_count;
+    count = std::min(count, 256u);
+
+    const uint32_t position = sizeof(BMPFileHeader) + header_size;
+    in.seekg(position, in.beg);
+    uint8_t entries[256][4];
+    in.read((char *)entries, 4 * count);
+    if (static_cast<uint32_t>(in.gcount()) != 4 * count)
+    {
+        throw BitmapException("Error! The colour table is truncated\n", position);
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        memcpy(colors[i], entries[i], 3);
+    }
+}
+
+/**
+ * read everything from the pixel data offset on, up to size bytes if
+ * size is not 0. Running out of data early is left to the decoder.
+ */
+static void readEncoded(std::istream &in, uint32_t offset, uint32_t size, PixelVector &encoded)
+{
+    in.seekg(offset, in.beg);
+    if (size)
+    {
+        encoded.resize(size);
+        in.read((char *)encoded.data(), size);
+        encoded.resize(static_cast<size_t>(in.gcount()));
+    }
+    else
+    {
+        const size_t chunk = 1u << 20;
+        size_t used = 0;
+        while (in)
+        {
+            encoded.resize(used + chunk);
+            in.read((char *)encoded.data() + used, chunk);
+            used += static_cast<size_t>(in.gcount());
+        }
+        encoded.resize(used);
+    }
+    if (!in.bad())
+    {
+        in.clear();
+    }
+}
+
+/**
+ * Read and expand the pixel rows of a palette, 16 bit or run-length
+ * encoded image to 24 bit rows in data, bottom row first.
+*/
+void Bitmap::decode(std::istream &in)
+{
+    TRACE_SCOPE("decode", 0);
+    // read_headers left the stream at the pixels and offset_data set for output.
+    const uint32_t pixel_offset = static_cast<uint32_t>(in.tellg());
+    BMPInfoHeader &info = bmp_info_header;
+    uint32_t header_size = 0;
+    in.seekg(sizeof(BMPFileHeader), in.beg);
+    in.read((char *)&header_size, sizeof(header_size));
+    if (header_size < sizeof(BMPInfoHeader))
+    {
+        throw BitmapException("Error! Unsupported bitmap header\n", sizeof(BMPFileHeader));
+    }
+
+    const bool palette = (info.bit_count == 1 || info.bit_count == 4 || info.bit_count == 8) && info.compression == BI_RGB;
+    const bool rle = (info.bit_count == 8 && info.compression == BI_RLE8) || (info.bit_count == 4 && info.compression == BI_RLE4);
+    const bool masked = info.bit_count == 16 && (info.compression == BI_RGB || info.compression == BI_BITFIELDS);
+    if (!palette && !rle && !masked)
+    {
+        throw BitmapException("Error! Unsupported bits per pixel or compression\n", BIT_COUNT_POSITION);
+    }
+
+    const bool top_down = info.height < 0;
+    const uint64_t width = info.width > 0 ? static_cast<uint64_t>(info.width) : 0;
+    const uint64_t height = top_down ? -static_cast<int64_t>(info.height) : info.height;
+    if (width == 0 || height == 0 || width * 3 * height > UINT32_MAX)
+    {
+        throw BitmapException("Error! Invalid image size\n", WIDTH_POSITION);
+    }
+
+    ColorTable colors;
+    if (palette || rle)
+    {
+        readColorTable(in, info, header_size, colors);
+    }
+
+    row_stride = static_cast<uint32_t>(width * 3);
+    data.resize(static_cast<size_t>(row_stride) * height);
+    // data row of the y-th row in the file.
+    auto rowAt = [&](uint32_t y) {
+        return data.data() + static_cast<size_t>(row_stride) * (top_down ? height - 1 - y : y);
+    };
+
+    if (rle)
+    {
+        PixelVector encoded;
+        readEncoded(in, pixel_offset, info.size_image, encoded);
+        PixelVector indices(static_cast<size_t>(width * height));
+        decodeRle(encoded.data(), encoded.size(), info.compression == BI_RLE4, indices.data(),
+                  static_cast<uint32_t>(width), static_cast<uint32_t>(height));
+        IndexExpander<8> expander(colors);
+        for (uint32_t y = 0; y < height; y++)
+        {
+            expander.expand(indices.data() + width * y, rowAt(y), static_cast<uint32_t>(width));
+        }
+    }
+    else
+    {
+        const size_t file_stride = (width * info.bit_count + 31) / 32 * 4;
+        PixelVector rows(file_stride * height);
+        in.seekg(pixel_offset, in.beg);
+        in.read((char *)rows.data(), rows.size());
+        if (static_cast<size_t>(in.gcount()) != rows.size())
+        {
+            throw BitmapException("Error! The pixel data is truncated\n", pixel_offset);
+        }
+
+        const uint32_t w = static_cast<uint32_t>(width);
+        if (masked)
+        {
+            uint32_t masks[3] = {0x7c00, 0x03e0, 0x001f};
+            if (info.compression == BI_BITFIELDS)
+            {
+                // right after the 40 byte info header, or inside a larger one.
+                in.seekg(sizeof(BMPFileHeader) + sizeof(BMPInfoHeader), in.beg);
+                in.read((char *)masks, sizeof(masks));
+                if (!in)
+                {
+                    throw BitmapException("Error! The file does not contain bit mask information\n", sizeof(BMPFileHeader) + sizeof(BMPInfoHeader));
+                }
+            }
+            const MaskChannel red(masks[0]), green(masks[1]), blue(masks[2]);
+            for (uint32_t y = 0; y < height; y++)
+            {
+                expandRow16(rows.data() + file_stride * y, rowAt(y), w, red, green, blue);
+            }
+        }
+        else if (info.bit_count == 8)
+        {
+            IndexExpander<8> expander(colors);
+            for (uint32_t y = 0; y < height; y++)
+            {
+                expander.expand(rows.data() + file_stride * y, rowAt(y), w);
+            }
+        }
+        else if (info.bit_count == 4)
+        {
+            IndexExpander<4> expander(colors);
+            for (uint32_t y = 0; y < height; y++)
+            {
+                expander.expand(rows.data() + file_stride * y, rowAt(y), w);
+            }
+        }
+        else
+        {
+            IndexExpander<1> expander(colors);
+            for (uint32_t y = 0; y < height; y++)
+            {
+                expander.expand(rows.data() + file_stride * y, rowAt(y), w);
+            }
+        }
+    }
+
+    // from here on it is a plain 24 bit bottom-up image.
+    info.height = static_cast<int32_t>(height);
+    info.bit_count = 24;
+    info.compression = BI_RGB;
+    info.colors_used = 0;
+    info.colors_important = 0;
+    bmp_color_header = BMPColorHeader();
+    imageType = 3;
+    prepare_output_headers();
+    update_output_sizes();
+    TRACE_BYTES(pixel_bytes());
+}
@@ -0,0 +1,248 @@
+#include "editsession.h"
+#include "threadpool.h"
+#include "trace.h"
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+#include <string.h>
+
+TilePlan::TilePlan(const FilterChain &chain)
+{
+    for (const ChainSegment &segment : chain.plan())
+    {
+        if (segment.filter)
+        {
+            tiled = false;
+        }
+        for (const BandStage &stage : segment.stages)
+        {
+            tiled = tiled && stage.tiles;
+            stages.push_back(stage);
+            halo += stage.halo;
+            align = std::lcm(align, std::max<uint32_t>(stage.align, 1));
+        }
+    }
+    if (!tiled)
+    {
+        stages.clear();
+    }
+}
+
+/**
+ * the tile grown by the halo on every side, with its corner moved back to
+ * a multiple of the alignment and clipped to the image.
+ */
+TileRect TilePlan::window(const TileRect &tile, uint32_t image_width, uint32_t image_height) const
+{
+    TileRect window;
+    window.x = tile.x > halo ? tile.x - halo : 0;
+    window.y = tile.y > halo ? tile.y - halo : 0;
+    window.x -= window.x % align;
+    window.y -= window.y % align;
+    window.width = static_cast<uint32_t>(std::min<uint64_t>(static_cast<uint64_t>(tile.x) + tile.width + halo, image_width)) - window.x;
+    window.height = static_cast<uint32_t>(std::min<uint64_t>(static_cast<uint64_t>(tile.y) + tile.height + halo, image_height)) - window.y;
+    return window;
+}
+
+/**
+ * copy the window of the tile into scratch, run the stages on it and
+ * copy the tile back out into dst.
+ */
+void TilePlan::filter(BitmapView src, const TileRect &tile, Bitmap &scratch, BitmapView dst) const
+{
+    const TileRect area = window(tile, src.width, src.height);
+    const uint32_t bpp = src.bpp;
+    scratch.reshape(area.width, area.height);
+    const BitmapView pixels = scratch.view();
+    for (uint32_t row = 0; row < area.height; row++)
+    {
+        memcpy(pixels.row(row), src.row(area.y + row) + static_cast<size_t>(area.x) * bpp,
+               static_cast<size_t>(area.width) * bpp);
+    }
+    for (const BandStage &stage : stages)
+    {
+        stage.filter(scratch);
+    }
+
+    const BitmapView filtered = scratch.view();
+    for (uint32_t row = 0; row < tile.height; row++)
+    {
+        memcpy(dst.row(tile.y + row) + static_cast<size_t>(tile.x) * bpp,
+               filtered.row(tile.y - area.y + row) + static_cast<size_t>(tile.x - area.x) * bpp,
+               static_cast<size_t>(tile.width) * bpp);
+    }
+}
+
+/**
+ * a bitmap with the headers of b and no pixels.
+ */
+Bitmap TilePlan::scratch(const Bitmap &b)
+{
+    Bitmap scratch;
+    scratch.file_header = b.file_header;
+    scratch.bmp_info_header = b.bmp_info_header;
+    scratch.bmp_color_header = b.bmp_color_header;
+    scratch.imageType = b.imageType;
+    return scratch;
+}
+
+EditSession::EditSession(const Bitmap &source, const FilterChain &chain, uint32_t tile_size)
+    : original(source), chain(chain), plan(chain), tile_size(tile_size)
+{
+    if (tile_size == 0)
+    {
+        throw std::runtime_error("The tile size must be positive");
+    }
+}
+
+Bitmap &EditSession::source()
+{
+    return original;
+}
+
+/**
+ * mark every tile whose result can depend on the rectangle.
+ */
+void EditSession::mark_dirty(uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+    const uint32_t image_width = original.bmp_info_header.width > 0 ? original.bmp_info_header.width : 0;
+    const uint32_t image_height = original.bmp_info_header.height > 0 ? original.bmp_info_header.height : 0;
+    if (all_dirty || x >= image_width || y >= image_height || width == 0 || height == 0)
+    {
+        return;
+    }
+    if (!plan.tiled || image_width != static_cast<uint32_t>(rendered_width) || image_height != static_cast<uint32_t>(rendered_height))
+    {
+        all_dirty = true;
+        return;
+    }
+
+    // a source pixel reaches result pixels up to the halo away.
+    const uint32_t first_x = x > plan.halo ? x - plan.halo : 0;
+    const uint32_t first_y = y > plan.halo ? y - plan.halo : 0;
+    const uint32_t last_x = static_cast<uint32_t>(std::min<uint64_t>(static_cast<uint64_t>(x) + width + plan.halo, image_width));
+    const uint32_t last_y = static_cast<uint32_t>(std::min<uint64_t>(static_cast<uint64_t>(y) + height + plan.halo, image_height));
+    const uint32_t across = tiles_across();
+    for (uint32_t ty = first_y / tile_size; ty <= (last_y - 1) / tile_size; ty++)
+    {
+        for (uint32_t tx = first_x / tile_size; tx <= (last_x - 1) / tile_size; tx++)
+        {
+            dirty_tiles[static_cast<size_t>(ty) * across + tx] = 1;
+        }
+    }
+}
+
+void EditSession::mark_all_dirty()
+{
+    all_dirty = true;
+}
+
+/**
+ * bring the result up to date and return it.
+ */
+const Bitmap &EditSession::render()
+{
+    TRACE_SCOPE("edit render", 0);
+    if (original.bmp_info_header.width != rendered_width || original.bmp_info_header.height != rendered_height)
+    {
+        all_dirty = true;
+    }
+    if (all_dirty)
+    {
+        render_all();
+        TRACE_BYTES(result.pixel_bytes());
+        return result;
+    }
+
+    std::vector<uint32_t> tiles;
+    for (uint32_t i = 0; i < dirty_tiles.size(); i++)
+    {
+        if (dirty_tiles[i])
+        {
+            tiles.push_back(i);
+            dirty_tiles[i] = 0;
+        }
+    }
+    if (!tiles.empty())
+    {
+        render_tiles(tiles);
+        TRACE_BYTES(counters.pixels_rendered);
+    }
+    return result;
+}
+
+bool EditSession::incremental() const
+{
+    return plan.tiled;
+}
+
+uint32_t EditSession::halo() const
+{
+    return plan.halo;
+}
+
+EditSession::Stats EditSession::stats() const
+{
+    return counters;
+}
+
+uint32_t EditSession::tiles_across() const
+{
+    return (static_cast<uint32_t>(rendered_width) + tile_size - 1) / tile_size;
+}
+
+uint32_t EditSession::tiles_down() const
+{
+    return (static_cast<uint32_t>(rendered_height) + tile_size - 1) / tile_size;
+}
+
+/**
+ * run the chain on a copy of the whole source.
+ */
+void EditSession::render_all()
+{
+    result = original;
+    chain.run(result);
+    rendered_width = original.bmp_info_header.width;
+    rendered_height = original.bmp_info_header.height;
+    all_dirty = false;
+    dirty_tiles.assign(static_cast<size_t>(tiles_across()) * tiles_down(), 0);
+
+    counters.renders++;
+    counters.full_renders++;
+    counters.pixels_rendered += static_cast<uint64_t>(std::max(rendered_width, 0)) * std::max(rendered_height, 0);
+}
+
+/**
+ * recompute the given tiles of the result in parallel.
+ */
+void EditSession::render_tiles(const std::vector<uint32_t> &tiles)
+{
+    const BitmapView src = original.view();
+    const BitmapView dst = result.view();
+    const uint32_t across = tiles_across();
+    auto tileAt = [&](uint32_t tile) {
+        TileRect rect;
+        rect.x = tile % across * tile_size;
+        rect.y = tile / across * tile_size;
+        rect.width = std::min(tile_size, src.width - rect.x);
+        rect.height = std::min(tile_size, src.height - rect.y);
+        return rect;
+    };
+
+    counters.renders++;
+    counters.tiles_rendered += tiles.size();
+    for (uint32_t tile : tiles)
+    {
+        const TileRect rect = tileAt(tile);
+        counters.pixels_rendered += static_cast<uint64_t>(rect.width) * rect.height;
+    }
+
+    ThreadPool::shared().parallel_for(0, static_cast<uint32_t>(tiles.size()), [&](uint32_t first, uint32_t last) {
+        Bitmap scratch = TilePlan::scratch(original);
+        for (uint32_t i = first; i < last; i++)
+        {
+            plan.filter(src, tileAt(tiles[i]), scratch, dst);
+        }
+    }, 1);
+}
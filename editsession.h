@@ -0,0 +1,151 @@
+#ifndef EDITSESSION_H
+#define EDITSESSION_H
+
+#include "bitmap.h"
+#include <stdint.h>
+#include <vector>
+
+/**
+ * a rectangle of pixels, in BitmapView coordinates.
+ */
+struct TileRect
+{
+    uint32_t x{0};
+    uint32_t y{0};
+    uint32_t width{0};
+    uint32_t height{0};
+};
+
+/**
+ * How to filter a chain tile by tile: its band stages, when every one of
+ * them can run on tiles, with their combined halo and alignment.
+ *
+ * A tile is filtered inside a window of the source that reaches halo
+ * pixels past it on every side and starts on a multiple of align, like
+ * the bands of a FilterChain, so it comes out as if the whole image had
+ * been filtered.
+ */
+struct TilePlan
+{
+    std::vector<BandStage> stages; // empty unless tiled
+    bool tiled{true};
+    uint32_t halo{0};
+    uint32_t align{1};
+
+    explicit TilePlan(const FilterChain &chain);
+
+    /**
+     * the window the tile is filtered in, inside an image of the given size.
+     */
+    TileRect window(const TileRect &tile, uint32_t image_width, uint32_t image_height) const;
+
+    /**
+     * filter one tile of src into the same place in dst, which must not
+     * overlap src.
+     *
+     * @param scratch a bitmap with the headers of the source, as made by
+     * scratch(), that holds the window; reused from tile to tile.
+     */
+    void filter(BitmapView src, const TileRect &tile, Bitmap &scratch, BitmapView dst) const;
+
+    /**
+     * a bitmap with the headers of b and no pixels.
+     */
+    static Bitmap scratch(const Bitmap &b);
+};
+
+/**
+ * An image being edited together with the result of a filter chain on
+ * it, kept up to date incrementally.
+ *
+ * The result is cut into square tiles. Marking a rectangle of the source
+ * dirty marks every tile whose pixels can depend on it, and render()
+ * recomputes only those tiles, each from a window of the source that also
+ * holds the halo rows and columns of the chain. Every stage spoils only
+ * its own halo at the window edges, so the tiles come out as if the
+ * whole image had been filtered, and the cost of an edit follows the
+ * size of the edit rather than the size of the image.
+ *
+ * Chains with a filter that can not run on tiles (whole-image filters
+ * such as the rotations and resizing, and fliph) are rerun on the whole
+ * image whenever anything is dirty.
+ */
+class EditSession
+{
+public:
+    struct Stats
+    {
+        uint64_t renders{0};         // render() calls that had something to do
+        uint64_t full_renders{0};    // of those, the ones that ran the chain on the whole image
+        uint64_t tiles_rendered{0};
+        uint64_t pixels_rendered{0}; // result pixels recomputed, halos not included
+    };
+
+    /**
+     * @param source the image to edit; mapped images are copied.
+     * @param chain the filters applied to it, copied.
+     * @param tile_size width and height of the tiles, in pixels.
+     *
+     * @throws runtime_error if tile_size is 0.
+     */
+    EditSession(const Bitmap &source, const FilterChain &chain, uint32_t tile_size = 256);
+
+    /**
+     * the image being edited. Change its pixels in place and then call
+     * mark_dirty() with what changed; changing its size makes the next
+     * render() a full one.
+     */
+    Bitmap &source();
+
+    /**
+     * note that a rectangle of source pixels has changed. Coordinates are
+     * those of BitmapView, rows bottom-up; the rectangle is clipped to the
+     * image.
+     */
+    void mark_dirty(uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+
+    /**
+     * note that the whole source has changed.
+     */
+    void mark_all_dirty();
+
+    /**
+     * bring the result up to date and return it. The first call filters
+     * the whole image.
+     */
+    const Bitmap &render();
+
+    /**
+     * true if edits are rendered tile by tile, false if the chain falls
+     * back to the whole image.
+     */
+    bool incremental() const;
+
+    /**
+     * combined halo of the chain in pixels, on every side of a tile.
+     */
+    uint32_t halo() const;
+
+    Stats stats() const;
+
+private:
+    Bitmap original;
+    Bitmap result;
+    FilterChain chain;
+    TilePlan plan;
+    uint32_t tile_size;
+
+    // size of the source the result was last rendered from.
+    int32_t rendered_width{0};
+    int32_t rendered_height{0};
+    bool all_dirty{true};
+    std::vector<uint8_t> dirty_tiles;
+    Stats counters;
+
+    uint32_t tiles_across() const;
+    uint32_t tiles_down() const;
+    void render_all();
+    void render_tiles(const std::vector<uint32_t> &tiles);
+};
+
+#endif
@@ -0,0 +1,225 @@
+#include "bitmap.h"
+#include "trace.h"
+#include <algorithm>
+#include <string.h>
+
+// values of BMPInfoHeader::compression
+static const uint32_t BI_RGB = 0;
+static const uint32_t BI_RLE8 = 1;
+
+// slots of the colour hash table; four per palette entry keeps probes short.
+static const uint32_t PALETTE_SLOTS = 1024;
+
+/**
+ * Collect the colours of a 24 bit image and the palette index of every
+ * pixel, bottom row first, in one pass. Colours are found through a
+ * small open-addressing hash table, and runs of one colour skip it.
+ *
+ * @return false as soon as a 257th colour turns up.
+ */
+static bool buildPalette(BitmapView view, uint32_t colors[256], uint32_t &count, PixelVector &indices)
+{
+    uint32_t keys[PALETTE_SLOTS] = {0};
+    uint8_t slots[PALETTE_SLOTS];
+    count = 0;
+    indices.resize(static_cast<size_t>(view.width) * view.height);
+
+    uint32_t last = 0xffffffff;
+    uint8_t last_index = 0;
+    for (uint32_t y = 0; y < view.height; y++)
+    {
+        const uint8_t *row = view.row(y);
+        uint8_t *out = indices.data() + static_cast<size_t>(view.width) * y;
+        for (uint32_t x = 0; x < view.width; x++, row += 3)
+        {
+            const uint32_t color = row[0] | (row[1] << 8) | (row[2] << 16);
+            if (color != last)
+            {
+                // keys carry a bit above the colour so 0 means an empty slot.
+                const uint32_t key = color | 0x01000000;
+                uint32_t slot = (color * 2654435761u) >> 22;
+                while (keys[slot] != 0 && keys[slot] != key)
+                {
+                    slot = (slot + 1) & (PALETTE_SLOTS - 1);
+                }
+                if (keys[slot] == 0)
+                {
+                    if (count == 256)
+                    {
+                        return false;
+                    }
+                    keys[slot] = key;
+                    slots[slot] = static_cast<uint8_t>(count);
+                    colors[count++] = color;
+                }
+                last = color;
+                last_index = slots[slot];
+            }
+            out[x] = last_index;
+        }
+    }
+    return true;
+}
+
+/**
+ * BI_RLE8 encode rows of indices, bottom row first. Repeats become runs,
+ * stretches of three or more pixels without a repeat become literals,
+ * and every row ends with an end of line, the last with end of bitmap.
+ *
+ * @return false as soon as the encoding would take more than limit bytes.
+ */
+static bool encodeRle8(const uint8_t *indices, uint32_t width, uint32_t height, size_t limit, PixelVector &rle)
+{
+    // at worst two bytes a pixel and two at the end of each row.
+    const size_t capacity = std::min(limit, (2 * static_cast<size_t>(width) + 2) * height);
+    rle.resize(capacity);
+    uint8_t *out = rle.data();
+    size_t used = 0;
+
+    for (uint32_t y = 0; y < height; y++)
+    {
+        const uint8_t *row = indices + static_cast<size_t>(width) * y;
+        uint32_t x = 0;
+        while (x < width)
+        {
+            uint32_t run = 1;
+            while (x + run < width && run < 255 && row[x + run] == row[x])
+            {
+                run++;
+            }
+            if (run == 1)
+            {
+                // extend a literal up to the next repeat.
+                uint32_t literal = 1;
+                while (x + literal < width && literal < 255 &&
+                       (x + literal + 1 == width || row[x + literal] != row[x + literal + 1]))
+                {
+                    literal++;
+                }
+                if (literal >= 3)
+                {
+                    const size_t bytes = 2 + literal + (literal & 1);
+                    if (used + bytes > capacity)
+                    {
+                        return false;
+                    }
+                    out[used] = 0;
+                    out[used + 1] = static_cast<uint8_t>(literal);
+                    memcpy(out + used + 2, row + x, literal);
+                    if (literal & 1)
+                    {
+                        out[used + 2 + literal] = 0;
+                    }
+                    used += bytes;
+                    x += literal;
+                    continue;
+                }
+            }
+
+            if (used + 2 > capacity)
+            {
+                return false;
+            }
+            out[used] = static_cast<uint8_t>(run);
+            out[used + 1] = row[x];
+            used += 2;
+            x += run;
+        }
+
+        if (used + 2 > capacity)
+        {
+            return false;
+        }
+        out[used] = 0;
+        out[used + 1] = y + 1 == height ? 1 : 0;
+        used += 2;
+    }
+    rle.resize(used);
+    return true;
+}
+
+/**
+ * Put the file in file as an 8 bit palette or RLE8 image, or return
+ * false to have it written with its rows as they are.
+*/
+bool Bitmap::encode_compact(PixelVector &file)
+{
+    if (output_encoding == OutputEncoding::TrueColor || bmp_info_header.bit_count != 24 ||
+        bmp_info_header.width <= 0 || bmp_info_header.height <= 0)
+    {
+        return false;
+    }
+    TRACE_SCOPE("encode 8 bit", pixel_bytes());
+
+    uint32_t colors[256];
+    uint32_t count = 0;
+    PixelVector indices;
+    const BitmapView image = view();
+    if (!buildPalette(image, colors, count, indices))
+    {
+        return false;
+    }
+
+    const uint32_t width = image.width;
+    const uint32_t height = image.height;
+    const uint32_t offset = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + 4 * count;
+    const size_t stride = (static_cast<size_t>(width) + 3) & ~static_cast<size_t>(3);
+    const size_t palette_bytes = stride * height;
+    const size_t truecolor_bytes = ((static_cast<size_t>(width) * 3 + 3) & ~static_cast<size_t>(3)) * height;
+
+    // RLE8 is only worth it below the size of the plain palette rows.
+    PixelVector rle;
+    bool use_rle = false;
+    if (output_encoding == OutputEncoding::Rle8)
+    {
+        use_rle = encodeRle8(indices.data(), width, height, SIZE_MAX, rle);
+    }
+    else if (output_encoding == OutputEncoding::Auto)
+    {
+        use_rle = encodeRle8(indices.data(), width, height, palette_bytes - 1, rle);
+    }
+    const size_t pixel_bytes = use_rle ? rle.size() : palette_bytes;
+    if (output_encoding == OutputEncoding::Auto && offset + pixel_bytes >= sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + truecolor_bytes)
+    {
+        return false;
+    }
+
+    BMPFileHeader file_out = file_header;
+    file_out.file_type = 0x4D42;
+    file_out.offset_data = offset;
+    file_out.file_size = static_cast<uint32_t>(offset + pixel_bytes);
+    BMPInfoHeader info_out = bmp_info_header;
+    info_out.size = sizeof(BMPInfoHeader);
+    info_out.planes = 1;
+    info_out.bit_count = 8;
+    info_out.compression = use_rle ? BI_RLE8 : BI_RGB;
+    info_out.size_image = static_cast<uint32_t>(pixel_bytes);
+    info_out.colors_used = count;
+    info_out.colors_important = 0;
+
+    file.resize(offset + pixel_bytes);
+    uint8_t *out = file.data();
+    memcpy(out, &file_out, sizeof(file_out));
+    memcpy(out + sizeof(file_out), &info_out, sizeof(info_out));
+    out += sizeof(file_out) + sizeof(info_out);
+    for (uint32_t i = 0; i < count; i++, out += 4)
+    {
+        // blue, green, red, reserved
+        out[0] = colors[i] & 0xff;
+        out[1] = (colors[i] >> 8) & 0xff;
+        out[2] = (colors[i] >> 16) & 0xff;
+        out[3] = 0;
+    }
+
+    if (use_rle)
+    {
+        memcpy(out, rle.data(), rle.size());
+        return true;
+    }
+    for (uint32_t y = 0; y < height; y++, out += stride)
+    {
+        memcpy(out, indices.data() + static_cast<size_t>(width) * y, width);
+        memset(out + width, 0, stride - width);
+    }
+    return true;
+}
@@ -0,0 +1,157 @@
+#include "batch.h"
+#include "bitmap.h"
+#include "tilecache.h"
+#include "trace.h"
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+/**
+ * Runs a chain of filters over a batch of images:
+ *
+ *   bitmap [options] --manifest=FILE FILTER...
+ *   bitmap [options] --input=DIR --output=DIR FILTER...
+ *
+ * A manifest has an input and an output path per line; a directory
+ * gives every .bmp file in it. The filters, by the names filterName()
+ * gives them, run in the order given. Options:
+ *
+ *   --threads=N    workers, 0 (the default) for one per hardware thread
+ *   --prefetch=N   files read ahead and written back through AsyncIO
+ *   --band-rows=N  rows per band of fused filters, 0 to fit in L2
+ *   --cache=DIR    keep filtered images and tiles, in memory and in DIR
+ *   --trace=FILE   write a Chrome trace of the batch and print a summary
+ *   --quiet        print only the totals, not a line per image
+ */
+
+struct BatchOptions
+{
+    std::string manifest;
+    std::string input;
+    std::string output;
+    std::vector<std::string> filters;
+    unsigned threads{0};
+    unsigned prefetch{0};
+    uint32_t band_rows{0};
+    std::string cache;
+    std::string trace;
+    bool quiet{false};
+};
+
+static const char *const USAGE =
+    "usage: bitmap [--threads=N] [--prefetch=N] [--band-rows=N] [--cache=DIR] [--trace=FILE] [--quiet]\n"
+    "              (--manifest=FILE | --input=DIR --output=DIR) FILTER...";
+
+static BatchOptions parseOptions(int argc, char **argv)
+{
+    BatchOptions options;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        std::string value = arg.find('=') == std::string::npos ? "" : arg.substr(arg.find('=') + 1);
+        if (arg.rfind("--manifest=", 0) == 0)
+        {
+            options.manifest = value;
+        }
+        else if (arg.rfind("--input=", 0) == 0)
+        {
+            options.input = value;
+        }
+        else if (arg.rfind("--output=", 0) == 0)
+        {
+            options.output = value;
+        }
+        else if (arg.rfind("--threads=", 0) == 0)
+        {
+            options.threads = static_cast<unsigned>(atoi(value.c_str()));
+        }
+        else if (arg.rfind("--prefetch=", 0) == 0)
+        {
+            options.prefetch = static_cast<unsigned>(atoi(value.c_str()));
+        }
+        else if (arg.rfind("--band-rows=", 0) == 0)
+        {
+            options.band_rows = static_cast<uint32_t>(atoi(value.c_str()));
+        }
+        else if (arg.rfind("--cache=", 0) == 0)
+        {
+            options.cache = value;
+        }
+        else if (arg.rfind("--trace=", 0) == 0)
+        {
+            options.trace = value;
+        }
+        else if (arg == "--quiet")
+        {
+            options.quiet = true;
+        }
+        else if (arg.rfind("--", 0) == 0)
+        {
+            throw std::runtime_error(USAGE);
+        }
+        else
+        {
+            options.filters.push_back(arg);
+        }
+    }
+    if (options.manifest.empty() == (options.input.empty() && options.output.empty()) ||
+        options.input.empty() != options.output.empty() || options.filters.empty())
+    {
+        throw std::runtime_error(USAGE);
+    }
+    return options;
+}
+
+int main(int argc, char **argv)
+{
+    try
+    {
+        BatchOptions options = parseOptions(argc, argv);
+        FilterChain chain;
+        for (const std::string &name : options.filters)
+        {
+            void (*filter)(Bitmap &) = filterByName(name);
+            if (!filter)
+            {
+                throw std::runtime_error("unknown filter " + name);
+            }
+            chain.add(filter);
+        }
+
+        std::vector<BatchJob> jobs = options.manifest.empty() ? listDirectory(options.input, options.output)
+                                                              : readManifest(options.manifest);
+        std::unique_ptr<TileCache> cache;
+        if (!options.cache.empty())
+        {
+            cache.reset(new TileCache(256u << 20, options.cache));
+        }
+        if (!options.trace.empty())
+        {
+            Trace::enable();
+        }
+
+        BatchReport report = processBatch(jobs, chain, options.threads, options.band_rows, options.prefetch, cache.get());
+        report.print(std::cout, !options.quiet);
+
+        if (!options.trace.empty())
+        {
+            Trace::enable(false);
+            std::ofstream file(options.trace);
+            Trace::write_chrome_trace(file);
+            if (!file)
+            {
+                throw std::runtime_error("Unable to write " + options.trace);
+            }
+            Trace::print_summary(std::cout);
+        }
+        return report.failed ? 1 : 0;
+    }
+    catch (const std::exception &ex)
+    {
+        std::cerr << ex.what() << "\n";
+        return 1;
+    }
+}
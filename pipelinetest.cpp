@@ -0,0 +1,139 @@
+#include "bitmap.h"
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+/**
+ * Checks BandPipeline streaming against whole images, that a cut short
+ * input stream is an error rather than an image with garbage rows, and
+ * which FilterChain steps the chain signature knows.
+ *
+ *   bitmap_pipeline_test
+ */
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+    if (!ok)
+    {
+        printf("FAILED %s\n", what);
+        failures++;
+    }
+}
+
+/**
+ * a bottom-up 24 bits per pixel BMP file of random pixels, rows padded
+ * to 4 bytes.
+ */
+static std::string bmpFile(uint32_t width, uint32_t height, uint32_t seed)
+{
+    const uint32_t stride = (width * 3 + 3) & ~3u;
+    std::string file(54 + static_cast<size_t>(stride) * height, '\0');
+    uint8_t *p = (uint8_t *)&file[0];
+    const uint32_t fields[] = {static_cast<uint32_t>(file.size()), 0, 54, 40, width, height};
+    p[0] = 'B';
+    p[1] = 'M';
+    memcpy(p + 2, fields, sizeof(fields));
+    const uint16_t planes_bits[] = {1, 24};
+    memcpy(p + 26, planes_bits, sizeof(planes_bits));
+    const uint32_t size_image = stride * height;
+    memcpy(p + 34, &size_image, sizeof(size_image));
+
+    std::mt19937 random(seed);
+    for (uint32_t y = 0; y < height; y++)
+    {
+        for (uint32_t x = 0; x < width * 3; x++)
+        {
+            p[54 + static_cast<size_t>(y) * stride + x] = static_cast<uint8_t>(random());
+        }
+    }
+    return file;
+}
+
+/**
+ * run file through a pipeline of filter, returning whether it threw.
+ */
+static bool streamThrows(const std::string &file, void (*filter)(Bitmap &b), std::string &output)
+{
+    std::istringstream in(file);
+    std::ostringstream out;
+    try
+    {
+        BandPipeline().add(filter).run(in, out, 16);
+    }
+    catch (const std::exception &)
+    {
+        return true;
+    }
+    output = out.str();
+    return false;
+}
+
+static void testStream()
+{
+    const std::string file = bmpFile(37, 64, 1);
+
+    // the whole file streams to what filtering it in memory gives.
+    std::string streamed;
+    check(!streamThrows(file, blur, streamed), "stream: a whole file throws");
+    Bitmap b;
+    std::istringstream in(file);
+    in >> b;
+    blur(b);
+    std::ostringstream whole;
+    whole << b;
+    check(streamed == whole.str(), "stream: differs from filtering the whole image");
+
+    // cut in the headers, in the first row, in the padding of a row and near the end.
+    for (size_t size : {size_t(20), size_t(54 + 50), size_t(54 + 112), file.size() / 4, file.size() - 1})
+    {
+        std::string output;
+        if (!streamThrows(file.substr(0, size), blur, output))
+        {
+            printf("FAILED stream: a file cut to %zu of %zu bytes does not throw\n", size, file.size());
+            failures++;
+        }
+    }
+}
+
+static void testSignature()
+{
+    const std::string known = FilterChain().add(blur).signature();
+    check(!known.empty(), "signature: a chain of blur has none");
+
+    // a stage equal to the one of bandStage(), its name in another buffer.
+    BandStage stage = bandStage(blur);
+    const std::string name = std::string("bl") + "ur";
+    stage.name = name.c_str();
+    check(FilterChain().add(stage).signature() == known, "signature: a copied blur stage is not known");
+
+    BandStage tiles = stage;
+    tiles.tiles = !tiles.tiles;
+    check(FilterChain().add(tiles).signature().empty(), "signature: a stage with other tiles is known");
+
+    BandStage halo = stage;
+    halo.halo++;
+    check(FilterChain().add(halo).signature().empty(), "signature: a stage with another halo is known");
+
+    const std::string other = "blur2";
+    BandStage renamed = stage;
+    renamed.name = other.c_str();
+    check(FilterChain().add(renamed).signature().empty(), "signature: a renamed stage is known");
+}
+
+int main()
+{
+    testStream();
+    testSignature();
+    if (failures)
+    {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("all pipeline checks pass\n");
+    return 0;
+}
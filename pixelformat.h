@@ -0,0 +1,84 @@
+#ifndef PIXELFORMAT_H
+#define PIXELFORMAT_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stdexcept>
+
+/**
+ * Pixel formats the per-pixel filters are instantiated for. The number
+ * of components is a compile time constant, so channel loops unroll and
+ * formats without alpha carry no alpha code.
+ */
+
+/**
+ * one byte per pixel: a single plane of a PlanarBitmap.
+ */
+struct Gray8
+{
+    static const uint32_t channels = 1;
+    static const bool has_alpha = false;
+};
+
+/**
+ * 24 bit blue, green, red.
+ */
+struct BGR24
+{
+    static const uint32_t channels = 3;
+    static const bool has_alpha = false;
+};
+
+/**
+ * 32 bit blue, green, red, alpha.
+ */
+struct BGRA32
+{
+    static const uint32_t channels = 4;
+    static const bool has_alpha = true;
+};
+
+/**
+ * the components of one pixel in the given format.
+ */
+template <typename Format>
+struct Pixel
+{
+    uint8_t c[Format::channels];
+
+    static Pixel load(const uint8_t *p)
+    {
+        Pixel pixel;
+        memcpy(pixel.c, p, Format::channels);
+        return pixel;
+    }
+
+    void store(uint8_t *p) const
+    {
+        memcpy(p, c, Format::channels);
+    }
+};
+
+/**
+ * Call op with a value of the format that has the given number of bytes
+ * per pixel. Filters branch on the format here, once per image, and run
+ * op as a generic lambda instantiated for each format.
+ *
+ * @throws runtime_error if no format has that many bytes per pixel.
+ */
+template <typename Op>
+auto withPixelFormat(uint32_t bytes_per_pixel, Op &&op) -> decltype(op(BGR24()))
+{
+    switch (bytes_per_pixel)
+    {
+    case Gray8::channels:
+        return op(Gray8());
+    case BGR24::channels:
+        return op(BGR24());
+    case BGRA32::channels:
+        return op(BGRA32());
+    }
+    throw std::runtime_error("The program can treat only 24 or 32 bits per pixel BMP files");
+}
+
+#endif
@@ -0,0 +1,1134 @@
+#include "simd.h"
+#include "bitmap.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITMAP_X86 1
+#endif
+
+// x / 3 == (x * GRAY_THIRD) >> 16 for every sum of three bytes (x <= 765).
+static const uint32_t GRAY_THIRD = 21846;
+
+/**
+ * lookup table of nearesetNumber() for every byte value.
+ */
+static const uint8_t *cellShadeTable()
+{
+    static uint8_t table[256];
+    static bool built = [] {
+        for (int i = 0; i < 256; i++)
+        {
+            table[i] = nearesetNumber(static_cast<uint8_t>(i));
+        }
+        return true;
+    }();
+    (void)built;
+    return table;
+}
+
+static void cellShadeScalar(uint8_t *row, uint32_t bytes)
+{
+    const uint8_t *table = cellShadeTable();
+    for (uint32_t i = 0; i < bytes; i++)
+    {
+        row[i] = table[row[i]];
+    }
+}
+
+static void grayscale24Scalar(uint8_t *row, uint32_t width)
+{
+    for (uint32_t x = 0; x < width; x++)
+    {
+        uint8_t *pixel = row + x * 3;
+        uint8_t gray = static_cast<uint8_t>(((pixel[0] + pixel[1] + pixel[2]) * GRAY_THIRD) >> 16);
+        pixel[0] = pixel[1] = pixel[2] = gray;
+    }
+}
+
+static void grayscale32Scalar(uint8_t *row, uint32_t width)
+{
+    for (uint32_t x = 0; x < width; x++)
+    {
+        uint8_t *pixel = row + x * 4;
+        uint8_t gray = static_cast<uint8_t>((pixel[0] + pixel[1] + pixel[2] + pixel[3]) >> 2);
+        pixel[0] = pixel[1] = pixel[2] = pixel[3] = gray;
+    }
+}
+
+static void reverse24Scalar(uint8_t *row, uint32_t width)
+{
+    uint8_t *left = row;
+    uint8_t *right = row + static_cast<size_t>(width) * 3;
+    while (right - left >= 6)
+    {
+        right -= 3;
+        uint8_t pixel[3] = {left[0], left[1], left[2]};
+        left[0] = right[0];
+        left[1] = right[1];
+        left[2] = right[2];
+        right[0] = pixel[0];
+        right[1] = pixel[1];
+        right[2] = pixel[2];
+        left += 3;
+    }
+}
+
+static void reverse32Scalar(uint8_t *row, uint32_t width)
+{
+    uint8_t *left = row;
+    uint8_t *right = row + static_cast<size_t>(width) * 4;
+    while (right - left >= 8)
+    {
+        right -= 4;
+        uint32_t a, b;
+        memcpy(&a, left, 4);
+        memcpy(&b, right, 4);
+        memcpy(left, &b, 4);
+        memcpy(right, &a, 4);
+        left += 4;
+    }
+}
+
+static void swapRowsScalar(uint8_t *a, uint8_t *b, uint32_t bytes)
+{
+    for (uint32_t i = 0; i < bytes; i++)
+    {
+        uint8_t t = a[i];
+        a[i] = b[i];
+        b[i] = t;
+    }
+}
+
+/**
+ * resampleColumn for bytes [first, bytes) of the row.
+ */
+static void resampleColumnScalarFrom(const uint8_t *const *rows, const int16_t *weights, uint32_t taps,
+                                     uint8_t *out, uint32_t first, uint32_t bytes)
+{
+    for (uint32_t i = first; i < bytes; i++)
+    {
+        int32_t sum = 1 << (RESAMPLE_WEIGHT_BITS - 1);
+        for (uint32_t k = 0; k < taps; k++)
+        {
+            sum += rows[k][i] * weights[k];
+        }
+        sum >>= RESAMPLE_WEIGHT_BITS;
+        out[i] = static_cast<uint8_t>(sum < 0 ? 0 : (sum > 255 ? 255 : sum));
+    }
+}
+
+static void resampleColumnScalar(const uint8_t *const *rows, const int16_t *weights, uint32_t taps,
+                                 uint8_t *out, uint32_t bytes)
+{
+    resampleColumnScalarFrom(rows, weights, taps, out, 0, bytes);
+}
+
+/**
+ * byte offsets of the components inside C byte pixels, for building
+ * pshufb masks: split[c][k] gathers component c from the k-th 16 bytes of
+ * 16 interleaved pixels, merge[c][k] scatters plane c into the k-th 16
+ * bytes. -1 clears the byte.
+ */
+template <uint32_t C>
+struct PlaneShuffles
+{
+    int8_t split[C][C][16];
+    int8_t merge[C][C][16];
+
+    constexpr PlaneShuffles() : split(), merge()
+    {
+        for (uint32_t c = 0; c < C; c++)
+        {
+            for (uint32_t k = 0; k < C; k++)
+            {
+                for (uint32_t j = 0; j < 16; j++)
+                {
+                    int32_t from = static_cast<int32_t>(C * j + c) - static_cast<int32_t>(16 * k);
+                    split[c][k][j] = static_cast<int8_t>(from >= 0 && from < 16 ? from : -1);
+                    uint32_t to = 16 * k + j;
+                    merge[c][k][j] = static_cast<int8_t>(to % C == c ? to / C : -1);
+                }
+            }
+        }
+    }
+};
+
+static constexpr PlaneShuffles<3> PLANE_SHUFFLES_24;
+static constexpr PlaneShuffles<4> PLANE_SHUFFLES_32;
+
+/**
+ * splitPlanes for pixels [first, width) of the row.
+ */
+template <uint32_t C>
+static void splitPlanesScalarFrom(const uint8_t *row, uint8_t *const *planes, uint32_t first, uint32_t width)
+{
+    for (uint32_t x = first; x < width; x++)
+    {
+        for (uint32_t c = 0; c < C; c++)
+        {
+            planes[c][x] = row[x * C + c];
+        }
+    }
+}
+
+/**
+ * mergePlanes for pixels [first, width) of the row.
+ */
+template <uint32_t C>
+static void mergePlanesScalarFrom(const uint8_t *const *planes, uint8_t *row, uint32_t first, uint32_t width)
+{
+    for (uint32_t x = first; x < width; x++)
+    {
+        for (uint32_t c = 0; c < C; c++)
+        {
+            row[x * C + c] = planes[c][x];
+        }
+    }
+}
+
+static void splitPlanes24Scalar(const uint8_t *row, uint8_t *const *planes, uint32_t width)
+{
+    splitPlanesScalarFrom<3>(row, planes, 0, width);
+}
+
+static void splitPlanes32Scalar(const uint8_t *row, uint8_t *const *planes, uint32_t width)
+{
+    splitPlanesScalarFrom<4>(row, planes, 0, width);
+}
+
+static void mergePlanes24Scalar(const uint8_t *const *planes, uint8_t *row, uint32_t width)
+{
+    mergePlanesScalarFrom<3>(planes, row, 0, width);
+}
+
+static void mergePlanes32Scalar(const uint8_t *const *planes, uint8_t *row, uint32_t width)
+{
+    mergePlanesScalarFrom<4>(planes, row, 0, width);
+}
+
+/**
+ * grayscalePlanes for pixels [first, width).
+ */
+static void grayscalePlanes24ScalarFrom(uint8_t *const *planes, uint32_t first, uint32_t width)
+{
+    for (uint32_t x = first; x < width; x++)
+    {
+        uint8_t gray = static_cast<uint8_t>(((planes[0][x] + planes[1][x] + planes[2][x]) * GRAY_THIRD) >> 16);
+        planes[0][x] = planes[1][x] = planes[2][x] = gray;
+    }
+}
+
+static void grayscalePlanes32ScalarFrom(uint8_t *const *planes, uint32_t first, uint32_t width)
+{
+    for (uint32_t x = first; x < width; x++)
+    {
+        uint8_t gray = static_cast<uint8_t>((planes[0][x] + planes[1][x] + planes[2][x] + planes[3][x]) >> 2);
+        planes[0][x] = planes[1][x] = planes[2][x] = planes[3][x] = gray;
+    }
+}
+
+static void grayscalePlanes24Scalar(uint8_t *const *planes, uint32_t width)
+{
+    grayscalePlanes24ScalarFrom(planes, 0, width);
+}
+
+static void grayscalePlanes32Scalar(uint8_t *const *planes, uint32_t width)
+{
+    grayscalePlanes32ScalarFrom(planes, 0, width);
+}
+
+static void reverse8Scalar(uint8_t *row, uint32_t width)
+{
+    uint8_t *left = row;
+    uint8_t *right = row + width;
+    while (right - left >= 2)
+    {
+        right--;
+        uint8_t t = *left;
+        *left = *right;
+        *right = t;
+        left++;
+    }
+}
+
+#ifdef BITMAP_X86
+
+/*
+ * cellShade: a byte goes to 0 up to 64, to 128 from 65 to 191 and to
+ * 255 from 192, which is two unsigned compares done with max_epu8.
+ */
+
+__attribute__((target("sse2"))) static void cellShadeSSE(uint8_t *row, uint32_t bytes)
+{
+    const __m128i above64 = _mm_set1_epi8(65);
+    const __m128i above191 = _mm_set1_epi8((char)192);
+    const __m128i half = _mm_set1_epi8((char)128);
+    uint32_t i = 0;
+    for (; i + 16 <= bytes; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(row + i));
+        __m128i mid = _mm_cmpeq_epi8(_mm_max_epu8(v, above64), v);
+        __m128i high = _mm_cmpeq_epi8(_mm_max_epu8(v, above191), v);
+        _mm_storeu_si128((__m128i *)(row + i), _mm_or_si128(_mm_and_si128(mid, half), high));
+    }
+    cellShadeScalar(row + i, bytes - i);
+}
+
+__attribute__((target("avx2"))) static void cellShadeAVX2(uint8_t *row, uint32_t bytes)
+{
+    const __m256i above64 = _mm256_set1_epi8(65);
+    const __m256i above191 = _mm256_set1_epi8((char)192);
+    const __m256i half = _mm256_set1_epi8((char)128);
+    uint32_t i = 0;
+    for (; i + 32 <= bytes; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(row + i));
+        __m256i mid = _mm256_cmpeq_epi8(_mm256_max_epu8(v, above64), v);
+        __m256i high = _mm256_cmpeq_epi8(_mm256_max_epu8(v, above191), v);
+        _mm256_storeu_si256((__m256i *)(row + i), _mm256_or_si256(_mm256_and_si256(mid, half), high));
+    }
+    cellShadeSSE(row + i, bytes - i);
+}
+
+/*
+ * grayscale: each 16 byte lane holds four pixels. pshufb spreads them to
+ * 4 bytes each, maddubs + hadd add up the components of each pixel, and
+ * a second pshufb copies the result back over every component.
+ */
+
+__attribute__((target("ssse3"))) static void grayscale24SSE(uint8_t *row, uint32_t width)
+{
+    const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i gather = _mm_setr_epi8(0, 0, 0, 2, 2, 2, 4, 4, 4, 6, 6, 6, -1, -1, -1, -1);
+    const __m128i keep = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1, -1, -1, -1);
+    const __m128i ones = _mm_set1_epi8(1);
+    const __m128i third = _mm_set1_epi16((short)GRAY_THIRD);
+    uint32_t x = 0;
+
+    // a load covers 5 1/3 pixels, the last 4 bytes are written back unchanged.
+    for (; x + 6 <= width; x += 4)
+    {
+        uint8_t *p = row + x * 3;
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i sums = _mm_maddubs_epi16(_mm_shuffle_epi8(v, spread), ones);
+        sums = _mm_hadd_epi16(sums, sums);
+        __m128i gray = _mm_mulhi_epu16(sums, third);
+        __m128i out = _mm_or_si128(_mm_shuffle_epi8(gray, gather), _mm_and_si128(v, keep));
+        _mm_storeu_si128((__m128i *)p, out);
+    }
+    grayscale24Scalar(row + x * 3, width - x);
+}
+
+__attribute__((target("ssse3"))) static void grayscale32SSE(uint8_t *row, uint32_t width)
+{
+    const __m128i gather = _mm_setr_epi8(0, 0, 0, 0, 2, 2, 2, 2, 4, 4, 4, 4, 6, 6, 6, 6);
+    const __m128i ones = _mm_set1_epi8(1);
+    uint32_t x = 0;
+    for (; x + 4 <= width; x += 4)
+    {
+        uint8_t *p = row + x * 4;
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i sums = _mm_maddubs_epi16(v, ones);
+        sums = _mm_hadd_epi16(sums, sums);
+        __m128i gray = _mm_srli_epi16(sums, 2);
+        _mm_storeu_si128((__m128i *)p, _mm_shuffle_epi8(gray, gather));
+    }
+    grayscale32Scalar(row + x * 4, width - x);
+}
+
+__attribute__((target("avx2"))) static void grayscale24AVX2(uint8_t *row, uint32_t width)
+{
+    const __m256i spread = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                            0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m256i gather = _mm256_setr_epi8(0, 0, 0, 2, 2, 2, 4, 4, 4, 6, 6, 6, -1, -1, -1, -1,
+                                            0, 0, 0, 2, 2, 2, 4, 4, 4, 6, 6, 6, -1, -1, -1, -1);
+    const __m256i keep = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1, -1, -1, -1,
+                                          0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1, -1, -1, -1);
+    const __m256i ones = _mm256_set1_epi8(1);
+    const __m256i third = _mm256_set1_epi16((short)GRAY_THIRD);
+    uint32_t x = 0;
+
+    // the two lanes hold pixels x..x+3 and x+4..x+7; lane 0 is stored
+    // first so lane 1 overwrites the 4 bytes they share.
+    for (; x + 10 <= width; x += 8)
+    {
+        uint8_t *p = row + x * 3;
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)),
+                                            _mm_loadu_si128((const __m128i *)(p + 12)), 1);
+        __m256i sums = _mm256_maddubs_epi16(_mm256_shuffle_epi8(v, spread), ones);
+        sums = _mm256_hadd_epi16(sums, sums);
+        __m256i gray = _mm256_mulhi_epu16(sums, third);
+        __m256i out = _mm256_or_si256(_mm256_shuffle_epi8(gray, gather), _mm256_and_si256(v, keep));
+        _mm_storeu_si128((__m128i *)p, _mm256_castsi256_si128(out));
+        _mm_storeu_si128((__m128i *)(p + 12), _mm256_extracti128_si256(out, 1));
+    }
+    grayscale24SSE(row + x * 3, width - x);
+}
+
+__attribute__((target("avx2"))) static void grayscale32AVX2(uint8_t *row, uint32_t width)
+{
+    const __m256i gather = _mm256_setr_epi8(0, 0, 0, 0, 2, 2, 2, 2, 4, 4, 4, 4, 6, 6, 6, 6,
+                                            0, 0, 0, 0, 2, 2, 2, 2, 4, 4, 4, 4, 6, 6, 6, 6);
+    const __m256i ones = _mm256_set1_epi8(1);
+    uint32_t x = 0;
+    for (; x + 8 <= width; x += 8)
+    {
+        uint8_t *p = row + x * 4;
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i sums = _mm256_maddubs_epi16(v, ones);
+        sums = _mm256_hadd_epi16(sums, sums);
+        __m256i gray = _mm256_srli_epi16(sums, 2);
+        _mm256_storeu_si256((__m256i *)p, _mm256_shuffle_epi8(gray, gather));
+    }
+    grayscale32SSE(row + x * 4, width - x);
+}
+
+/*
+ * reverse: swap a block from each end of the row, reversing the pixel
+ * order inside each block. 24 bit rows move 5 pixels (15 of the 16
+ * loaded bytes) per block; the 16th byte is written back unchanged.
+ */
+
+__attribute__((target("ssse3"))) static void reverse24SSE(uint8_t *row, uint32_t width)
+{
+    const __m128i to_left = _mm_setr_epi8(13, 14, 15, 10, 11, 12, 7, 8, 9, 4, 5, 6, 1, 2, 3, -1);
+    const __m128i to_right = _mm_setr_epi8(-1, 12, 13, 14, 9, 10, 11, 6, 7, 8, 3, 4, 5, 0, 1, 2);
+    const __m128i keep_last = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1);
+    const __m128i keep_first = _mm_setr_epi8(-1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    uint32_t left = 0;
+    uint32_t right = width;
+
+    // the blocks stay 16 bytes apart, so the loads never overlap.
+    while (right - left >= 11)
+    {
+        uint8_t *l = row + left * 3;
+        uint8_t *r = row + right * 3 - 16;
+        __m128i lv = _mm_loadu_si128((const __m128i *)l);
+        __m128i rv = _mm_loadu_si128((const __m128i *)r);
+        _mm_storeu_si128((__m128i *)l, _mm_or_si128(_mm_shuffle_epi8(rv, to_left), _mm_and_si128(lv, keep_last)));
+        _mm_storeu_si128((__m128i *)r, _mm_or_si128(_mm_shuffle_epi8(lv, to_right), _mm_and_si128(rv, keep_first)));
+        left += 5;
+        right -= 5;
+    }
+    reverse24Scalar(row + left * 3, right - left);
+}
+
+__attribute__((target("sse2"))) static void reverse32SSE(uint8_t *row, uint32_t width)
+{
+    uint32_t left = 0;
+    uint32_t right = width;
+    while (right - left >= 8)
+    {
+        uint8_t *l = row + left * 4;
+        uint8_t *r = row + right * 4 - 16;
+        __m128i lv = _mm_loadu_si128((const __m128i *)l);
+        __m128i rv = _mm_loadu_si128((const __m128i *)r);
+        _mm_storeu_si128((__m128i *)l, _mm_shuffle_epi32(rv, _MM_SHUFFLE(0, 1, 2, 3)));
+        _mm_storeu_si128((__m128i *)r, _mm_shuffle_epi32(lv, _MM_SHUFFLE(0, 1, 2, 3)));
+        left += 4;
+        right -= 4;
+    }
+    reverse32Scalar(row + left * 4, right - left);
+}
+
+__attribute__((target("avx2"))) static void reverse32AVX2(uint8_t *row, uint32_t width)
+{
+    const __m256i reversed = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+    uint32_t left = 0;
+    uint32_t right = width;
+    while (right - left >= 16)
+    {
+        uint8_t *l = row + left * 4;
+        uint8_t *r = row + right * 4 - 32;
+        __m256i lv = _mm256_loadu_si256((const __m256i *)l);
+        __m256i rv = _mm256_loadu_si256((const __m256i *)r);
+        _mm256_storeu_si256((__m256i *)l, _mm256_permutevar8x32_epi32(rv, reversed));
+        _mm256_storeu_si256((__m256i *)r, _mm256_permutevar8x32_epi32(lv, reversed));
+        left += 8;
+        right -= 8;
+    }
+    reverse32SSE(row + left * 4, right - left);
+}
+
+__attribute__((target("sse2"))) static void swapRowsSSE(uint8_t *a, uint8_t *b, uint32_t bytes)
+{
+    uint32_t i = 0;
+    for (; i + 16 <= bytes; i += 16)
+    {
+        __m128i av = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i bv = _mm_loadu_si128((const __m128i *)(b + i));
+        _mm_storeu_si128((__m128i *)(a + i), bv);
+        _mm_storeu_si128((__m128i *)(b + i), av);
+    }
+    swapRowsScalar(a + i, b + i, bytes - i);
+}
+
+__attribute__((target("avx2"))) static void swapRowsAVX2(uint8_t *a, uint8_t *b, uint32_t bytes)
+{
+    uint32_t i = 0;
+    for (; i + 32 <= bytes; i += 32)
+    {
+        __m256i av = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i bv = _mm256_loadu_si256((const __m256i *)(b + i));
+        _mm256_storeu_si256((__m256i *)(a + i), bv);
+        _mm256_storeu_si256((__m256i *)(b + i), av);
+    }
+    swapRowsSSE(a + i, b + i, bytes - i);
+}
+
+/*
+ * resampleColumn: bytes of two tap rows are interleaved and widened to
+ * 16 bits, so one madd applies both weights at once. The 32 bit sums
+ * are packed back to bytes with saturation, which does the clamping.
+ * The AVX2 version does the same thing in each 128 bit lane.
+ */
+
+__attribute__((target("sse2"))) static void resampleColumnSSEFrom(const uint8_t *const *rows, const int16_t *weights, uint32_t taps,
+                                                                   uint8_t *out, uint32_t first, uint32_t bytes)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(1 << (RESAMPLE_WEIGHT_BITS - 1));
+    uint32_t i = first;
+    for (; i + 16 <= bytes; i += 16)
+    {
+        __m128i sum0 = round, sum1 = round, sum2 = round, sum3 = round;
+        for (uint32_t k = 0; k < taps; k += 2)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i *)(rows[k] + i));
+            __m128i b = zero;
+            uint32_t pair = static_cast<uint16_t>(weights[k]);
+            if (k + 1 < taps)
+            {
+                b = _mm_loadu_si128((const __m128i *)(rows[k + 1] + i));
+                pair |= static_cast<uint32_t>(static_cast<uint16_t>(weights[k + 1])) << 16;
+            }
+            __m128i w = _mm_set1_epi32(static_cast<int32_t>(pair));
+            __m128i lo = _mm_unpacklo_epi8(a, b);
+            __m128i hi = _mm_unpackhi_epi8(a, b);
+            sum0 = _mm_add_epi32(sum0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), w));
+            sum1 = _mm_add_epi32(sum1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), w));
+            sum2 = _mm_add_epi32(sum2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), w));
+            sum3 = _mm_add_epi32(sum3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), w));
+        }
+        __m128i low = _mm_packs_epi32(_mm_srai_epi32(sum0, RESAMPLE_WEIGHT_BITS), _mm_srai_epi32(sum1, RESAMPLE_WEIGHT_BITS));
+        __m128i high = _mm_packs_epi32(_mm_srai_epi32(sum2, RESAMPLE_WEIGHT_BITS), _mm_srai_epi32(sum3, RESAMPLE_WEIGHT_BITS));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(low, high));
+    }
+    resampleColumnScalarFrom(rows, weights, taps, out, i, bytes);
+}
+
+__attribute__((target("sse2"))) static void resampleColumnSSE(const uint8_t *const *rows, const int16_t *weights, uint32_t taps,
+                                                               uint8_t *out, uint32_t bytes)
+{
+    resampleColumnSSEFrom(rows, weights, taps, out, 0, bytes);
+}
+
+__attribute__((target("avx2"))) static void resampleColumnAVX2(const uint8_t *const *rows, const int16_t *weights, uint32_t taps,
+                                                                uint8_t *out, uint32_t bytes)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i round = _mm256_set1_epi32(1 << (RESAMPLE_WEIGHT_BITS - 1));
+    uint32_t i = 0;
+    for (; i + 32 <= bytes; i += 32)
+    {
+        __m256i sum0 = round, sum1 = round, sum2 = round, sum3 = round;
+        for (uint32_t k = 0; k < taps; k += 2)
+        {
+            __m256i a = _mm256_loadu_si256((const __m256i *)(rows[k] + i));
+            __m256i b = zero;
+            uint32_t pair = static_cast<uint16_t>(weights[k]);
+            if (k + 1 < taps)
+            {
+                b = _mm256_loadu_si256((const __m256i *)(rows[k + 1] + i));
+                pair |= static_cast<uint32_t>(static_cast<uint16_t>(weights[k + 1])) << 16;
+            }
+            __m256i w = _mm256_set1_epi32(static_cast<int32_t>(pair));
+            __m256i lo = _mm256_unpacklo_epi8(a, b);
+            __m256i hi = _mm256_unpackhi_epi8(a, b);
+            sum0 = _mm256_add_epi32(sum0, _mm256_madd_epi16(_mm256_unpacklo_epi8(lo, zero), w));
+            sum1 = _mm256_add_epi32(sum1, _mm256_madd_epi16(_mm256_unpackhi_epi8(lo, zero), w));
+            sum2 = _mm256_add_epi32(sum2, _mm256_madd_epi16(_mm256_unpacklo_epi8(hi, zero), w));
+            sum3 = _mm256_add_epi32(sum3, _mm256_madd_epi16(_mm256_unpackhi_epi8(hi, zero), w));
+        }
+        __m256i low = _mm256_packs_epi32(_mm256_srai_epi32(sum0, RESAMPLE_WEIGHT_BITS), _mm256_srai_epi32(sum1, RESAMPLE_WEIGHT_BITS));
+        __m256i high = _mm256_packs_epi32(_mm256_srai_epi32(sum2, RESAMPLE_WEIGHT_BITS), _mm256_srai_epi32(sum3, RESAMPLE_WEIGHT_BITS));
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_packus_epi16(low, high));
+    }
+    resampleColumnSSEFrom(rows, weights, taps, out, i, bytes);
+}
+
+/*
+ * planes: 16 pixels are C loads of 16 bytes. Each plane takes its bytes
+ * from every load with a pshufb and ORs them together; merging does the
+ * reverse. The AVX2 versions run two groups of 16 pixels, one per lane.
+ */
+
+template <uint32_t C>
+__attribute__((target("ssse3"))) static void splitPlanesSSEFrom(const uint8_t *row, uint8_t *const *planes, uint32_t first, uint32_t width,
+                                                                const PlaneShuffles<C> &shuffles)
+{
+    uint32_t x = first;
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i v[C];
+        for (uint32_t k = 0; k < C; k++)
+        {
+            v[k] = _mm_loadu_si128((const __m128i *)(row + x * C + 16 * k));
+        }
+        for (uint32_t c = 0; c < C; c++)
+        {
+            __m128i out = _mm_setzero_si128();
+            for (uint32_t k = 0; k < C; k++)
+            {
+                out = _mm_or_si128(out, _mm_shuffle_epi8(v[k], _mm_loadu_si128((const __m128i *)shuffles.split[c][k])));
+            }
+            _mm_storeu_si128((__m128i *)(planes[c] + x), out);
+        }
+    }
+    splitPlanesScalarFrom<C>(row, planes, x, width);
+}
+
+template <uint32_t C>
+__attribute__((target("ssse3"))) static void mergePlanesSSEFrom(const uint8_t *const *planes, uint8_t *row, uint32_t first, uint32_t width,
+                                                                const PlaneShuffles<C> &shuffles)
+{
+    uint32_t x = first;
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i p[C];
+        for (uint32_t c = 0; c < C; c++)
+        {
+            p[c] = _mm_loadu_si128((const __m128i *)(planes[c] + x));
+        }
+        for (uint32_t k = 0; k < C; k++)
+        {
+            __m128i out = _mm_setzero_si128();
+            for (uint32_t c = 0; c < C; c++)
+            {
+                out = _mm_or_si128(out, _mm_shuffle_epi8(p[c], _mm_loadu_si128((const __m128i *)shuffles.merge[c][k])));
+            }
+            _mm_storeu_si128((__m128i *)(row + x * C + 16 * k), out);
+        }
+    }
+    mergePlanesScalarFrom<C>(planes, row, x, width);
+}
+
+template <uint32_t C>
+__attribute__((target("avx2"))) static void splitPlanesAVX2(const uint8_t *row, uint8_t *const *planes, uint32_t width,
+                                                            const PlaneShuffles<C> &shuffles)
+{
+    uint32_t x = 0;
+    for (; x + 32 <= width; x += 32)
+    {
+        __m256i v[C];
+        for (uint32_t k = 0; k < C; k++)
+        {
+            const uint8_t *p = row + x * C + 16 * k;
+            v[k] = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)),
+                                           _mm_loadu_si128((const __m128i *)(p + 16 * C)), 1);
+        }
+        for (uint32_t c = 0; c < C; c++)
+        {
+            __m256i out = _mm256_setzero_si256();
+            for (uint32_t k = 0; k < C; k++)
+            {
+                __m256i mask = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)shuffles.split[c][k]));
+                out = _mm256_or_si256(out, _mm256_shuffle_epi8(v[k], mask));
+            }
+            _mm256_storeu_si256((__m256i *)(planes[c] + x), out);
+        }
+    }
+    splitPlanesSSEFrom<C>(row, planes, x, width, shuffles);
+}
+
+template <uint32_t C>
+__attribute__((target("avx2"))) static void mergePlanesAVX2(const uint8_t *const *planes, uint8_t *row, uint32_t width,
+                                                            const PlaneShuffles<C> &shuffles)
+{
+    uint32_t x = 0;
+    for (; x + 32 <= width; x += 32)
+    {
+        __m256i p[C];
+        for (uint32_t c = 0; c < C; c++)
+        {
+            p[c] = _mm256_loadu_si256((const __m256i *)(planes[c] + x));
+        }
+        for (uint32_t k = 0; k < C; k++)
+        {
+            __m256i out = _mm256_setzero_si256();
+            for (uint32_t c = 0; c < C; c++)
+            {
+                __m256i mask = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)shuffles.merge[c][k]));
+                out = _mm256_or_si256(out, _mm256_shuffle_epi8(p[c], mask));
+            }
+            uint8_t *d = row + x * C + 16 * k;
+            _mm_storeu_si128((__m128i *)d, _mm256_castsi256_si128(out));
+            _mm_storeu_si128((__m128i *)(d + 16 * C), _mm256_extracti128_si256(out, 1));
+        }
+    }
+    mergePlanesSSEFrom<C>(planes, row, x, width, shuffles);
+}
+
+__attribute__((target("ssse3"))) static void splitPlanes24SSE(const uint8_t *row, uint8_t *const *planes, uint32_t width)
+{
+    splitPlanesSSEFrom<3>(row, planes, 0, width, PLANE_SHUFFLES_24);
+}
+
+__attribute__((target("ssse3"))) static void splitPlanes32SSE(const uint8_t *row, uint8_t *const *planes, uint32_t width)
+{
+    splitPlanesSSEFrom<4>(row, planes, 0, width, PLANE_SHUFFLES_32);
+}
+
+__attribute__((target("ssse3"))) static void mergePlanes24SSE(const uint8_t *const *planes, uint8_t *row, uint32_t width)
+{
+    mergePlanesSSEFrom<3>(planes, row, 0, width, PLANE_SHUFFLES_24);
+}
+
+__attribute__((target("ssse3"))) static void mergePlanes32SSE(const uint8_t *const *planes, uint8_t *row, uint32_t width)
+{
+    mergePlanesSSEFrom<4>(planes, row, 0, width, PLANE_SHUFFLES_32);
+}
+
+__attribute__((target("avx2"))) static void splitPlanes24AVX2(const uint8_t *row, uint8_t *const *planes, uint32_t width)
+{
+    splitPlanesAVX2<3>(row, planes, width, PLANE_SHUFFLES_24);
+}
+
+__attribute__((target("avx2"))) static void splitPlanes32AVX2(const uint8_t *row, uint8_t *const *planes, uint32_t width)
+{
+    splitPlanesAVX2<4>(row, planes, width, PLANE_SHUFFLES_32);
+}
+
+__attribute__((target("avx2"))) static void mergePlanes24AVX2(const uint8_t *const *planes, uint8_t *row, uint32_t width)
+{
+    mergePlanesAVX2<3>(planes, row, width, PLANE_SHUFFLES_24);
+}
+
+__attribute__((target("avx2"))) static void mergePlanes32AVX2(const uint8_t *const *planes, uint8_t *row, uint32_t width)
+{
+    mergePlanesAVX2<4>(planes, row, width, PLANE_SHUFFLES_32);
+}
+
+/*
+ * grayscalePlanes: the planes are widened to 16 bits and added, then
+ * divided like grayscale24/32 and packed back. unpack and pack both work
+ * per lane, so the AVX2 version keeps the byte order without permutes.
+ */
+
+/**
+ * grayscalePlanes for pixels [first, width).
+ */
+__attribute__((target("sse2"))) static void grayscalePlanes24SSEFrom(uint8_t *const *planes, uint32_t first, uint32_t width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i third = _mm_set1_epi16((short)GRAY_THIRD);
+    uint32_t x = first;
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i lo = zero, hi = zero;
+        for (uint32_t c = 0; c < 3; c++)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(planes[c] + x));
+            lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero));
+            hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero));
+        }
+        __m128i gray = _mm_packus_epi16(_mm_mulhi_epu16(lo, third), _mm_mulhi_epu16(hi, third));
+        for (uint32_t c = 0; c < 3; c++)
+        {
+            _mm_storeu_si128((__m128i *)(planes[c] + x), gray);
+        }
+    }
+    grayscalePlanes24ScalarFrom(planes, x, width);
+}
+
+__attribute__((target("sse2"))) static void grayscalePlanes32SSEFrom(uint8_t *const *planes, uint32_t first, uint32_t width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t x = first;
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i lo = zero, hi = zero;
+        for (uint32_t c = 0; c < 4; c++)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(planes[c] + x));
+            lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero));
+            hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero));
+        }
+        __m128i gray = _mm_packus_epi16(_mm_srli_epi16(lo, 2), _mm_srli_epi16(hi, 2));
+        for (uint32_t c = 0; c < 4; c++)
+        {
+            _mm_storeu_si128((__m128i *)(planes[c] + x), gray);
+        }
+    }
+    grayscalePlanes32ScalarFrom(planes, x, width);
+}
+
+__attribute__((target("sse2"))) static void grayscalePlanes24SSE(uint8_t *const *planes, uint32_t width)
+{
+    grayscalePlanes24SSEFrom(planes, 0, width);
+}
+
+__attribute__((target("sse2"))) static void grayscalePlanes32SSE(uint8_t *const *planes, uint32_t width)
+{
+    grayscalePlanes32SSEFrom(planes, 0, width);
+}
+
+__attribute__((target("avx2"))) static void grayscalePlanes24AVX2(uint8_t *const *planes, uint32_t width)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i third = _mm256_set1_epi16((short)GRAY_THIRD);
+    uint32_t x = 0;
+    for (; x + 32 <= width; x += 32)
+    {
+        __m256i lo = zero, hi = zero;
+        for (uint32_t c = 0; c < 3; c++)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(planes[c] + x));
+            lo = _mm256_add_epi16(lo, _mm256_unpacklo_epi8(v, zero));
+            hi = _mm256_add_epi16(hi, _mm256_unpackhi_epi8(v, zero));
+        }
+        __m256i gray = _mm256_packus_epi16(_mm256_mulhi_epu16(lo, third), _mm256_mulhi_epu16(hi, third));
+        for (uint32_t c = 0; c < 3; c++)
+        {
+            _mm256_storeu_si256((__m256i *)(planes[c] + x), gray);
+        }
+    }
+    grayscalePlanes24SSEFrom(planes, x, width);
+}
+
+__attribute__((target("avx2"))) static void grayscalePlanes32AVX2(uint8_t *const *planes, uint32_t width)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    uint32_t x = 0;
+    for (; x + 32 <= width; x += 32)
+    {
+        __m256i lo = zero, hi = zero;
+        for (uint32_t c = 0; c < 4; c++)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(planes[c] + x));
+            lo = _mm256_add_epi16(lo, _mm256_unpacklo_epi8(v, zero));
+            hi = _mm256_add_epi16(hi, _mm256_unpackhi_epi8(v, zero));
+        }
+        __m256i gray = _mm256_packus_epi16(_mm256_srli_epi16(lo, 2), _mm256_srli_epi16(hi, 2));
+        for (uint32_t c = 0; c < 4; c++)
+        {
+            _mm256_storeu_si256((__m256i *)(planes[c] + x), gray);
+        }
+    }
+    grayscalePlanes32SSEFrom(planes, x, width);
+}
+
+/*
+ * reverse8: swap 16 (32) bytes from each end, reversed with pshufb. The
+ * AVX2 version also swaps the two lanes.
+ */
+
+__attribute__((target("ssse3"))) static void reverse8SSE(uint8_t *row, uint32_t width)
+{
+    const __m128i reversed = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    uint32_t left = 0;
+    uint32_t right = width;
+    while (right - left >= 32)
+    {
+        uint8_t *l = row + left;
+        uint8_t *r = row + right - 16;
+        __m128i lv = _mm_loadu_si128((const __m128i *)l);
+        __m128i rv = _mm_loadu_si128((const __m128i *)r);
+        _mm_storeu_si128((__m128i *)l, _mm_shuffle_epi8(rv, reversed));
+        _mm_storeu_si128((__m128i *)r, _mm_shuffle_epi8(lv, reversed));
+        left += 16;
+        right -= 16;
+    }
+    reverse8Scalar(row + left, right - left);
+}
+
+__attribute__((target("avx2"))) static void reverse8AVX2(uint8_t *row, uint32_t width)
+{
+    const __m256i reversed = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+                                              15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    uint32_t left = 0;
+    uint32_t right = width;
+    while (right - left >= 64)
+    {
+        uint8_t *l = row + left;
+        uint8_t *r = row + right - 32;
+        __m256i lv = _mm256_loadu_si256((const __m256i *)l);
+        __m256i rv = _mm256_loadu_si256((const __m256i *)r);
+        _mm256_storeu_si256((__m256i *)l, _mm256_permute4x64_epi64(_mm256_shuffle_epi8(rv, reversed), _MM_SHUFFLE(1, 0, 3, 2)));
+        _mm256_storeu_si256((__m256i *)r, _mm256_permute4x64_epi64(_mm256_shuffle_epi8(lv, reversed), _MM_SHUFFLE(1, 0, 3, 2)));
+        left += 32;
+        right -= 32;
+    }
+    reverse8SSE(row + left, right - left);
+}
+
+#endif
+
+/**
+ * the best instruction set this CPU supports, detected once.
+ */
+SimdLevel simdLevel()
+{
+#ifdef BITMAP_X86
+    static SimdLevel level = [] {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+        {
+            return SimdLevel::AVX2;
+        }
+        if (__builtin_cpu_supports("ssse3"))
+        {
+            return SimdLevel::SSE;
+        }
+        return SimdLevel::Scalar;
+    }();
+    return level;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+/*
+ * halveRows: pavgb rounds up, so the vertical average subtracts the
+ * lowest bit of a ^ b to round down instead. Even and odd pixels are
+ * then split apart with shuffles and averaged with pavgb.
+ */
+
+template <uint32_t Bpp>
+static void halveRowsScalarFrom(const uint8_t *top, const uint8_t *bottom, uint8_t *out, uint32_t first, uint32_t width)
+{
+    for (uint32_t x = first; x < width; x++)
+    {
+        const uint8_t *t = top + 2 * Bpp * x;
+        const uint8_t *b = bottom + 2 * Bpp * x;
+        for (uint32_t c = 0; c < Bpp; c++)
+        {
+            const uint32_t left = (t[c] + b[c]) >> 1;
+            const uint32_t right = (t[Bpp + c] + b[Bpp + c]) >> 1;
+            out[Bpp * x + c] = static_cast<uint8_t>((left + right + 1) >> 1);
+        }
+    }
+}
+
+static void halveRows24Scalar(const uint8_t *top, const uint8_t *bottom, uint8_t *out, uint32_t width)
+{
+    halveRowsScalarFrom<3>(top, bottom, out, 0, width);
+}
+
+static void halveRows32Scalar(const uint8_t *top, const uint8_t *bottom, uint8_t *out, uint32_t width)
+{
+    halveRowsScalarFrom<4>(top, bottom, out, 0, width);
+}
+
+#ifdef BITMAP_X86
+__attribute__((target("sse2"))) static inline __m128i averageDownSSE(__m128i a, __m128i b)
+{
+    return _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+}
+
+__attribute__((target("ssse3"))) static void halveRows24SSE(const uint8_t *top, const uint8_t *bottom, uint8_t *out, uint32_t width)
+{
+    // pixels 0-4 come from the first 16 bytes, 5-7 from bytes 8-23.
+    const __m128i even_low = _mm_setr_epi8(0, 1, 2, 6, 7, 8, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i even_high = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, 10, 11, 12, -1, -1, -1, -1);
+    const __m128i odd_low = _mm_setr_epi8(3, 4, 5, 9, 10, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i odd_high = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 7, 8, 9, 13, 14, 15, -1, -1, -1, -1);
+    uint32_t x = 0;
+    // four pixels a step, storing 16 bytes of which 12 are kept.
+    for (; x + 6 <= width; x += 4)
+    {
+        const uint8_t *t = top + 6 * x;
+        const uint8_t *b = bottom + 6 * x;
+        __m128i low = averageDownSSE(_mm_loadu_si128((const __m128i *)t), _mm_loadu_si128((const __m128i *)b));
+        __m128i high = averageDownSSE(_mm_loadu_si128((const __m128i *)(t + 8)), _mm_loadu_si128((const __m128i *)(b + 8)));
+        __m128i even = _mm_or_si128(_mm_shuffle_epi8(low, even_low), _mm_shuffle_epi8(high, even_high));
+        __m128i odd = _mm_or_si128(_mm_shuffle_epi8(low, odd_low), _mm_shuffle_epi8(high, odd_high));
+        _mm_storeu_si128((__m128i *)(out + 3 * x), _mm_avg_epu8(even, odd));
+    }
+    halveRowsScalarFrom<3>(top, bottom, out, x, width);
+}
+
+__attribute__((target("sse2"))) static void halveRows32SSEFrom(const uint8_t *top, const uint8_t *bottom, uint8_t *out, uint32_t first, uint32_t width)
+{
+    uint32_t x = first;
+    for (; x + 4 <= width; x += 4)
+    {
+        const uint8_t *t = top + 8 * x;
+        const uint8_t *b = bottom + 8 * x;
+        __m128 v0 = _mm_castsi128_ps(averageDownSSE(_mm_loadu_si128((const __m128i *)t), _mm_loadu_si128((const __m128i *)b)));
+        __m128 v1 = _mm_castsi128_ps(averageDownSSE(_mm_loadu_si128((const __m128i *)(t + 16)), _mm_loadu_si128((const __m128i *)(b + 16))));
+        __m128i even = _mm_castps_si128(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(2, 0, 2, 0)));
+        __m128i odd = _mm_castps_si128(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(3, 1, 3, 1)));
+        _mm_storeu_si128((__m128i *)(out + 4 * x), _mm_avg_epu8(even, odd));
+    }
+    halveRowsScalarFrom<4>(top, bottom, out, x, width);
+}
+
+__attribute__((target("sse2"))) static void halveRows32SSE(const uint8_t *top, const uint8_t *bottom, uint8_t *out, uint32_t width)
+{
+    halveRows32SSEFrom(top, bottom, out, 0, width);
+}
+
+__attribute__((target("avx2"))) static inline __m256i averageDownAVX2(__m256i a, __m256i b)
+{
+    return _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), _mm256_set1_epi8(1)));
+}
+
+__attribute__((target("avx2"))) static void halveRows32AVX2(const uint8_t *top, const uint8_t *bottom, uint8_t *out, uint32_t width)
+{
+    uint32_t x = 0;
+    for (; x + 8 <= width; x += 8)
+    {
+        const uint8_t *t = top + 8 * x;
+        const uint8_t *b = bottom + 8 * x;
+        __m256 v0 = _mm256_castsi256_ps(averageDownAVX2(_mm256_loadu_si256((const __m256i *)t), _mm256_loadu_si256((const __m256i *)b)));
+        __m256 v1 = _mm256_castsi256_ps(averageDownAVX2(_mm256_loadu_si256((const __m256i *)(t + 32)), _mm256_loadu_si256((const __m256i *)(b + 32))));
+        // the shuffles work per 128 bit lane, so put the 64 bit halves back in order.
+        __m256i even = _mm256_castps_si256(_mm256_shuffle_ps(v0, v1, _MM_SHUFFLE(2, 0, 2, 0)));
+        __m256i odd = _mm256_castps_si256(_mm256_shuffle_ps(v0, v1, _MM_SHUFFLE(3, 1, 3, 1)));
+        _mm256_storeu_si256((__m256i *)(out + 4 * x), _mm256_permute4x64_epi64(_mm256_avg_epu8(even, odd), _MM_SHUFFLE(3, 1, 2, 0)));
+    }
+    halveRows32SSEFrom(top, bottom, out, x, width);
+}
+#endif
+
+/*
+ * resampleRow: each output pixel is one pass over its taps, two source
+ * pixels at a time. pshufb puts component c of the pair side by side as
+ * 16 bit values, so one madd applies both weights to all the components.
+ * Pixels whose 8 byte loads would run past the row are done as scalar.
+ * AVX2 has no wider step here and uses the SSE kernels.
+ */
+
+template <uint32_t Bpp>
+static void resamplePixelScalar(const uint8_t *row, const uint32_t *first, const int16_t *weights, uint32_t taps,
+                                uint8_t *out, uint32_t x)
+{
+    const uint8_t *in = row + static_cast<size_t>(first[x]) * Bpp;
+    const int16_t *w = weights + static_cast<size_t>(x) * taps;
+    for (uint32_t c = 0; c < Bpp; c++)
+    {
+        int32_t sum = 1 << (RESAMPLE_WEIGHT_BITS - 1);
+        for (uint32_t k = 0; k < taps; k++)
+        {
+            sum += in[k * Bpp + c] * w[k];
+        }
+        sum >>= RESAMPLE_WEIGHT_BITS;
+        out[static_cast<size_t>(x) * Bpp + c] = static_cast<uint8_t>(sum < 0 ? 0 : (sum > 255 ? 255 : sum));
+    }
+}
+
+static void resampleRow24Scalar(const uint8_t *row, uint32_t, const uint32_t *first, const int16_t *weights,
+                                uint32_t taps, uint8_t *out, uint32_t width)
+{
+    for (uint32_t x = 0; x < width; x++)
+    {
+        resamplePixelScalar<3>(row, first, weights, taps, out, x);
+    }
+}
+
+static void resampleRow32Scalar(const uint8_t *row, uint32_t, const uint32_t *first, const int16_t *weights,
+                                uint32_t taps, uint8_t *out, uint32_t width)
+{
+    for (uint32_t x = 0; x < width; x++)
+    {
+        resamplePixelScalar<4>(row, first, weights, taps, out, x);
+    }
+}
+
+#ifdef BITMAP_X86
+template <uint32_t Bpp>
+__attribute__((target("ssse3"))) static void resampleRowSSE(const uint8_t *row, uint32_t src_width, const uint32_t *first,
+                                                            const int16_t *weights, uint32_t taps, uint8_t *out, uint32_t width)
+{
+    const __m128i pair = Bpp == 3 ? _mm_setr_epi8(0, -1, 3, -1, 1, -1, 4, -1, 2, -1, 5, -1, -1, -1, -1, -1)
+                                  : _mm_setr_epi8(0, -1, 4, -1, 1, -1, 5, -1, 2, -1, 6, -1, 3, -1, 7, -1);
+    const __m128i round = _mm_set1_epi32(1 << (RESAMPLE_WEIGHT_BITS - 1));
+    // the last pair of an odd number of taps reads one pixel more, with weight 0.
+    const uint32_t read = (taps + 1) & ~1u;
+    const size_t end = static_cast<size_t>(src_width) * Bpp;
+    for (uint32_t x = 0; x < width; x++)
+    {
+        const size_t start = static_cast<size_t>(first[x]) * Bpp;
+        if (start + static_cast<size_t>(read - 2) * Bpp + 8 > end)
+        {
+            resamplePixelScalar<Bpp>(row, first, weights, taps, out, x);
+            continue;
+        }
+        const uint8_t *in = row + start;
+        const int16_t *w = weights + static_cast<size_t>(x) * taps;
+        __m128i sum = round;
+        for (uint32_t k = 0; k < taps; k += 2)
+        {
+            uint32_t both = static_cast<uint16_t>(w[k]);
+            if (k + 1 < taps)
+            {
+                both |= static_cast<uint32_t>(static_cast<uint16_t>(w[k + 1])) << 16;
+            }
+            __m128i pixels = _mm_shuffle_epi8(_mm_loadl_epi64((const __m128i *)(in + k * Bpp)), pair);
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(pixels, _mm_set1_epi32(static_cast<int32_t>(both))));
+        }
+        sum = _mm_packs_epi32(_mm_srai_epi32(sum, RESAMPLE_WEIGHT_BITS), sum);
+        const uint32_t bytes = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_packus_epi16(sum, sum)));
+        memcpy(out + static_cast<size_t>(x) * Bpp, &bytes, Bpp);
+    }
+}
+
+__attribute__((target("ssse3"))) static void resampleRow24SSE(const uint8_t *row, uint32_t src_width, const uint32_t *first,
+                                                              const int16_t *weights, uint32_t taps, uint8_t *out, uint32_t width)
+{
+    resampleRowSSE<3>(row, src_width, first, weights, taps, out, width);
+}
+
+__attribute__((target("ssse3"))) static void resampleRow32SSE(const uint8_t *row, uint32_t src_width, const uint32_t *first,
+                                                              const int16_t *weights, uint32_t taps, uint8_t *out, uint32_t width)
+{
+    resampleRowSSE<4>(row, src_width, first, weights, taps, out, width);
+}
+#endif
+
+/**
+ * the kernels for the given instruction set, capped at what the CPU supports.
+ */
+const RowKernels &rowKernels(SimdLevel level)
+{
+    static const RowKernels scalar = {cellShadeScalar, grayscale24Scalar, grayscale32Scalar,
+                                      reverse24Scalar, reverse32Scalar, swapRowsScalar, resampleColumnScalar,
+                                      splitPlanes24Scalar, splitPlanes32Scalar, mergePlanes24Scalar, mergePlanes32Scalar,
+                                      grayscalePlanes24Scalar, grayscalePlanes32Scalar, reverse8Scalar,
+                                      halveRows24Scalar, halveRows32Scalar, resampleRow24Scalar, resampleRow32Scalar};
+#ifdef BITMAP_X86
+    static const RowKernels sse = {cellShadeSSE, grayscale24SSE, grayscale32SSE,
+                                   reverse24SSE, reverse32SSE, swapRowsSSE, resampleColumnSSE,
+                                   splitPlanes24SSE, splitPlanes32SSE, mergePlanes24SSE, mergePlanes32SSE,
+                                   grayscalePlanes24SSE, grayscalePlanes32SSE, reverse8SSE,
+                                   halveRows24SSE, halveRows32SSE, resampleRow24SSE, resampleRow32SSE};
+    static const RowKernels avx2 = {cellShadeAVX2, grayscale24AVX2, grayscale32AVX2,
+                                    reverse24SSE, reverse32AVX2, swapRowsAVX2, resampleColumnAVX2,
+                                    splitPlanes24AVX2, splitPlanes32AVX2, mergePlanes24AVX2, mergePlanes32AVX2,
+                                    grayscalePlanes24AVX2, grayscalePlanes32AVX2, reverse8AVX2,
+                                    halveRows24SSE, halveRows32AVX2, resampleRow24SSE, resampleRow32SSE};
+    if (level > simdLevel())
+    {
+        level = simdLevel();
+    }
+    if (level == SimdLevel::AVX2)
+    {
+        return avx2;
+    }
+    if (level == SimdLevel::SSE)
+    {
+        return sse;
+    }
+#endif
+    return scalar;
+}
+
+/**
+ * the kernels for simdLevel().
+ */
+const RowKernels &rowKernels()
+{
+    return rowKernels(simdLevel());
+}
@@ -0,0 +1,141 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stdint.h>
+
+/**
+ * instruction sets the row kernels can be built for.
+ */
+enum class SimdLevel
+{
+    Scalar,
+    SSE, // SSE2 + SSSE3
+    AVX2
+};
+
+/**
+ * Per-row pixel kernels. Each set does exactly the same arithmetic, only
+ * the instructions differ, so all of them give identical results.
+ */
+struct RowKernels
+{
+    /**
+     * round every byte of the row to the nearest of 0, 128, 255.
+     */
+    void (*cellShade)(uint8_t *row, uint32_t bytes);
+
+    /**
+     * set the components of each 24 bit pixel to their average.
+     */
+    void (*grayscale24)(uint8_t *row, uint32_t width);
+
+    /**
+     * set the components of each 32 bit pixel to their average.
+     */
+    void (*grayscale32)(uint8_t *row, uint32_t width);
+
+    /**
+     * reverse the order of the 24 bit pixels in the row, in place.
+     */
+    void (*reverse24)(uint8_t *row, uint32_t width);
+
+    /**
+     * reverse the order of the 32 bit pixels in the row, in place.
+     */
+    void (*reverse32)(uint8_t *row, uint32_t width);
+
+    /**
+     * exchange the contents of two rows that don't overlap.
+     */
+    void (*swapRows)(uint8_t *a, uint8_t *b, uint32_t bytes);
+
+    /**
+     * out[i] = sum of rows[k][i] * weights[k] over the taps, for every
+     * byte of the row. Weights are fixed point with RESAMPLE_WEIGHT_BITS
+     * fraction bits; results are rounded and clamped to 0..255.
+     */
+    void (*resampleColumn)(const uint8_t *const *rows, const int16_t *weights, uint32_t taps,
+                           uint8_t *out, uint32_t bytes);
+
+    /**
+     * copy component c of each 24 bit pixel to planes[c][x].
+     */
+    void (*splitPlanes24)(const uint8_t *row, uint8_t *const *planes, uint32_t width);
+
+    /**
+     * copy component c of each 32 bit pixel to planes[c][x].
+     */
+    void (*splitPlanes32)(const uint8_t *row, uint8_t *const *planes, uint32_t width);
+
+    /**
+     * build 24 bit pixels from planes[c][x], the inverse of splitPlanes24.
+     */
+    void (*mergePlanes24)(const uint8_t *const *planes, uint8_t *row, uint32_t width);
+
+    /**
+     * build 32 bit pixels from planes[c][x], the inverse of splitPlanes32.
+     */
+    void (*mergePlanes32)(const uint8_t *const *planes, uint8_t *row, uint32_t width);
+
+    /**
+     * set the three planes to the average of their bytes, as grayscale24.
+     */
+    void (*grayscalePlanes24)(uint8_t *const *planes, uint32_t width);
+
+    /**
+     * set the four planes to the average of their bytes, as grayscale32.
+     */
+    void (*grayscalePlanes32)(uint8_t *const *planes, uint32_t width);
+
+    /**
+     * reverse the order of the bytes in the row, in place.
+     */
+    void (*reverse8)(uint8_t *row, uint32_t width);
+
+    /**
+     * average each 2x2 block of 24 bit pixels of two rows of 2 * width
+     * pixels into one pixel of out: the rows are averaged rounding down,
+     * then pixel pairs rounding up, so repeated halving doesn't drift.
+     */
+    void (*halveRows24)(const uint8_t *top, const uint8_t *bottom, uint8_t *out, uint32_t width);
+
+    /**
+     * halveRows24 for 32 bit pixels.
+     */
+    void (*halveRows32)(const uint8_t *top, const uint8_t *bottom, uint8_t *out, uint32_t width);
+
+    /**
+     * resample a row of src_width 24 bit pixels to width pixels: out
+     * pixel x is the sum of row pixels first[x] + k times weights[x * taps
+     * + k] over the taps, rounded and clamped as resampleColumn.
+     */
+    void (*resampleRow24)(const uint8_t *row, uint32_t src_width, const uint32_t *first, const int16_t *weights,
+                          uint32_t taps, uint8_t *out, uint32_t width);
+
+    /**
+     * resampleRow24 for 32 bit pixels.
+     */
+    void (*resampleRow32)(const uint8_t *row, uint32_t src_width, const uint32_t *first, const int16_t *weights,
+                          uint32_t taps, uint8_t *out, uint32_t width);
+};
+
+// fraction bits of the fixed point resampling weights.
+static const uint32_t RESAMPLE_WEIGHT_BITS = 14;
+
+/**
+ * the best instruction set this CPU supports, detected once.
+ */
+SimdLevel simdLevel();
+
+/**
+ * the kernels for the given instruction set. Asking for a level the CPU
+ * doesn't support gives the best supported one below it.
+ */
+const RowKernels &rowKernels(SimdLevel level);
+
+/**
+ * the kernels for simdLevel().
+ */
+const RowKernels &rowKernels();
+
+#endif
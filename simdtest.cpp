@@ -0,0 +1,313 @@
+#include "simd.h"
+#include <functional>
+#include <random>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+/**
+ * Checks every SSE and AVX2 row kernel the CPU supports against the
+ * scalar one: each runs on the same random rows, 24 and 32 bit where the
+ * kernel has both, for every width up to a few vectors and some larger
+ * ones, so every tail length is covered. Buffers reach GUARD_BYTES of
+ * GUARD_VALUE past the row, which no kernel, scalar included, may change.
+ *
+ *   bitmap_test
+ */
+
+static const uint32_t GUARD_BYTES = 64;
+static const uint8_t GUARD_VALUE = 0xa5;
+
+// buffers whose guard a kernel wrote to.
+static uint32_t overruns = 0;
+
+/**
+ * runs a kernel of the given set on rows made from seed, and returns
+ * every byte it may have written, guards included.
+ */
+typedef std::function<std::vector<uint8_t>(const RowKernels &kernels, uint32_t width, uint32_t seed)> KernelRun;
+
+static std::vector<uint8_t> randomBytes(std::mt19937 &random, size_t size)
+{
+    std::vector<uint8_t> bytes(size + GUARD_BYTES, GUARD_VALUE);
+    for (size_t i = 0; i < size; i++)
+    {
+        bytes[i] = static_cast<uint8_t>(random());
+    }
+    return bytes;
+}
+
+/**
+ * add a buffer a kernel wrote to the output, checking its guard.
+ */
+static void append(std::vector<uint8_t> &out, const std::vector<uint8_t> &bytes)
+{
+    for (size_t i = bytes.size() - GUARD_BYTES; i < bytes.size(); i++)
+    {
+        if (bytes[i] != GUARD_VALUE)
+        {
+            overruns++;
+            break;
+        }
+    }
+    out.insert(out.end(), bytes.begin(), bytes.end());
+}
+
+/**
+ * a kernel that changes one row of bpp byte pixels in place, told the
+ * number of pixels or, with in_bytes, of bytes.
+ */
+static KernelRun inPlace(void (*RowKernels::*kernel)(uint8_t *, uint32_t), uint32_t bpp, bool in_bytes = false)
+{
+    return [=](const RowKernels &kernels, uint32_t width, uint32_t seed) {
+        std::mt19937 random(seed);
+        std::vector<uint8_t> row = randomBytes(random, static_cast<size_t>(width) * bpp);
+        (kernels.*kernel)(row.data(), in_bytes ? width * bpp : width);
+        std::vector<uint8_t> out;
+        append(out, row);
+        return out;
+    };
+}
+
+static KernelRun swapRows()
+{
+    return [](const RowKernels &kernels, uint32_t width, uint32_t seed) {
+        std::mt19937 random(seed);
+        std::vector<uint8_t> a = randomBytes(random, width);
+        std::vector<uint8_t> b = randomBytes(random, width);
+        kernels.swapRows(a.data(), b.data(), width);
+        std::vector<uint8_t> out;
+        append(out, a);
+        append(out, b);
+        return out;
+    };
+}
+
+static KernelRun resampleColumn()
+{
+    return [](const RowKernels &kernels, uint32_t width, uint32_t seed) {
+        std::mt19937 random(seed);
+        std::vector<uint8_t> out;
+        for (uint32_t taps = 1; taps <= 9; taps++)
+        {
+            // weights with negative lobes that add up to one, as Lanczos gives.
+            std::vector<int16_t> weights(taps);
+            int32_t sum = 0;
+            for (uint32_t k = 0; k + 1 < taps; k++)
+            {
+                weights[k] = static_cast<int16_t>(static_cast<int32_t>(random() % 9000) - 3000);
+                sum += weights[k];
+            }
+            weights[taps - 1] = static_cast<int16_t>((1 << RESAMPLE_WEIGHT_BITS) - sum);
+
+            std::vector<std::vector<uint8_t>> rows;
+            std::vector<const uint8_t *> pointers;
+            for (uint32_t k = 0; k < taps; k++)
+            {
+                rows.push_back(randomBytes(random, width));
+                pointers.push_back(rows.back().data());
+            }
+            std::vector<uint8_t> result = randomBytes(random, width);
+            kernels.resampleColumn(pointers.data(), weights.data(), taps, result.data(), width);
+            append(out, result);
+        }
+        return out;
+    };
+}
+
+static KernelRun resampleRow(void (*RowKernels::*kernel)(const uint8_t *, uint32_t, const uint32_t *, const int16_t *,
+                                                         uint32_t, uint8_t *, uint32_t),
+                             uint32_t bpp)
+{
+    return [=](const RowKernels &kernels, uint32_t width, uint32_t seed) {
+        std::mt19937 random(seed);
+        std::vector<uint8_t> out;
+        for (uint32_t taps = 1; taps <= 9; taps++)
+        {
+            // windows anywhere in the source row, the last pixel included.
+            const uint32_t src_width = width / 2 + taps;
+            std::vector<uint32_t> first(width);
+            std::vector<int16_t> weights(static_cast<size_t>(width) * taps);
+            for (uint32_t x = 0; x < width; x++)
+            {
+                first[x] = x + 1 == width ? src_width - taps : random() % (src_width - taps + 1);
+                int16_t *w = &weights[static_cast<size_t>(x) * taps];
+                int32_t sum = 0;
+                for (uint32_t k = 0; k + 1 < taps; k++)
+                {
+                    w[k] = static_cast<int16_t>(static_cast<int32_t>(random() % 9000) - 3000);
+                    sum += w[k];
+                }
+                w[taps - 1] = static_cast<int16_t>((1 << RESAMPLE_WEIGHT_BITS) - sum);
+            }
+
+            std::vector<uint8_t> row = randomBytes(random, static_cast<size_t>(src_width) * bpp);
+            std::vector<uint8_t> result = randomBytes(random, static_cast<size_t>(width) * bpp);
+            (kernels.*kernel)(row.data(), src_width, first.data(), weights.data(), taps, result.data(), width);
+            append(out, result);
+        }
+        return out;
+    };
+}
+
+static KernelRun splitPlanes(void (*RowKernels::*kernel)(const uint8_t *, uint8_t *const *, uint32_t), uint32_t bpp)
+{
+    return [=](const RowKernels &kernels, uint32_t width, uint32_t seed) {
+        std::mt19937 random(seed);
+        std::vector<uint8_t> row = randomBytes(random, static_cast<size_t>(width) * bpp);
+        std::vector<std::vector<uint8_t>> planes;
+        std::vector<uint8_t *> pointers;
+        for (uint32_t c = 0; c < bpp; c++)
+        {
+            planes.push_back(randomBytes(random, width));
+        }
+        for (std::vector<uint8_t> &plane : planes)
+        {
+            pointers.push_back(plane.data());
+        }
+        (kernels.*kernel)(row.data(), pointers.data(), width);
+        std::vector<uint8_t> out;
+        for (const std::vector<uint8_t> &plane : planes)
+        {
+            append(out, plane);
+        }
+        return out;
+    };
+}
+
+static KernelRun mergePlanes(void (*RowKernels::*kernel)(const uint8_t *const *, uint8_t *, uint32_t), uint32_t bpp)
+{
+    return [=](const RowKernels &kernels, uint32_t width, uint32_t seed) {
+        std::mt19937 random(seed);
+        std::vector<std::vector<uint8_t>> planes;
+        std::vector<const uint8_t *> pointers;
+        for (uint32_t c = 0; c < bpp; c++)
+        {
+            planes.push_back(randomBytes(random, width));
+        }
+        for (const std::vector<uint8_t> &plane : planes)
+        {
+            pointers.push_back(plane.data());
+        }
+        std::vector<uint8_t> row = randomBytes(random, static_cast<size_t>(width) * bpp);
+        (kernels.*kernel)(pointers.data(), row.data(), width);
+        std::vector<uint8_t> out;
+        append(out, row);
+        return out;
+    };
+}
+
+static KernelRun grayscalePlanes(void (*RowKernels::*kernel)(uint8_t *const *, uint32_t), uint32_t bpp)
+{
+    return [=](const RowKernels &kernels, uint32_t width, uint32_t seed) {
+        std::mt19937 random(seed);
+        std::vector<std::vector<uint8_t>> planes;
+        std::vector<uint8_t *> pointers;
+        for (uint32_t c = 0; c < bpp; c++)
+        {
+            planes.push_back(randomBytes(random, width));
+        }
+        for (std::vector<uint8_t> &plane : planes)
+        {
+            pointers.push_back(plane.data());
+        }
+        (kernels.*kernel)(pointers.data(), width);
+        std::vector<uint8_t> out;
+        for (const std::vector<uint8_t> &plane : planes)
+        {
+            append(out, plane);
+        }
+        return out;
+    };
+}
+
+static KernelRun halveRows(void (*RowKernels::*kernel)(const uint8_t *, const uint8_t *, uint8_t *, uint32_t), uint32_t bpp)
+{
+    return [=](const RowKernels &kernels, uint32_t width, uint32_t seed) {
+        std::mt19937 random(seed);
+        std::vector<uint8_t> top = randomBytes(random, static_cast<size_t>(width) * 2 * bpp);
+        std::vector<uint8_t> bottom = randomBytes(random, static_cast<size_t>(width) * 2 * bpp);
+        std::vector<uint8_t> out = randomBytes(random, static_cast<size_t>(width) * bpp);
+        std::vector<uint8_t> result;
+        (kernels.*kernel)(top.data(), bottom.data(), out.data(), width);
+        append(result, out);
+        return result;
+    };
+}
+
+int main()
+{
+    // cellShade and swapRows take bytes, the others pixels.
+    const std::vector<std::pair<std::string, KernelRun>> kernels = {
+        {"cellShade", inPlace(&RowKernels::cellShade, 1, true)},
+        {"cellShade 24 bit", inPlace(&RowKernels::cellShade, 3, true)},
+        {"cellShade 32 bit", inPlace(&RowKernels::cellShade, 4, true)},
+        {"grayscale24", inPlace(&RowKernels::grayscale24, 3)},
+        {"grayscale32", inPlace(&RowKernels::grayscale32, 4)},
+        {"reverse8", inPlace(&RowKernels::reverse8, 1)},
+        {"reverse24", inPlace(&RowKernels::reverse24, 3)},
+        {"reverse32", inPlace(&RowKernels::reverse32, 4)},
+        {"swapRows", swapRows()},
+        {"resampleColumn", resampleColumn()},
+        {"resampleRow24", resampleRow(&RowKernels::resampleRow24, 3)},
+        {"resampleRow32", resampleRow(&RowKernels::resampleRow32, 4)},
+        {"splitPlanes24", splitPlanes(&RowKernels::splitPlanes24, 3)},
+        {"splitPlanes32", splitPlanes(&RowKernels::splitPlanes32, 4)},
+        {"mergePlanes24", mergePlanes(&RowKernels::mergePlanes24, 3)},
+        {"mergePlanes32", mergePlanes(&RowKernels::mergePlanes32, 4)},
+        {"grayscalePlanes24", grayscalePlanes(&RowKernels::grayscalePlanes24, 3)},
+        {"grayscalePlanes32", grayscalePlanes(&RowKernels::grayscalePlanes32, 4)},
+        {"halveRows24", halveRows(&RowKernels::halveRows24, 3)},
+        {"halveRows32", halveRows(&RowKernels::halveRows32, 4)},
+    };
+
+    std::vector<uint32_t> widths;
+    for (uint32_t width = 0; width <= 130; width++)
+    {
+        widths.push_back(width);
+    }
+    for (uint32_t width : {255u, 256u, 257u, 1000u, 1023u, 1031u, 4097u})
+    {
+        widths.push_back(width);
+    }
+
+    const RowKernels &scalar = rowKernels(SimdLevel::Scalar);
+    const std::pair<SimdLevel, const char *> levels[] = {{SimdLevel::SSE, "SSE"}, {SimdLevel::AVX2, "AVX2"}};
+    int failures = 0;
+    for (const std::pair<SimdLevel, const char *> &level : levels)
+    {
+        if (simdLevel() < level.first)
+        {
+            printf("%s: not supported by this CPU, skipped\n", level.second);
+            continue;
+        }
+        const RowKernels &vector = rowKernels(level.first);
+        for (const std::pair<std::string, KernelRun> &kernel : kernels)
+        {
+            uint32_t seed = 1;
+            for (uint32_t width : widths)
+            {
+                overruns = 0;
+                if (kernel.second(vector, width, seed) != kernel.second(scalar, width, seed))
+                {
+                    printf("FAILED %s %s: width %u differs from scalar\n", level.second, kernel.first.c_str(), width);
+                    failures++;
+                }
+                if (overruns)
+                {
+                    printf("FAILED %s %s: width %u writes past the row\n", level.second, kernel.first.c_str(), width);
+                    failures++;
+                }
+                seed++;
+            }
+        }
+        printf("%s: %zu kernels checked on %zu widths\n", level.second, kernels.size(), widths.size());
+    }
+    if (failures)
+    {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("all kernels match scalar\n");
+    return 0;
+}
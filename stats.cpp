@@ -0,0 +1,192 @@
+#include "bitmap.h"
+#include "pixelformat.h"
+#include "threadpool.h"
+#include "trace.h"
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string.h>
+
+// interleaved histograms per channel; pixel x counts into x % SUB_HISTOGRAMS.
+static const uint32_t SUB_HISTOGRAMS = 4;
+
+// bytes of rows each thread counts at a time.
+static const size_t STATS_GRAIN_BYTES = 64u << 10;
+
+/**
+ * Histograms of some of the pixels of an image, counted into 32 bit sub
+ * histograms and carried over into 64 bit totals before they can
+ * overflow.
+ */
+struct StatsCounts
+{
+    uint32_t channels;
+    uint64_t pixels{0};
+    uint64_t pending{0}; // pixels in the sub histograms
+    uint64_t totals[4][256];
+    uint32_t counts[SUB_HISTOGRAMS][4][256];
+
+    explicit StatsCounts(uint32_t channels) : channels(channels)
+    {
+        if (channels != Gray8::channels && channels != BGR24::channels && channels != BGRA32::channels)
+        {
+            throw std::runtime_error("Stats can only be taken of 8, 24 or 32 bits per pixel images");
+        }
+        memset(totals, 0, sizeof(totals));
+        memset(counts, 0, sizeof(counts));
+    }
+
+    void add(BitmapView view)
+    {
+        withPixelFormat(view.bpp, [&](auto format) {
+            const uint32_t n = decltype(format)::channels;
+            for (uint32_t y = 0; y < view.height; y++)
+            {
+                if (pending + view.width > UINT32_MAX)
+                {
+                    flush();
+                }
+                const uint8_t *p = view.row(y);
+                uint32_t x = 0;
+                for (; x + SUB_HISTOGRAMS <= view.width; x += SUB_HISTOGRAMS, p += SUB_HISTOGRAMS * n)
+                {
+                    for (uint32_t c = 0; c < n; c++)
+                    {
+                        counts[0][c][p[c]]++;
+                        counts[1][c][p[n + c]]++;
+                        counts[2][c][p[2 * n + c]]++;
+                        counts[3][c][p[3 * n + c]]++;
+                    }
+                }
+                for (; x < view.width; x++, p += n)
+                {
+                    for (uint32_t c = 0; c < n; c++)
+                    {
+                        counts[0][c][p[c]]++;
+                    }
+                }
+                pending += view.width;
+            }
+        });
+    }
+
+    void flush()
+    {
+        for (uint32_t s = 0; s < SUB_HISTOGRAMS; s++)
+        {
+            for (uint32_t c = 0; c < channels; c++)
+            {
+                for (uint32_t v = 0; v < 256; v++)
+                {
+                    totals[c][v] += counts[s][c][v];
+                }
+            }
+        }
+        memset(counts, 0, sizeof(counts));
+        pixels += pending;
+        pending = 0;
+    }
+
+    void merge(StatsCounts &other)
+    {
+        other.flush();
+        for (uint32_t c = 0; c < channels; c++)
+        {
+            for (uint32_t v = 0; v < 256; v++)
+            {
+                totals[c][v] += other.totals[c][v];
+            }
+        }
+        pixels += other.pixels;
+    }
+
+    ImageStats finish()
+    {
+        flush();
+        ImageStats stats;
+        stats.channels = channels;
+        stats.pixels = pixels;
+        for (uint32_t c = 0; c < channels && pixels; c++)
+        {
+            ChannelStats &channel = stats.channel[c];
+            memcpy(channel.histogram, totals[c], sizeof(channel.histogram));
+            uint64_t sum = 0;
+            for (uint32_t v = 0; v < 256; v++)
+            {
+                sum += totals[c][v] * v;
+            }
+            channel.mean = static_cast<double>(sum) / pixels;
+            double squares = 0;
+            for (uint32_t v = 0; v < 256; v++)
+            {
+                squares += totals[c][v] * (v - channel.mean) * (v - channel.mean);
+            }
+            channel.variance = squares / pixels;
+            uint32_t low = 0;
+            while (totals[c][low] == 0)
+            {
+                low++;
+            }
+            uint32_t high = 255;
+            while (totals[c][high] == 0)
+            {
+                high--;
+            }
+            channel.min = static_cast<uint8_t>(low);
+            channel.max = static_cast<uint8_t>(high);
+        }
+        return stats;
+    }
+};
+
+/**
+ * count the rows of the view into total, a block of rows per thread.
+ */
+static void countRows(BitmapView view, StatsCounts &total)
+{
+    if (view.empty())
+    {
+        return;
+    }
+    std::mutex mutex;
+    const size_t row_bytes = static_cast<size_t>(view.width) * view.bpp;
+    const uint32_t grain = static_cast<uint32_t>(std::max<size_t>(STATS_GRAIN_BYTES / row_bytes, 1));
+    ThreadPool::shared().parallel_for(0, view.height, [&](uint32_t first, uint32_t last) {
+        std::unique_ptr<StatsCounts> counts(new StatsCounts(total.channels));
+        counts->add(view.crop(0, first, view.width, last - first));
+        std::lock_guard<std::mutex> lock(mutex);
+        total.merge(*counts);
+    }, grain);
+}
+
+ImageStats computeStats(BitmapView view)
+{
+    TRACE_SCOPE("stats", static_cast<uint64_t>(view.width) * view.height * view.bpp);
+    StatsCounts total(view.bpp);
+    countRows(view, total);
+    return total.finish();
+}
+
+StatsRead withStats(Bitmap &b, ImageStats &stats)
+{
+    return StatsRead{b, stats};
+}
+
+std::istream &operator>>(std::istream &in, StatsRead read)
+{
+    read.stats = ImageStats();
+    std::unique_ptr<StatsCounts> total;
+    read.bitmap.read(in, [&](BitmapView rows) {
+        TRACE_SCOPE("stats", static_cast<uint64_t>(rows.width) * rows.height * rows.bpp);
+        if (!total)
+        {
+            total.reset(new StatsCounts(rows.bpp));
+        }
+        countRows(rows, *total);
+    });
+    if (in && total)
+    {
+        read.stats = total->finish();
+    }
+    return in;
+}
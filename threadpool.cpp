@@ -0,0 +1,315 @@
+#include "threadpool.h"
+#include <algorithm>
+
+// set while a SerialScope of the current thread is alive.
+static thread_local bool serial_thread = false;
+
+/**
+ * @param threads total threads working on a loop, including the caller.
+ */
+ThreadPool::ThreadPool(unsigned threads)
+{
+    for (unsigned i = 1; i < threads; i++)
+    {
+        workers.emplace_back(&ThreadPool::worker_loop, this);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+/**
+ * number of threads working on a loop, including the caller.
+ */
+unsigned ThreadPool::size() const
+{
+    return static_cast<unsigned>(workers.size()) + 1;
+}
+
+void ThreadPool::worker_loop()
+{
+    for (;;)
+    {
+        std::shared_ptr<Job> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty())
+            {
+                return;
+            }
+            job = queue.front();
+            queue.pop_front();
+        }
+        run_chunks(*job);
+    }
+}
+
+/**
+ * run chunks of the job until none are left.
+ */
+void ThreadPool::run_chunks(Job &job)
+{
+    for (uint32_t chunk = job.next++; chunk < job.chunks; chunk = job.next++)
+    {
+        uint32_t first = job.begin + chunk * job.grain;
+        uint32_t last = std::min(first + job.grain, job.end);
+        try
+        {
+            (*job.body)(first, last);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(job.mutex);
+            if (!job.error)
+            {
+                job.error = std::current_exception();
+            }
+        }
+        if (--job.remaining == 0)
+        {
+            std::lock_guard<std::mutex> lock(job.mutex);
+            job.finished.notify_all();
+        }
+    }
+}
+
+/**
+ * calls body(first, last) over [begin, end) in chunks of at least
+ * grain items, spread over the pool, and returns once all are done.
+ *
+ * @throws the first exception thrown by body.
+ */
+void ThreadPool::parallel_for(uint32_t begin, uint32_t end, const std::function<void(uint32_t, uint32_t)> &body, uint32_t grain)
+{
+    if (begin >= end)
+    {
+        return;
+    }
+
+    // aim for a few chunks per thread so uneven rows even out.
+    uint32_t count = end - begin;
+    grain = std::max(grain, (count + size() * 4 - 1) / (size() * 4));
+    uint32_t chunks = (count + grain - 1) / grain;
+    if (chunks == 1 || workers.empty() || serial_thread)
+    {
+        body(begin, end);
+        return;
+    }
+
+    std::shared_ptr<Job> job = std::make_shared<Job>();
+    job->body = &body;
+    job->begin = begin;
+    job->end = end;
+    job->grain = grain;
+    job->chunks = chunks;
+    job->remaining = chunks;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t helpers = std::min<size_t>(workers.size(), chunks - 1);
+        for (size_t i = 0; i < helpers; i++)
+        {
+            queue.push_back(job);
+        }
+    }
+    wake.notify_all();
+
+    run_chunks(*job);
+    {
+        std::unique_lock<std::mutex> lock(job->mutex);
+        job->finished.wait(lock, [&job] { return job->remaining == 0; });
+    }
+    if (job->error)
+    {
+        std::rethrow_exception(job->error);
+    }
+}
+
+/**
+ * the pool shared by the filters, one thread per hardware thread.
+ */
+ThreadPool &ThreadPool::shared()
+{
+    static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+    return pool;
+}
+
+ThreadPool::SerialScope::SerialScope(bool serial) : previous(serial_thread)
+{
+    serial_thread = serial_thread || serial;
+}
+
+ThreadPool::SerialScope::~SerialScope()
+{
+    serial_thread = previous;
+}
+
+// the pool and worker index of the current thread, if it is a WorkStealingPool worker.
+static thread_local WorkStealingPool *current_pool = nullptr;
+static thread_local unsigned current_worker = 0;
+
+/**
+ * @param threads number of workers.
+ */
+WorkStealingPool::WorkStealingPool(unsigned threads)
+{
+    threads = std::max(1u, threads);
+    for (unsigned i = 0; i < threads; i++)
+    {
+        queues.emplace_back(new Queue);
+    }
+    for (unsigned i = 0; i < threads; i++)
+    {
+        workers.emplace_back(&WorkStealingPool::worker_loop, this, i);
+    }
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+/**
+ * number of workers.
+ */
+unsigned WorkStealingPool::size() const
+{
+    return static_cast<unsigned>(workers.size());
+}
+
+/**
+ * queue a task on the current worker's local deque, or on the next
+ * worker's deque in turn.
+ */
+void WorkStealingPool::submit(Task task)
+{
+    unsigned target;
+    const bool local = current_pool == this;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        target = local ? current_worker : next_queue++ % queues.size();
+        unfinished++;
+    }
+    {
+        std::lock_guard<std::mutex> lock(queues[target]->mutex);
+        (local ? queues[target]->local : queues[target]->tasks).push_back(std::move(task));
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queued++;
+    }
+    wake.notify_one();
+}
+
+/**
+ * block until every submitted task has finished.
+ */
+void WorkStealingPool::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this] { return unfinished == 0; });
+    if (error)
+    {
+        std::exception_ptr first = error;
+        error = nullptr;
+        std::rethrow_exception(first);
+    }
+}
+
+/**
+ * take the newest local task of the worker, then its oldest outside one,
+ * or steal the oldest task of another worker.
+ */
+bool WorkStealingPool::take(unsigned worker, Task &task)
+{
+    {
+        Queue &own = *queues[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.local.empty())
+        {
+            task = std::move(own.local.back());
+            own.local.pop_back();
+            return true;
+        }
+        if (!own.tasks.empty())
+        {
+            task = std::move(own.tasks.front());
+            own.tasks.pop_front();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < queues.size(); i++)
+    {
+        Queue &victim = *queues[(worker + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        std::deque<Task> &tasks = victim.tasks.empty() ? victim.local : victim.tasks;
+        if (!tasks.empty())
+        {
+            task = std::move(tasks.front());
+            tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkStealingPool::worker_loop(unsigned worker)
+{
+    current_pool = this;
+    current_worker = worker;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this] { return stopping || queued > 0; });
+            if (queued == 0)
+            {
+                return;
+            }
+            queued--;
+        }
+
+        // a task was counted for us, so one is in some deque.
+        Task task;
+        while (!take(worker, task))
+        {
+            std::this_thread::yield();
+        }
+        try
+        {
+            task(worker);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error)
+            {
+                error = std::current_exception();
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--unfinished == 0)
+        {
+            idle.notify_all();
+        }
+    }
+}
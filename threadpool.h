@@ -0,0 +1,174 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed set of worker threads that split loops over rows between them.
+ *
+ * The thread calling parallel_for always works on its own loop as well,
+ * so nested or concurrent calls can never wait on a busy pool.
+ */
+class ThreadPool
+{
+    /**
+     * one parallel_for call, handed out to the workers in chunks.
+     */
+    struct Job
+    {
+        const std::function<void(uint32_t, uint32_t)> *body{nullptr};
+        uint32_t begin{0};
+        uint32_t end{0};
+        uint32_t grain{1};
+        uint32_t chunks{0};
+        std::atomic<uint32_t> next{0};
+        std::atomic<uint32_t> remaining{0};
+        std::exception_ptr error;
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+
+    std::vector<std::thread> workers;
+    std::deque<std::shared_ptr<Job>> queue;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping{false};
+
+    void worker_loop();
+
+    /**
+     * run chunks of the job until none are left.
+     */
+    static void run_chunks(Job &job);
+
+public:
+    /**
+     * @param threads total threads working on a loop, including the caller.
+     */
+    explicit ThreadPool(unsigned threads = std::thread::hardware_concurrency());
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    /**
+     * number of threads working on a loop, including the caller.
+     */
+    unsigned size() const;
+
+    /**
+     * calls body(first, last) over [begin, end) in chunks of at least
+     * grain items, spread over the pool, and returns once all are done.
+     *
+     * @throws the first exception thrown by body.
+     */
+    void parallel_for(uint32_t begin, uint32_t end, const std::function<void(uint32_t, uint32_t)> &body, uint32_t grain = 1);
+
+    /**
+     * the pool shared by the filters, one thread per hardware thread.
+     */
+    static ThreadPool &shared();
+
+    /**
+     * While alive, and serial is set, every parallel_for called on this
+     * thread runs the whole loop on it, for threads that are already one
+     * of enough busy workers, such as those of a batch.
+     */
+    class SerialScope
+    {
+        bool previous;
+
+    public:
+        explicit SerialScope(bool serial = true);
+        ~SerialScope();
+
+        SerialScope(const SerialScope &) = delete;
+        SerialScope &operator=(const SerialScope &) = delete;
+    };
+};
+
+/**
+ * A pool for many independent tasks of uneven size, such as whole
+ * images of a batch.
+ *
+ * Every worker has its own deques. Tasks submitted from outside the pool
+ * are dealt out to them in turn and run oldest first, so a batch comes
+ * out roughly in the order it went in. Tasks a worker submits itself go
+ * on its local deque and it takes the newest of those first, so
+ * follow-up work stays on a warm cache. An idle worker steals the oldest
+ * task of another, outside tasks before local ones.
+ */
+class WorkStealingPool
+{
+public:
+    /**
+     * a task is told the index of the worker running it, so it can use
+     * per-worker buffers without locking.
+     */
+    typedef std::function<void(unsigned worker)> Task;
+
+    /**
+     * @param threads number of workers.
+     */
+    explicit WorkStealingPool(unsigned threads = std::thread::hardware_concurrency());
+    ~WorkStealingPool();
+
+    WorkStealingPool(const WorkStealingPool &) = delete;
+    WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+    /**
+     * number of workers.
+     */
+    unsigned size() const;
+
+    /**
+     * queue a task. From a worker of this pool it goes on that worker's
+     * local deque, otherwise the workers' deques are filled in turn.
+     */
+    void submit(Task task);
+
+    /**
+     * block until every submitted task has finished.
+     *
+     * @throws the first exception a task threw since the last wait().
+     */
+    void wait();
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks; // submitted from outside, oldest first
+        std::deque<Task> local; // submitted by the worker, newest first
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    size_t queued{0};
+    size_t unfinished{0};
+    unsigned next_queue{0};
+    bool stopping{false};
+    std::exception_ptr error;
+
+    void worker_loop(unsigned worker);
+
+    /**
+     * take the newest local task of the worker, then its oldest outside
+     * one, or steal the oldest task of another worker.
+     */
+    bool take(unsigned worker, Task &task);
+};
+
+#endif
@@ -0,0 +1,520 @@
+#include "tilecache.h"
+#include "threadpool.h"
+#include "trace.h"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ull;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4Full;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ull;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ull;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ull;
+
+static inline uint64_t rotl64(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t read64(const uint8_t *p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t xxhRound(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    return rotl64(acc, 31) * PRIME64_1;
+}
+
+static inline uint64_t xxhMerge(uint64_t acc, uint64_t value)
+{
+    acc ^= xxhRound(0, value);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+/**
+ * XXH64: four independent lanes over 32 byte stripes, then the tail.
+ */
+uint64_t hashBytes(const void *data, size_t size, uint64_t seed)
+{
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    const uint8_t *end = p + size;
+    uint64_t h;
+    if (size >= 32)
+    {
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+        for (; p + 32 <= end; p += 32)
+        {
+            v1 = xxhRound(v1, read64(p));
+            v2 = xxhRound(v2, read64(p + 8));
+            v3 = xxhRound(v3, read64(p + 16));
+            v4 = xxhRound(v4, read64(p + 24));
+        }
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxhMerge(h, v1);
+        h = xxhMerge(h, v2);
+        h = xxhMerge(h, v3);
+        h = xxhMerge(h, v4);
+    }
+    else
+    {
+        h = seed + PRIME64_5;
+    }
+
+    h += size;
+    for (; p + 8 <= end; p += 8)
+    {
+        h ^= xxhRound(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (p + 4 <= end)
+    {
+        h ^= read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++)
+    {
+        h ^= *p * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+// what a key was made for, so an image and a tile never share one.
+static const uint32_t IMAGE_KEY = 1;
+static const uint32_t TILE_KEY = 2;
+
+/**
+ * what a result depends on besides the pixels.
+ */
+struct KeyHeader
+{
+    uint32_t kind;
+    uint32_t bpp;
+    uint64_t chain;
+    uint32_t width;  // of the image or the tile window
+    uint32_t height;
+    uint32_t tile_x; // tile inside the window; 0 for an image
+    uint32_t tile_y;
+    uint32_t tile_width;
+    uint32_t tile_height;
+};
+
+/**
+ * hash the header, then the rows of the rectangle of view, row by row.
+ */
+static uint64_t hashKey(const KeyHeader &header, BitmapView view, const TileRect &area)
+{
+    uint64_t h = hashBytes(&header, sizeof(header));
+    for (uint32_t y = 0; y < area.height; y++)
+    {
+        h = hashBytes(view.row(area.y + y) + static_cast<size_t>(area.x) * view.bpp,
+                      static_cast<size_t>(area.width) * view.bpp, h);
+    }
+    return h;
+}
+
+/**
+ * the rows of a rectangle of view, packed.
+ */
+static PixelVector copyRect(BitmapView view, const TileRect &area)
+{
+    const size_t bytes = static_cast<size_t>(area.width) * view.bpp;
+    PixelVector pixels(bytes * area.height);
+    for (uint32_t y = 0; y < area.height; y++)
+    {
+        memcpy(pixels.data() + bytes * y, view.row(area.y + y) + static_cast<size_t>(area.x) * view.bpp, bytes);
+    }
+    return pixels;
+}
+
+// the header of an entry file.
+struct EntryFileHeader
+{
+    uint32_t magic;
+    int32_t width;
+    int32_t height;
+    uint32_t bpp;
+    uint64_t key;
+    uint64_t size;
+};
+static const uint32_t ENTRY_MAGIC = 0x31455443; // "CTE1"
+
+TileCache::TileCache(size_t memory_bytes, const std::string &directory, size_t disk_bytes, uint32_t tile_size)
+    : memory_limit(memory_bytes), directory(directory), disk_limit(disk_bytes), tile_size(tile_size)
+{
+    if (tile_size == 0)
+    {
+        throw std::runtime_error("The tile size must be positive");
+    }
+    if (directory.empty())
+    {
+        return;
+    }
+
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    if (error)
+    {
+        throw std::runtime_error("Unable to create the cache directory " + directory);
+    }
+
+    // pick up the entries of earlier runs, oldest last.
+    std::vector<std::pair<std::filesystem::file_time_type, uint64_t>> found;
+    for (const std::filesystem::directory_entry &file : std::filesystem::directory_iterator(directory, error))
+    {
+        const std::string name = file.path().filename().string();
+        if (name.size() != 21 || name.compare(16, 5, ".tile") != 0 || name.find_first_not_of("0123456789abcdef") != 16)
+        {
+            continue;
+        }
+        const uint64_t key = std::stoull(name.substr(0, 16), nullptr, 16);
+        const size_t size = static_cast<size_t>(file.file_size(error));
+        if (!error && disk_index.find(key) == disk_index.end())
+        {
+            found.push_back({file.last_write_time(error), key});
+            disk_index[key] = {disk_entries.end(), size};
+        }
+    }
+    std::sort(found.begin(), found.end(), [](const std::pair<std::filesystem::file_time_type, uint64_t> &a,
+                                             const std::pair<std::filesystem::file_time_type, uint64_t> &b) {
+        return a.first > b.first;
+    });
+    for (const std::pair<std::filesystem::file_time_type, uint64_t> &entry : found)
+    {
+        disk_entries.push_back(entry.second);
+        disk_index[entry.second].first = std::prev(disk_entries.end());
+        counters.disk_bytes += disk_index[entry.second].second;
+    }
+}
+
+TileCache::~TileCache()
+{
+    if (directory.empty())
+    {
+        return;
+    }
+    // least recently used first, so the disk budget keeps the newest.
+    for (EntryList::reverse_iterator entry = entries.rbegin(); entry != entries.rend(); ++entry)
+    {
+        spill(*entry);
+    }
+}
+
+/**
+ * Apply the chain to b through the cache: the whole result if this image
+ * was seen before, otherwise tile by tile for chains that run on tiles,
+ * and the whole chain for the rest. The result is then kept as well.
+ */
+void TileCache::run(const FilterChain &chain, Bitmap &b, uint32_t band_rows)
+{
+    TRACE_SCOPE("tile cache", b.pixel_bytes());
+    const std::string signature = chain.signature();
+    if (signature.empty() || b.bmp_info_header.width <= 0 || b.bmp_info_header.height <= 0)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            counters.uncached++;
+        }
+        chain.run(b, band_rows);
+        return;
+    }
+
+    const uint64_t chain_hash = hashBytes(signature.data(), signature.size());
+    const BitmapView src = b.view();
+    const TileRect image{0, 0, src.width, src.height};
+    const uint64_t image_key = hashKey(KeyHeader{IMAGE_KEY, src.bpp, chain_hash, src.width, src.height, 0, 0, 0, 0}, src, image);
+    if (find(image_key, false, [&b](const Entry &entry) {
+            b.reshape(entry.width, entry.height);
+            memcpy(b.pixels(), entry.pixels.data(), entry.pixels.size());
+        }))
+    {
+        return;
+    }
+
+    const TilePlan plan(chain);
+    if (!plan.tiled)
+    {
+        chain.run(b, band_rows);
+    }
+    else
+    {
+        Bitmap result = TilePlan::scratch(b);
+        result.reshape(src.width, src.height);
+        const BitmapView dst = result.view();
+        const uint32_t across = (src.width + tile_size - 1) / tile_size;
+        const uint32_t down = (src.height + tile_size - 1) / tile_size;
+
+        ThreadPool::shared().parallel_for(0, across * down, [&](uint32_t first, uint32_t last) {
+            Bitmap scratch = TilePlan::scratch(b);
+            for (uint32_t i = first; i < last; i++)
+            {
+                TileRect tile;
+                tile.x = i % across * tile_size;
+                tile.y = i / across * tile_size;
+                tile.width = std::min(tile_size, src.width - tile.x);
+                tile.height = std::min(tile_size, src.height - tile.y);
+                const TileRect window = plan.window(tile, src.width, src.height);
+                const uint64_t key = hashKey(KeyHeader{TILE_KEY, src.bpp, chain_hash, window.width, window.height,
+                                                       tile.x - window.x, tile.y - window.y, tile.width, tile.height},
+                                             src, window);
+
+                const bool hit = find(key, true, [&](const Entry &entry) {
+                    const size_t bytes = static_cast<size_t>(tile.width) * dst.bpp;
+                    for (uint32_t y = 0; y < tile.height; y++)
+                    {
+                        memcpy(dst.row(tile.y + y) + static_cast<size_t>(tile.x) * dst.bpp, entry.pixels.data() + bytes * y, bytes);
+                    }
+                });
+                if (!hit)
+                {
+                    plan.filter(src, tile, scratch, dst);
+                    insert(Entry{key, static_cast<int32_t>(tile.width), static_cast<int32_t>(tile.height), dst.bpp, copyRect(dst, tile)});
+                }
+            }
+        }, 1);
+        b.reshape(src.width, src.height, result.data);
+    }
+
+    const BitmapView out = b.view();
+    insert(Entry{image_key, static_cast<int32_t>(out.width), static_cast<int32_t>(out.height), out.bpp,
+                 copyRect(out, TileRect{0, 0, out.width, out.height})});
+}
+
+TileCache::Stats TileCache::stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
+
+/**
+ * drop every entry, in memory and on disk.
+ */
+void TileCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+    index.clear();
+    counters.memory_bytes = 0;
+    for (uint64_t key : disk_entries)
+    {
+        remove(path(key).c_str());
+    }
+    disk_entries.clear();
+    disk_index.clear();
+    counters.disk_bytes = 0;
+}
+
+/**
+ * Look the key up in memory, then on disk, and hand the entry to use.
+ * Entries read from disk move back into memory.
+ */
+bool TileCache::find(uint64_t key, bool tile, const std::function<void(const Entry &)> &use)
+{
+    uint64_t &hits = tile ? counters.tile_hits : counters.image_hits;
+    uint64_t &misses = tile ? counters.tile_misses : counters.image_misses;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::unordered_map<uint64_t, EntryList::iterator>::iterator found = index.find(key);
+        if (found != index.end())
+        {
+            entries.splice(entries.begin(), entries, found->second);
+            use(*found->second);
+            hits++;
+            return true;
+        }
+        if (disk_index.find(key) == disk_index.end())
+        {
+            misses++;
+            return false;
+        }
+    }
+
+    Entry entry;
+    const bool loaded = load(key, entry);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!loaded)
+        {
+            misses++;
+            return false;
+        }
+        hits++;
+        counters.disk_hits++;
+    }
+    use(entry);
+    insert(std::move(entry));
+    return true;
+}
+
+/**
+ * Keep the entry in memory, most recently used, and push the least
+ * recently used ones out to disk while over the budget. Entries larger
+ * than the whole budget go straight to disk.
+ */
+void TileCache::insert(Entry &&entry)
+{
+    std::vector<Entry> evicted;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::unordered_map<uint64_t, EntryList::iterator>::iterator found = index.find(entry.key);
+        if (found != index.end())
+        {
+            entries.splice(entries.begin(), entries, found->second);
+            return;
+        }
+        if (entry.pixels.size() > memory_limit)
+        {
+            evicted.push_back(std::move(entry));
+        }
+        else
+        {
+            entries.push_front(std::move(entry));
+            index[entries.front().key] = entries.begin();
+            counters.memory_bytes += entries.front().pixels.size();
+        }
+        while (counters.memory_bytes > memory_limit)
+        {
+            Entry &last = entries.back();
+            counters.memory_bytes -= last.pixels.size();
+            counters.evictions++;
+            index.erase(last.key);
+            evicted.push_back(std::move(last));
+            entries.pop_back();
+        }
+    }
+    if (!directory.empty())
+    {
+        for (Entry &old : evicted)
+        {
+            spill(old);
+        }
+    }
+}
+
+/**
+ * Write an entry pushed out of memory to its file, unless it is there
+ * already, and remove the least recently used files while over the
+ * disk budget. The file is written under a temporary name and renamed,
+ * so a reader never sees half of it.
+ */
+void TileCache::spill(Entry &entry)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::unordered_map<uint64_t, std::pair<std::list<uint64_t>::iterator, size_t>>::iterator found = disk_index.find(entry.key);
+        if (found != disk_index.end())
+        {
+            disk_entries.splice(disk_entries.begin(), disk_entries, found->second.first);
+            return;
+        }
+    }
+
+    const std::string file = path(entry.key);
+    const std::string temporary = file + "." + std::to_string(getpid()) + "." + std::to_string(reinterpret_cast<uintptr_t>(&entry));
+    {
+        std::ofstream out(temporary, std::ios_base::binary);
+        const EntryFileHeader header{ENTRY_MAGIC, entry.width, entry.height, entry.bpp, entry.key, entry.pixels.size()};
+        out.write((const char *)&header, sizeof(header));
+        out.write((const char *)entry.pixels.data(), entry.pixels.size());
+        if (!out)
+        {
+            out.close();
+            remove(temporary.c_str());
+            return;
+        }
+    }
+    if (rename(temporary.c_str(), file.c_str()) != 0)
+    {
+        remove(temporary.c_str());
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (disk_index.find(entry.key) != disk_index.end())
+    {
+        return;
+    }
+    const size_t size = sizeof(EntryFileHeader) + entry.pixels.size();
+    disk_entries.push_front(entry.key);
+    disk_index[entry.key] = {disk_entries.begin(), size};
+    counters.disk_bytes += size;
+    while (counters.disk_bytes > disk_limit && !disk_entries.empty())
+    {
+        const uint64_t last = disk_entries.back();
+        counters.disk_bytes -= disk_index[last].second;
+        disk_index.erase(last);
+        disk_entries.pop_back();
+        remove(path(last).c_str());
+    }
+}
+
+/**
+ * read an entry file back. A missing, short or foreign file is a miss,
+ * and is forgotten.
+ */
+bool TileCache::load(uint64_t key, Entry &found)
+{
+    std::ifstream in(path(key), std::ios_base::binary);
+    EntryFileHeader header{};
+    in.read((char *)&header, sizeof(header));
+    bool ok = in && header.magic == ENTRY_MAGIC && header.key == key && header.width > 0 && header.height > 0 &&
+              header.size == static_cast<uint64_t>(header.width) * header.height * header.bpp;
+    if (ok)
+    {
+        found.key = key;
+        found.width = header.width;
+        found.height = header.height;
+        found.bpp = header.bpp;
+        found.pixels.resize(header.size);
+        in.read((char *)found.pixels.data(), header.size);
+        ok = static_cast<uint64_t>(in.gcount()) == header.size;
+    }
+    if (!ok)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::unordered_map<uint64_t, std::pair<std::list<uint64_t>::iterator, size_t>>::iterator stale = disk_index.find(key);
+        if (stale != disk_index.end())
+        {
+            counters.disk_bytes -= stale->second.second;
+            disk_entries.erase(stale->second.first);
+            disk_index.erase(stale);
+        }
+    }
+    return ok;
+}
+
+/**
+ * the file of an entry: its key in hex.
+ */
+std::string TileCache::path(uint64_t key) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.tile", (unsigned long long)key);
+    return directory + name;
+}
@@ -0,0 +1,118 @@
+#ifndef TILECACHE_H
+#define TILECACHE_H
+
+#include "bitmap.h"
+#include "editsession.h"
+#include <stdint.h>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/**
+ * 64 bit XXH64 hash of size bytes, continuing from seed.
+ */
+uint64_t hashBytes(const void *data, size_t size, uint64_t seed = 0);
+
+/**
+ * Memoizes what filter chains make of images, so repeated work is
+ * skipped.
+ *
+ * Results are keyed by a hash of the chain signature, the image size and
+ * format, and the pixels. An image seen before with the same chain comes
+ * straight from the cache. Otherwise chains that can run on tiles are
+ * run tile by tile, and each tile is keyed by the pixels of the window
+ * it is filtered in, so only the tiles of an image that changed are
+ * recomputed, wherever they sit.
+ *
+ * Entries live in memory up to a byte budget, least recently used first
+ * out. With a directory given, entries pushed out of memory are kept
+ * there as files up to a second budget, and found again by later runs.
+ *
+ * One cache may be shared by threads filtering different images.
+ */
+class TileCache
+{
+public:
+    struct Stats
+    {
+        uint64_t image_hits{0};
+        uint64_t image_misses{0};
+        uint64_t tile_hits{0};
+        uint64_t tile_misses{0};
+        uint64_t disk_hits{0};      // hits, of either kind, read back from the directory
+        uint64_t uncached{0};       // runs of chains without a signature, passed straight through
+        uint64_t evictions{0};      // entries pushed out of memory
+        uint64_t memory_bytes{0};
+        uint64_t disk_bytes{0};
+    };
+
+    /**
+     * @param memory_bytes pixel bytes kept in memory.
+     * @param directory where entries pushed out of memory go, "" for none.
+     * It is created if missing.
+     * @param disk_bytes pixel bytes kept in the directory.
+     * @param tile_size width and height of the tiles, in pixels.
+     *
+     * @throws runtime_error if tile_size is 0 or the directory can not be created.
+     */
+    explicit TileCache(size_t memory_bytes = 256u << 20, const std::string &directory = "",
+                       size_t disk_bytes = size_t(1) << 30, uint32_t tile_size = 256);
+
+    /**
+     * writes the entries still in memory to the directory, if any, for
+     * later runs.
+     */
+    ~TileCache();
+
+    TileCache(const TileCache &) = delete;
+    TileCache &operator=(const TileCache &) = delete;
+
+    /**
+     * apply the chain to the bitmap, reusing earlier results where it can.
+     * Chains with an empty signature() just run.
+     *
+     * @param band_rows as for FilterChain::run.
+     */
+    void run(const FilterChain &chain, Bitmap &b, uint32_t band_rows = 0);
+
+    Stats stats() const;
+
+    /**
+     * drop every entry, in memory and on disk.
+     */
+    void clear();
+
+private:
+    struct Entry
+    {
+        uint64_t key;
+        int32_t width;
+        int32_t height;
+        uint32_t bpp;
+        PixelVector pixels;
+    };
+    typedef std::list<Entry> EntryList;
+
+    mutable std::mutex mutex;
+    EntryList entries; // most recently used first
+    std::unordered_map<uint64_t, EntryList::iterator> index;
+    size_t memory_limit;
+
+    std::string directory;
+    std::list<uint64_t> disk_entries; // most recently used first
+    std::unordered_map<uint64_t, std::pair<std::list<uint64_t>::iterator, size_t>> disk_index;
+    size_t disk_limit;
+
+    uint32_t tile_size;
+    Stats counters;
+
+    bool find(uint64_t key, bool tile, const std::function<void(const Entry &)> &use);
+    void insert(Entry &&entry);
+    void spill(Entry &entry);
+    bool load(uint64_t key, Entry &found);
+    std::string path(uint64_t key) const;
+};
+
+#endif
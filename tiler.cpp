@@ -0,0 +1,115 @@
+#include "tiler.h"
+#include "threadpool.h"
+#include "trace.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <stdlib.h>
+#include <stdio.h>
+
+typedef std::chrono::steady_clock TilerClock;
+
+static double secondsSince(TilerClock::time_point start)
+{
+    return std::chrono::duration<double>(TilerClock::now() - start).count();
+}
+
+/**
+ * write the tiles of one level, a band of tile rows at a time from the
+ * top, the tiles of a band in parallel.
+ */
+static void tileLevel(const Bitmap &b, BitmapView view, const std::string &directory, uint32_t tile_size,
+                      TilerReport &report)
+{
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    if (error)
+    {
+        throw std::runtime_error("Unable to create the tile directory " + directory + ": " + error.message());
+    }
+
+    const uint32_t across = (view.width + tile_size - 1) / tile_size;
+    const uint32_t down = (view.height + tile_size - 1) / tile_size;
+    std::atomic<uint64_t> bytes{0};
+    for (uint32_t row = 0; row < down; row++)
+    {
+        // rows of the view are bottom-up, tile rows top-down.
+        const uint32_t top = view.height - row * tile_size;
+        const uint32_t height = std::min(tile_size, top);
+        const BitmapView band = view.crop(0, top - height, view.width, height);
+        TRACE_SCOPE("tile band", band.height * static_cast<uint64_t>(band.width) * band.bpp);
+        ThreadPool::shared().parallel_for(0, across, [&](uint32_t first, uint32_t last) {
+            for (uint32_t column = first; column < last; column++)
+            {
+                const uint32_t x = column * tile_size;
+                const std::string path = directory + "/" + std::to_string(column) + "_" + std::to_string(row) + ".bmp";
+                bytes += b.save_view(path, band.crop(x, 0, std::min(tile_size, band.width - x), height));
+            }
+        }, 1);
+    }
+    report.tiles += static_cast<uint64_t>(across) * down;
+    report.bytes += bytes;
+    report.levels++;
+}
+
+TilerReport writeTiles(Bitmap &b, const std::string &prefix, uint32_t tile_size, bool pyramid)
+{
+    if (tile_size == 0)
+    {
+        throw std::runtime_error("The tile size must be positive");
+    }
+    if (b.bmp_info_header.bit_count != 24 && b.bmp_info_header.bit_count != 32)
+    {
+        throw std::runtime_error("Only 24 and 32 bits per pixel images can be tiled");
+    }
+    TRACE_SCOPE("tiles", b.pixel_bytes());
+
+    TilerReport report;
+    Pyramid levels;
+    if (pyramid)
+    {
+        TilerClock::time_point start = TilerClock::now();
+        levels = buildPyramid(b);
+        report.pyramid_seconds = secondsSince(start);
+    }
+
+    // Deep Zoom numbers levels from 1x1 up, the image itself last.
+    TilerClock::time_point start = TilerClock::now();
+    const uint32_t top = static_cast<uint32_t>(levels.levels.size());
+    const std::string files = prefix + "_files/";
+    tileLevel(b, b.view(), files + std::to_string(top), tile_size, report);
+    for (uint32_t i = 0; i < top; i++)
+    {
+        tileLevel(b, levels.level(i), files + std::to_string(top - 1 - i), tile_size, report);
+    }
+
+    if (pyramid)
+    {
+        std::ofstream dzi(prefix + ".dzi");
+        dzi << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+            << "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" TileSize=\"" << tile_size
+            << "\" Overlap=\"0\" Format=\"bmp\">\n"
+            << "  <Size Width=\"" << b.bmp_info_header.width << "\" Height=\"" << std::abs(b.bmp_info_header.height)
+            << "\"/>\n"
+            << "</Image>\n";
+        if (!dzi)
+        {
+            throw std::runtime_error("Unable to write " + prefix + ".dzi");
+        }
+    }
+    report.write_seconds = secondsSince(start);
+    return report;
+}
+
+void TilerReport::print(std::ostream &out) const
+{
+    char line[256];
+    const double seconds = write_seconds > 0 ? write_seconds : 1e-9;
+    snprintf(line, sizeof(line), "%u levels, %llu tiles, %.1f MB: pyramid %.2f ms, write %.2f ms, %.1f MB/s\n",
+             levels, static_cast<unsigned long long>(tiles), bytes / 1e6, pyramid_seconds * 1e3,
+             write_seconds * 1e3, bytes / seconds / 1e6);
+    out << line;
+}
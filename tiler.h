@@ -0,0 +1,43 @@
+#ifndef TILER_H
+#define TILER_H
+
+#include "bitmap.h"
+#include <stdint.h>
+#include <iostream>
+#include <string>
+
+/**
+ * what writeTiles() wrote. Times are in seconds.
+ */
+struct TilerReport
+{
+    uint32_t levels{0};   // levels written
+    uint64_t tiles{0};
+    uint64_t bytes{0};    // total size of the tile files
+    double pyramid_seconds{0};
+    double write_seconds{0};
+
+    void print(std::ostream &out) const;
+};
+
+/**
+ * Cut an image into square BMP tiles in the Deep Zoom layout: the tile
+ * in column c and row r of level l, counted from the top left, goes to
+ * prefix_files/l/c_r.bmp. Level 0 is 1x1 and the image itself is the
+ * last level; tiles on the right and bottom edges are cut short.
+ *
+ * The image is walked top to bottom in bands of tile_size rows, and the
+ * tiles of a band are written in parallel, each with one writev straight
+ * from the rows of the band, so every row is read once and while its
+ * neighbours are in cache.
+ *
+ * With pyramid, the reduced levels come from buildPyramid() and are
+ * tiled the same way, and prefix.dzi describes the whole set for Deep
+ * Zoom viewers. Without it only the last level is written.
+ *
+ * @throws runtime_error if tile_size is 0, the image is not 24 or 32
+ * bits per pixel, or a directory or tile can not be written.
+ */
+TilerReport writeTiles(Bitmap &b, const std::string &prefix, uint32_t tile_size = 256, bool pyramid = false);
+
+#endif
@@ -0,0 +1,212 @@
+#include "trace.h"
+#include "bufferpool.h"
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+
+std::atomic<bool> Trace::active{false};
+
+/**
+ * the events of one thread. Only that thread appends to them; the lock
+ * is taken against readers.
+ */
+struct ThreadEvents
+{
+    unsigned thread;
+    std::mutex mutex;
+    std::vector<TraceEvent> events;
+};
+
+// every thread that has recorded an event; never shrinks, so pointers stay valid.
+static std::mutex registry_mutex;
+static std::vector<std::unique_ptr<ThreadEvents>> registry;
+
+static int64_t nowNs()
+{
+    static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+static ThreadEvents &threadEvents()
+{
+    static thread_local ThreadEvents *local = nullptr;
+    if (!local)
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        registry.emplace_back(new ThreadEvents());
+        local = registry.back().get();
+        local->thread = static_cast<unsigned>(registry.size() - 1);
+    }
+    return *local;
+}
+
+/**
+ * start or stop recording events.
+ */
+void Trace::enable(bool on)
+{
+    // fix the epoch before the first event.
+    nowNs();
+    active.store(on, std::memory_order_relaxed);
+}
+
+void Trace::clear()
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (std::unique_ptr<ThreadEvents> &thread : registry)
+    {
+        std::lock_guard<std::mutex> events_lock(thread->mutex);
+        thread->events.clear();
+    }
+}
+
+std::vector<TraceEvent> Trace::events()
+{
+    std::vector<TraceEvent> all;
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        for (std::unique_ptr<ThreadEvents> &thread : registry)
+        {
+            std::lock_guard<std::mutex> events_lock(thread->mutex);
+            all.insert(all.end(), thread->events.begin(), thread->events.end());
+        }
+    }
+    std::sort(all.begin(), all.end(), [](const TraceEvent &a, const TraceEvent &b) {
+        return a.start_ns < b.start_ns || (a.start_ns == b.start_ns && a.duration_ns > b.duration_ns);
+    });
+    return all;
+}
+
+static std::string escapeJson(const char *text)
+{
+    std::string escaped;
+    for (; *text; text++)
+    {
+        if (*text == '"' || *text == '\\')
+        {
+            escaped += '\\';
+        }
+        if (static_cast<unsigned char>(*text) >= 0x20)
+        {
+            escaped += *text;
+        }
+    }
+    return escaped;
+}
+
+/**
+ * write the events as Chrome trace-event JSON.
+ */
+void Trace::write_chrome_trace(std::ostream &out)
+{
+    const std::vector<TraceEvent> all = events();
+    char line[256];
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    for (size_t i = 0; i < all.size(); i++)
+    {
+        const TraceEvent &event = all[i];
+        snprintf(line, sizeof(line),
+                 "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, "
+                 "\"args\": {\"bytes\": %llu, \"allocations\": %llu}}%s\n",
+                 escapeJson(event.name).c_str(), event.thread, event.start_ns / 1e3, event.duration_ns / 1e3,
+                 (unsigned long long)event.bytes, (unsigned long long)event.allocations,
+                 i + 1 < all.size() ? "," : "");
+        out << line;
+    }
+    out << "]}\n";
+}
+
+/**
+ * print totals per scope name, then per thread.
+ */
+void Trace::print_summary(std::ostream &out)
+{
+    struct Total
+    {
+        uint64_t calls{0};
+        int64_t total_ns{0};
+        int64_t max_ns{0};
+        uint64_t bytes{0};
+        uint64_t allocations{0};
+    };
+    struct ThreadTotal
+    {
+        uint64_t events{0};
+        int64_t traced_ns{0};
+        int64_t covered_until{0};
+    };
+
+    const std::vector<TraceEvent> all = events();
+    std::map<std::string, Total> names;
+    std::map<unsigned, ThreadTotal> threads;
+    for (const TraceEvent &event : all)
+    {
+        Total &total = names[event.name];
+        total.calls++;
+        total.total_ns += event.duration_ns;
+        total.max_ns = std::max(total.max_ns, event.duration_ns);
+        total.bytes += event.bytes;
+        total.allocations += event.allocations;
+
+        // events come by start time, so one inside another adds nothing.
+        ThreadTotal &thread = threads[event.thread];
+        thread.events++;
+        const int64_t end = event.start_ns + event.duration_ns;
+        if (end > thread.covered_until)
+        {
+            thread.traced_ns += end - std::max(event.start_ns, thread.covered_until);
+            thread.covered_until = end;
+        }
+    }
+
+    char line[256];
+    snprintf(line, sizeof(line), "%-28s %8s %12s %10s %10s %10s %8s\n",
+             "scope", "calls", "total ms", "mean ms", "max ms", "MB/s", "allocs");
+    out << line;
+    for (const std::pair<const std::string, Total> &entry : names)
+    {
+        const Total &total = entry.second;
+        const double seconds = total.total_ns / 1e9;
+        snprintf(line, sizeof(line), "%-28s %8llu %12.3f %10.3f %10.3f %10.1f %8llu\n",
+                 entry.first.c_str(), (unsigned long long)total.calls, total.total_ns / 1e6,
+                 total.total_ns / 1e6 / total.calls, total.max_ns / 1e6,
+                 seconds > 0 ? total.bytes / seconds / 1e6 : 0.0, (unsigned long long)total.allocations);
+        out << line;
+    }
+
+    snprintf(line, sizeof(line), "\n%-8s %8s %12s\n", "thread", "events", "traced ms");
+    out << line;
+    for (const std::pair<const unsigned, ThreadTotal> &entry : threads)
+    {
+        snprintf(line, sizeof(line), "%-8u %8llu %12.3f\n", entry.first,
+                 (unsigned long long)entry.second.events, entry.second.traced_ns / 1e6);
+        out << line;
+    }
+}
+
+void TraceScope::begin(const char *name, uint64_t bytes)
+{
+    recording = true;
+    const size_t length = std::min(strlen(name), sizeof(event.name) - 1);
+    memcpy(event.name, name, length);
+    event.name[length] = '\0';
+    event.bytes = bytes;
+    event.allocations = BufferPool::thread_acquires();
+    event.start_ns = nowNs();
+}
+
+void TraceScope::end()
+{
+    event.duration_ns = nowNs() - event.start_ns;
+    event.allocations = BufferPool::thread_acquires() - event.allocations;
+
+    ThreadEvents &thread = threadEvents();
+    event.thread = thread.thread;
+    std::lock_guard<std::mutex> lock(thread.mutex);
+    thread.events.push_back(event);
+}
@@ -0,0 +1,129 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <atomic>
+#include <iostream>
+#include <vector>
+
+/**
+ * Opt-in profiling of reads, writes and filters.
+ *
+ * TRACE_SCOPE(name, bytes) times the rest of the enclosing block as one
+ * event, with the bytes it processed and the buffer pool blocks the
+ * thread took meanwhile. Events are kept per thread, so recording takes
+ * no shared lock, and can be exported as Chrome trace-event JSON (open
+ * it in chrome://tracing or Perfetto) or summed up in a table.
+ *
+ * Tracing is off until Trace::enable(); until then a scope costs one
+ * relaxed load and a branch. Building with -DBITMAP_NO_TRACE compiles
+ * the scopes out altogether.
+ */
+
+/**
+ * one timed scope.
+ */
+struct TraceEvent
+{
+    char name[40];
+    unsigned thread;       // small index of the thread, in order of first event
+    int64_t start_ns;      // since tracing was first enabled
+    int64_t duration_ns;
+    uint64_t bytes;        // bytes the scope processed, 0 if not known
+    uint64_t allocations;  // buffer pool blocks the thread acquired in the scope
+};
+
+class Trace
+{
+public:
+    /**
+     * start or stop recording events.
+     */
+    static void enable(bool on = true);
+
+    static bool enabled()
+    {
+        return active.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * drop the recorded events.
+     */
+    static void clear();
+
+    /**
+     * the events of all threads, by start time.
+     */
+    static std::vector<TraceEvent> events();
+
+    /**
+     * write the events as Chrome trace-event JSON, one complete ("X")
+     * event per scope, with bytes and allocations as arguments.
+     */
+    static void write_chrome_trace(std::ostream &out);
+
+    /**
+     * print calls, total, mean and max time, throughput and allocations
+     * per scope name, then the traced time and events of each thread.
+     */
+    static void print_summary(std::ostream &out);
+
+private:
+    static std::atomic<bool> active;
+};
+
+/**
+ * Records the time from its construction to its destruction as an
+ * event, if tracing was enabled when it was constructed.
+ */
+class TraceScope
+{
+public:
+    /**
+     * @param name copied into the event; at most 39 characters are kept.
+     * @param bytes bytes the scope processes, if known up front.
+     */
+    TraceScope(const char *name, uint64_t bytes = 0)
+    {
+        if (Trace::enabled())
+        {
+            begin(name, bytes);
+        }
+    }
+
+    ~TraceScope()
+    {
+        if (recording)
+        {
+            end();
+        }
+    }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+    /**
+     * set the bytes processed, once they are known.
+     */
+    void set_bytes(uint64_t count)
+    {
+        event.bytes = count;
+    }
+
+private:
+    bool recording{false};
+    TraceEvent event;
+
+    void begin(const char *name, uint64_t bytes);
+    void end();
+};
+
+#ifdef BITMAP_NO_TRACE
+#define TRACE_SCOPE(name, bytes)
+#define TRACE_BYTES(bytes)
+#else
+#define TRACE_SCOPE(name, bytes) TraceScope trace_scope(name, bytes)
+#define TRACE_BYTES(bytes) trace_scope.set_bytes(bytes)
+#endif
+
+#endif